@@ -0,0 +1,119 @@
+// microbenchmark for the sftp reply codec, no server needed
+//
+// build (posix):
+//   g++ -std=c++17 -O2 -I../minsftp -I../minsftp/include codec_bench.cpp ../minsftp/sftp_codec.cpp -o codec_bench
+// run:
+//   ./codec_bench [--entries 100] [--iters 100000]
+//
+// parses synthetic NAME replies the way SftpChannel does (arena reset per batch) and counts
+// heap allocations with a replaced global operator new. "parse" is the codec alone,
+// "parse+copy" also copies every name into a std::string, the cost the codec avoids
+// one json object per line, like minsftp_bench
+
+#include "sftp_codec.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+static size_t allocations = 0;
+
+void* operator new(size_t size) {
+	allocations++;
+	if (void* p = malloc(size ? size : 1)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept {
+	free(p);
+}
+void operator delete(void* p, size_t) noexcept {
+	free(p);
+}
+
+static void PutU32(std::vector<uint8_t>& out, uint32_t v) {
+	for (int i = 0; i < 4; i++) {
+		out.push_back((uint8_t)(v >> (24 - 8 * i)));
+	}
+}
+static void PutString(std::vector<uint8_t>& out, const std::string& s) {
+	PutU32(out, (uint32_t)s.size());
+	out.insert(out.end(), s.begin(), s.end());
+}
+
+// NAME reply as a server sends it for a readdir: name, ls -l style longname, full attrs
+static std::vector<uint8_t> NamePacket(size_t entries) {
+	std::vector<uint8_t> packet{ FXP_NAME };
+	PutU32(packet, 7);
+	PutU32(packet, (uint32_t)entries);
+	for (size_t i = 0; i < entries; i++) {
+		std::string name = "file_with_a_typical_length_" + std::to_string(i) + ".dat";
+		PutString(packet, name);
+		PutString(packet, "-rw-r--r--    1 user     group        4096 Jan  1 00:00 " + name);
+		PutU32(packet, LIBSSH2_SFTP_ATTR_SIZE | LIBSSH2_SFTP_ATTR_UIDGID | LIBSSH2_SFTP_ATTR_PERMISSIONS |
+			LIBSSH2_SFTP_ATTR_ACMODTIME);
+		PutU32(packet, 0);
+		PutU32(packet, 4096);
+		PutU32(packet, 1000);
+		PutU32(packet, 1000);
+		PutU32(packet, 0100644);
+		PutU32(packet, 1700000000);
+		PutU32(packet, 1700000000);
+	}
+	return packet;
+}
+
+static void Run(const char* bench, const std::vector<uint8_t>& packet, size_t entries, size_t iters, bool copy) {
+	SftpArena arena{};
+	std::vector<std::string> names{};
+	names.reserve(entries);
+	size_t checksum = 0;
+
+	// one warm up round so the arena has its block
+	uint32_t id;
+	sftp_reply reply{};
+	ParseReply(packet.data(), packet.size(), arena, id, reply);
+
+	size_t before = allocations;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < iters; i++) {
+		arena.Reset();
+		if (!ParseReply(packet.data(), packet.size(), arena, id, reply) || reply.names.size() != entries) {
+			fprintf(stderr, "parse failed\n");
+			exit(1);
+		}
+		for (const sftp_name& name : reply.names) {
+			if (copy) {
+				names.emplace_back(name.name);
+			}
+			checksum += name.name.size() + name.attrs.filesize;
+		}
+		names.clear();
+	}
+	double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	size_t allocs = allocations - before;
+
+	double total = (double)entries * iters;
+	printf("{\"bench\":\"%s\",\"entries\":%zu,\"iters\":%zu,\"allocs_per_entry\":%.3f,\"ns_per_entry\":%.2f,"
+		"\"arena_bytes\":%zu,\"checksum\":%zu}\n",
+		bench, entries, iters, allocs / total, ns / total, arena.Capacity(), checksum);
+}
+
+int main(int argc, char** argv) {
+	size_t entries = 100;
+	size_t iters = 100000;
+	for (int i = 1; i + 1 < argc; i += 2) {
+		std::string arg = argv[i];
+		if (arg == "--entries") entries = std::stoul(argv[i + 1]);
+		else if (arg == "--iters") iters = std::stoul(argv[i + 1]);
+	}
+
+	std::vector<uint8_t> packet = NamePacket(entries);
+	Run("parse", packet, entries, iters, false);
+	Run("parse+copy", packet, entries, iters, true);
+	return 0;
+}
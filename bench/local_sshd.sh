@@ -0,0 +1,34 @@
+#!/bin/sh
+# start a throwaway OpenSSH sshd on 127.0.0.1 for minsftp_bench
+# usage: local_sshd.sh [port]
+# stop it with: kill $(cat /tmp/minsftp_sshd/sshd.pid)
+set -e
+
+PORT=${1:-2222}
+DIR=${MINSFTP_SSHD_DIR:-/tmp/minsftp_sshd}
+SSHD=$(command -v sshd || echo /usr/sbin/sshd)
+
+mkdir -p "$DIR"
+[ -f "$DIR/host_key" ] || ssh-keygen -q -t ed25519 -N '' -f "$DIR/host_key"
+# pem rsa key, readable by every libssh2 crypto backend
+[ -f "$DIR/client_key" ] || ssh-keygen -q -t rsa -b 3072 -m PEM -N '' -f "$DIR/client_key"
+cp "$DIR/client_key.pub" "$DIR/authorized_keys"
+
+cat > "$DIR/sshd_config" <<CONF
+Port $PORT
+ListenAddress 127.0.0.1
+HostKey $DIR/host_key
+PidFile $DIR/sshd.pid
+AuthorizedKeysFile $DIR/authorized_keys
+PubkeyAuthentication yes
+PasswordAuthentication no
+KbdInteractiveAuthentication no
+UsePAM no
+StrictModes no
+Subsystem sftp internal-sftp
+CONF
+
+"$SSHD" -f "$DIR/sshd_config" -E "$DIR/sshd.log"
+
+echo "target: $(id -un)@127.0.0.1:$PORT"
+echo "key:    $DIR/client_key"
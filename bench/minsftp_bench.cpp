@@ -0,0 +1,270 @@
+// throughput/latency benchmark for minsftp against a (local) sftp server
+//
+// build (posix):
+//   g++ -std=c++17 -O2 -I../minsftp -I../minsftp/include minsftp_bench.cpp ../minsftp/*.cpp -lssh2 -o minsftp_bench
+// run against the throwaway sshd from local_sshd.sh:
+//   ./minsftp_bench --target user@127.0.0.1:2222 --key /tmp/minsftp_sshd/client_key --rtts 0,20,80 --out results.jsonl
+//
+// rtts, jitter and bandwidth limits are injected in-process by the NetEm transport shim
+//
+// every measurement is printed as one json object per line, followed by the
+// per request metrics ("bench":"metrics") the session collected during the run
+
+#include "minsftp.h"
+#include "netem.h"
+
+#include <fstream>
+#include <numeric>
+#include <string>
+#include <vector>
+
+struct bench_options {
+	std::string target;
+	std::string keyPath;
+	std::string password;
+	std::string remoteDir{ "/tmp/minsftp_bench" };
+	std::vector<size_t> sizes{ 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+	std::vector<size_t> counts{ 10, 100, 1000 };
+	std::vector<size_t> chunks{ 4096, 32 * 1024, 256 * 1024 };
+	std::vector<size_t> rtts{ 0 };
+	uint32_t jitterMs{ 0 };
+	uint64_t bandwidthBps{ 0 };
+	double rttMs{ 0 }; // rtt of the current run
+	int iters{ 5 };
+	std::string outPath;
+};
+
+struct bench_row {
+	std::string bench;
+	size_t size{};
+	size_t count{};
+	size_t chunk{};
+	double rttMs{};
+	std::vector<double> samplesMs{};
+	size_t bytesPerIter{};
+	int failures{};
+};
+
+static std::vector<size_t> ParseSizeList(const std::string& list) {
+	std::vector<size_t> values{};
+	std::stringstream ss(list);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		if (item.empty()) {
+			continue;
+		}
+		size_t mult = 1;
+		char suffix = (char)toupper(item.back());
+		if (suffix == 'K') mult = 1024;
+		else if (suffix == 'M') mult = 1024 * 1024;
+		else if (suffix == 'G') mult = 1024 * 1024 * 1024;
+		if (mult != 1) {
+			item.pop_back();
+		}
+		values.push_back((size_t)std::stoull(item) * mult);
+	}
+	return values;
+}
+
+static double Percentile(std::vector<double> samples, double p) {
+	if (samples.empty()) {
+		return 0;
+	}
+	std::sort(samples.begin(), samples.end());
+	size_t idx = (size_t)(p / 100.0 * (samples.size() - 1) + 0.5);
+	return samples[std::min(idx, samples.size() - 1)];
+}
+
+static void EmitRow(std::ostream& out, const bench_row& row) {
+	double sum = std::accumulate(row.samplesMs.begin(), row.samplesMs.end(), 0.0);
+	double mean = row.samplesMs.empty() ? 0 : sum / row.samplesMs.size();
+	double mbps = mean > 0 ? (row.bytesPerIter / (1024.0 * 1024.0)) / (mean / 1000.0) : 0;
+
+	char line[512];
+	snprintf(line, sizeof(line),
+		"{\"bench\":\"%s\",\"size\":%zu,\"count\":%zu,\"chunk\":%zu,\"rtt_ms\":%.1f,\"iters\":%zu,\"failures\":%d,"
+		"\"mean_ms\":%.3f,\"min_ms\":%.3f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f,\"mb_per_s\":%.3f}",
+		row.bench.c_str(), row.size, row.count, row.chunk, row.rttMs, row.samplesMs.size(), row.failures,
+		mean, Percentile(row.samplesMs, 0), Percentile(row.samplesMs, 50), Percentile(row.samplesMs, 99),
+		Percentile(row.samplesMs, 100), mbps);
+	out << line << std::endl;
+}
+
+template <typename Fn>
+static double TimeMs(Fn fn, bool& ok) {
+	auto start = std::chrono::steady_clock::now();
+	ok = fn();
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void BenchReadWrite(minsftp& sftp, const bench_options& opt, std::ostream& out) {
+	for (size_t chunk : opt.chunks) {
+		sftp.SetChunkSize(chunk);
+		for (size_t size : opt.sizes) {
+			FILE_DATA data(size);
+			for (size_t i = 0; i < size; i++) {
+				data[i] = (uint8_t)(i * 31 + 7);
+			}
+			std::string path = opt.remoteDir + "/rw_" + std::to_string(size) + ".bin";
+
+			bench_row write{ "WriteBytes", size, 1, chunk, opt.rttMs };
+			bench_row read{ "ReadBytes", size, 1, chunk, opt.rttMs };
+			write.bytesPerIter = read.bytesPerIter = size;
+			for (int i = 0; i < opt.iters; i++) {
+				bool ok = false;
+				double ms = TimeMs([&] { return sftp.WriteBytes(path, data) == RES_OK; }, ok);
+				ok ? write.samplesMs.push_back(ms) : (void)write.failures++;
+
+				FILE_DATA readBack{};
+				ms = TimeMs([&] { return sftp.ReadBytes(path, readBack) == RES_OK && readBack.size() == size; }, ok);
+				ok ? read.samplesMs.push_back(ms) : (void)read.failures++;
+			}
+			sftp.SftpDeleteFile(path);
+			EmitRow(out, write);
+			EmitRow(out, read);
+		}
+	}
+	sftp.SetChunkSize(BUFFER_SIZE);
+}
+
+static void BenchTree(minsftp& sftp, const bench_options& opt, std::ostream& out) {
+	const size_t fileSize = 4096;
+	FILE_DATA data(fileSize, 'x');
+
+	for (size_t count : opt.counts) {
+		std::string tree = opt.remoteDir + "/tree_" + std::to_string(count);
+		sftp.SftpDeleteDir(tree);
+		if (sftp.SftpMakeDir(tree) != RES_OK) {
+			fprintf(stderr, "failed to create %s\n", tree.c_str());
+			continue;
+		}
+		// 16 files per sub directory so copy/delete also recurse
+		for (size_t i = 0; i < count; i++) {
+			std::string sub = tree + "/d" + std::to_string(i / 16);
+			if (i % 16 == 0) {
+				sftp.SftpMakeDir(sub);
+			}
+			sftp.WriteBytes(sub + "/f" + std::to_string(i), data);
+		}
+
+		bench_row list{ "ListDirectory", fileSize, count, 0, opt.rttMs };
+		bench_row copy{ "SftpCopyDir", fileSize, count, 0, opt.rttMs };
+		bench_row del{ "SftpDeleteDir", fileSize, count, 0, opt.rttMs };
+		copy.bytesPerIter = count * fileSize;
+		for (int i = 0; i < opt.iters; i++) {
+			bool ok = false;
+			double ms = TimeMs([&] { return !sftp.ListDirectory(tree).empty(); }, ok);
+			ok ? list.samplesMs.push_back(ms) : (void)list.failures++;
+
+			std::string copyPath = tree + "_copy";
+			ms = TimeMs([&] { return sftp.SftpCopyDir(tree, copyPath) == RES_OK; }, ok);
+			ok ? copy.samplesMs.push_back(ms) : (void)copy.failures++;
+
+			ms = TimeMs([&] { return sftp.SftpDeleteDir(copyPath) == RES_OK; }, ok);
+			ok ? del.samplesMs.push_back(ms) : (void)del.failures++;
+		}
+		sftp.SftpDeleteDir(tree);
+		EmitRow(out, list);
+		EmitRow(out, copy);
+		EmitRow(out, del);
+	}
+}
+
+static void Usage() {
+	fprintf(stderr,
+		"usage: minsftp_bench --target user@host:port (--key path | --password pw) [options]\n"
+		"  --dir path        remote scratch directory (default /tmp/minsftp_bench)\n"
+		"  --sizes list      file sizes for ReadBytes/WriteBytes, e.g. 1K,64K,1M\n"
+		"  --counts list     file counts for ListDirectory/SftpCopyDir/SftpDeleteDir\n"
+		"  --chunks list     chunk sizes for ReadBytes/WriteBytes\n"
+		"  --rtts list       rtts in ms injected with NetEm, one run each (default 0)\n"
+		"  --jitter-ms n     rtt jitter in ms\n"
+		"  --bandwidth n     link bandwidth in bytes/s per direction, e.g. 12M\n"
+		"  --iters n         iterations per measurement (default 5)\n"
+		"  --out path        append results to path instead of stdout\n");
+}
+
+int main(int argc, char** argv) {
+	bench_options opt{};
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (i + 1 >= argc) {
+			Usage();
+			return 1;
+		}
+		std::string val = argv[++i];
+		if (arg == "--target") opt.target = val;
+		else if (arg == "--key") opt.keyPath = val;
+		else if (arg == "--password") opt.password = val;
+		else if (arg == "--dir") opt.remoteDir = val;
+		else if (arg == "--sizes") opt.sizes = ParseSizeList(val);
+		else if (arg == "--counts") opt.counts = ParseSizeList(val);
+		else if (arg == "--chunks") opt.chunks = ParseSizeList(val);
+		else if (arg == "--rtts") opt.rtts = ParseSizeList(val);
+		else if (arg == "--jitter-ms") opt.jitterMs = (uint32_t)std::stoul(val);
+		else if (arg == "--bandwidth") opt.bandwidthBps = ParseSizeList(val).at(0);
+		else if (arg == "--iters") opt.iters = std::stoi(val);
+		else if (arg == "--out") opt.outPath = val;
+		else {
+			Usage();
+			return 1;
+		}
+	}
+	if (opt.target.empty() || (opt.keyPath.empty() && opt.password.empty())) {
+		Usage();
+		return 1;
+	}
+
+	Client client(opt.target.c_str());
+	auth_pubkey pubkey{};
+	auth_password password{ opt.password };
+	AUTH_TYPE authType = AUTH_PASSWORD;
+	void* authVal = &password;
+	if (!opt.keyPath.empty()) {
+		pubkey.privKeyData = minsftp::ReadPrivateKeyFromFile(opt.keyPath);
+		authType = AUTH_PUBKEY;
+		authVal = &pubkey;
+	}
+
+	std::ofstream file;
+	if (!opt.outPath.empty()) {
+		file.open(opt.outPath, std::ios::app);
+	}
+	std::ostream& out = opt.outPath.empty() ? std::cout : file;
+
+	for (size_t rtt : opt.rtts) {
+		opt.rttMs = (double)rtt;
+
+		minsftp sftp(client, authType, authVal);
+		if (rtt || opt.jitterMs || opt.bandwidthBps) {
+			netem_config link{};
+			link.rttMs = (uint32_t)rtt;
+			link.jitterMs = opt.jitterMs;
+			link.bandwidthBps = opt.bandwidthBps;
+			sftp.SetTransport(std::make_shared<NetEm>(link));
+		}
+
+		MINSFTP_RES res = sftp.Init();
+		if (res != RES_OK) {
+			fprintf(stderr, "init failed: %s\n", sftp.ResToStr(res));
+			return 1;
+		}
+		sftp.SftpMakeDir(opt.remoteDir);
+
+		BenchReadWrite(sftp, opt, out);
+		BenchTree(sftp, opt, out);
+
+		sftp.SftpDeleteDir(opt.remoteDir);
+
+		// per request latency histograms collected by the session during the run
+		std::stringstream metrics(sftp.GetMetrics()->Snapshot().ToJson());
+		std::string line;
+		char prefix[64];
+		snprintf(prefix, sizeof(prefix), "{\"bench\":\"metrics\",\"rtt_ms\":%.1f,", opt.rttMs);
+		while (std::getline(metrics, line)) {
+			out << prefix << line.substr(1) << std::endl;
+		}
+		sftp.Shutdown();
+	}
+	return 0;
+}
@@ -0,0 +1,349 @@
+#include "bulk_transfer.h"
+
+#include <algorithm>
+#include <cstring>
+
+BulkGetter::BulkGetter(SftpChannel* _channel, Metrics* _metrics, const bulk_get_fn& _onFile, const bulk_options& _options) {
+    channel = _channel;
+    metrics = _metrics;
+    onFile = _onFile;
+    options = _options;
+    if (!options.maxOpen) {
+        options.maxOpen = 1;
+    }
+    if (!options.chunkSize) {
+        options.chunkSize = 32 * 1024;
+    }
+    if (!options.requestsPerFile) {
+        options.requestsPerFile = 1;
+    }
+}
+
+void BulkGetter::Record(METRIC_OP op, std::chrono::steady_clock::time_point start, bool ok, uint64_t bytes) {
+    if (metrics) {
+        metrics->Record(op, std::chrono::steady_clock::now() - start, bytes, ok);
+    }
+}
+
+MINSFTP_RES BulkGetter::Run(const std::vector<std::string>& paths) {
+    channel->SetMaxInFlight(options.maxInFlight);
+
+    size_t next = 0;
+    while (true) {
+        while (next < paths.size() && open < options.maxOpen && !channel->Broken()) {
+            StartFile(next, paths[next]);
+            next++;
+        }
+        if (!channel->InFlight()) {
+            break;
+        }
+
+        if (channel->Pump() != RES_OK) {
+            break;
+        }
+        if (channel->WouldBlock()) {
+            channel->WaitSocket();
+        }
+    }
+
+    if (channel->Broken()) {
+        // everyone still gets a result
+        for (; next < paths.size(); next++) {
+            bulk_get_result result{ next, paths[next], RES_CHANNEL_FAILED };
+            if (onFile) {
+                onFile(result);
+            }
+        }
+        MINSFTP_ERROR("bulk get aborted, sftp channel broke");
+        return RES_CHANNEL_FAILED;
+    }
+    return failed ? RES_FAILED : RES_OK;
+}
+
+void BulkGetter::Add(size_t index, const std::string& path) {
+    StartFile(index, path);
+}
+size_t BulkGetter::Active() const {
+    return open;
+}
+
+void BulkGetter::StartFile(size_t index, const std::string& path) {
+    auto file = std::make_shared<file_state>();
+    file->result.index = index;
+    file->result.path = path;
+    open++;
+
+    auto start = std::chrono::steady_clock::now();
+    channel->OpenFile(path, LIBSSH2_FXF_READ, 0, [this, file, start](const sftp_reply& reply) {
+        bool ok = reply.Ok() && reply.type == FXP_HANDLE;
+        Record(OP_OPEN, start, ok);
+        if (!ok) {
+            open--;
+            Finish(file, reply.type ? RES_FAILED_OPEN_FILE_SFTP : RES_CHANNEL_FAILED);
+            return;
+        }
+        file->handle = reply.handle;
+
+        // size and the first chunk in the same round trip, most small files are done after it
+        file->outstanding++;
+        auto statStart = std::chrono::steady_clock::now();
+        channel->FStat(file->handle, [this, file, statStart](const sftp_reply& reply) {
+            file->outstanding--;
+            file->sizeKnown = true;
+            bool ok = reply.Ok() && reply.type == FXP_ATTRS;
+            Record(OP_STAT, statStart, ok);
+            if (ok && (reply.attrs.flags & LIBSSH2_SFTP_ATTR_SIZE)) {
+                file->size = std::min<uint64_t>(file->size, reply.attrs.filesize);
+            }
+            // without a size the file is read until eof
+            IssueReads(file);
+            CheckDone(file);
+        });
+        ReadChunk(file, 0, options.chunkSize);
+        file->nextOffset = options.chunkSize;
+    });
+}
+
+void BulkGetter::IssueReads(std::shared_ptr<file_state> file) {
+    if (!file->sizeKnown || file->eof || file->done) {
+        return;
+    }
+    while (file->outstanding < options.requestsPerFile && file->nextOffset < file->size) {
+        uint32_t len = (uint32_t)std::min<uint64_t>(options.chunkSize, file->size - file->nextOffset);
+        ReadChunk(file, file->nextOffset, len);
+        file->nextOffset += len;
+    }
+}
+
+void BulkGetter::ReadChunk(std::shared_ptr<file_state> file, uint64_t offset, uint32_t len) {
+    file->outstanding++;
+    auto start = std::chrono::steady_clock::now();
+    channel->Read(file->handle, offset, len, [this, file, offset, len, start](const sftp_reply& reply) {
+        file->outstanding--;
+        if (file->done) {
+            CheckDone(file);
+            return;
+        }
+
+        if (reply.type == FXP_DATA) {
+            uint32_t n = (uint32_t)std::min<size_t>(reply.dataLen, len);
+            FILE_DATA& data = file->result.data;
+            if (data.size() < offset + n) {
+                data.resize((size_t)(offset + n));
+            }
+            memcpy(data.data() + offset, reply.data, n);
+            Record(OP_READ, start, true, n);
+            // servers may return less than asked for, ask for the rest
+            if (n < len && offset + n < file->size) {
+                ReadChunk(file, offset + n, len - n);
+            }
+        }
+        else if (reply.type == FXP_STATUS && reply.status == LIBSSH2_FX_EOF) {
+            Record(OP_READ, start, true);
+            file->eof = true;
+            file->size = std::min(file->size, offset);
+        }
+        else {
+            Record(OP_READ, start, false);
+            Finish(file, reply.type ? RES_FAILED : RES_CHANNEL_FAILED);
+            CheckDone(file);
+            return;
+        }
+
+        IssueReads(file);
+        CheckDone(file);
+    });
+}
+
+void BulkGetter::CheckDone(std::shared_ptr<file_state> file) {
+    if (file->outstanding) {
+        return;
+    }
+    if (!file->done) {
+        if (!file->sizeKnown || (!file->eof && file->nextOffset < file->size)) {
+            return;
+        }
+        if (file->size != UINT64_MAX) {
+            file->result.data.resize((size_t)file->size);
+        }
+        Finish(file, RES_OK);
+    }
+
+    if (!file->handle.empty()) {
+        std::string handle;
+        handle.swap(file->handle);
+        auto start = std::chrono::steady_clock::now();
+        channel->CloseHandle(handle, [this, start](const sftp_reply& reply) {
+            Record(OP_CLOSE, start, reply.Ok());
+            open--;
+        });
+    }
+}
+
+void BulkGetter::Finish(std::shared_ptr<file_state> file, MINSFTP_RES res) {
+    if (file->done) {
+        return;
+    }
+    file->done = true;
+    file->result.res = res;
+    if (res != RES_OK) {
+        failed++;
+        file->result.data.clear();
+    }
+    if (onFile) {
+        onFile(file->result);
+    }
+    // the caller may have moved the data out, either way it's not needed anymore
+    FILE_DATA().swap(file->result.data);
+}
+
+BulkPutter::BulkPutter(SftpChannel* _channel, Metrics* _metrics, const bulk_put_fn& _onFile, const bulk_options& _options) {
+    channel = _channel;
+    metrics = _metrics;
+    onFile = _onFile;
+    options = _options;
+    if (!options.maxOpen) {
+        options.maxOpen = 1;
+    }
+    if (!options.chunkSize) {
+        options.chunkSize = 32 * 1024;
+    }
+    if (!options.requestsPerFile) {
+        options.requestsPerFile = 1;
+    }
+}
+
+void BulkPutter::Record(METRIC_OP op, std::chrono::steady_clock::time_point start, bool ok, uint64_t bytes) {
+    if (metrics) {
+        metrics->Record(op, std::chrono::steady_clock::now() - start, bytes, ok);
+    }
+}
+
+MINSFTP_RES BulkPutter::Run(const bulk_put_source& source) {
+    channel->SetMaxInFlight(options.maxInFlight);
+
+    size_t produced = 0;
+    bool more = true;
+    while (true) {
+        // a file larger than maxBytesInFlight still goes through, alone
+        while (more && open < options.maxOpen && (bytesHeld < options.maxBytesInFlight || !open) && !channel->Broken()) {
+            bulk_put_item item{};
+            if (!source(item)) {
+                more = false;
+                break;
+            }
+            Add(produced++, item);
+        }
+        if (!channel->InFlight()) {
+            break;
+        }
+
+        if (channel->Pump() != RES_OK) {
+            break;
+        }
+        if (channel->WouldBlock()) {
+            channel->WaitSocket();
+        }
+    }
+
+    if (channel->Broken()) {
+        MINSFTP_ERROR("bulk put aborted, sftp channel broke");
+        return RES_CHANNEL_FAILED;
+    }
+    return failed ? RES_FAILED : RES_OK;
+}
+
+void BulkPutter::Add(size_t index, bulk_put_item& item) {
+    auto file = std::make_shared<file_state>();
+    file->result.index = index;
+    file->result.path = std::move(item.path);
+    file->data = std::move(item.data);
+    file->mode = item.mode;
+    StartFile(file);
+}
+size_t BulkPutter::Active() const {
+    return open;
+}
+
+void BulkPutter::StartFile(std::shared_ptr<file_state> file) {
+    open++;
+    bytesHeld += file->data.size();
+
+    auto start = std::chrono::steady_clock::now();
+    channel->OpenFile(file->result.path, LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC, file->mode,
+        [this, file, start](const sftp_reply& reply) {
+        bool ok = reply.Ok() && reply.type == FXP_HANDLE;
+        Record(OP_OPEN, start, ok);
+        if (!ok) {
+            ReleaseData(file);
+            open--;
+            Finish(file, reply.type ? RES_FAILED_OPEN_FILE_SFTP : RES_CHANNEL_FAILED);
+            return;
+        }
+        file->handle = reply.handle;
+        IssueWrites(file);
+        CheckDone(file);
+    });
+}
+
+void BulkPutter::IssueWrites(std::shared_ptr<file_state> file) {
+    while (!file->failed && file->outstanding < options.requestsPerFile && file->nextOffset < file->data.size()) {
+        uint64_t offset = file->nextOffset;
+        size_t len = (size_t)std::min<uint64_t>(options.chunkSize, file->data.size() - offset);
+        file->nextOffset += len;
+        file->outstanding++;
+
+        auto start = std::chrono::steady_clock::now();
+        channel->Write(file->handle, offset, file->data.data() + offset, len, [this, file, len, start](const sftp_reply& reply) {
+            file->outstanding--;
+            bool ok = reply.Ok();
+            Record(OP_WRITE, start, ok, ok ? len : 0);
+            if (!ok && !file->failed) {
+                file->failed = true;
+                file->result.res = reply.type ? RES_SFTP_WRITE_FAILED : RES_CHANNEL_FAILED;
+            }
+            IssueWrites(file);
+            CheckDone(file);
+        });
+    }
+}
+
+void BulkPutter::CheckDone(std::shared_ptr<file_state> file) {
+    if (file->outstanding || file->closing) {
+        return;
+    }
+    if (!file->failed && file->nextOffset < file->data.size()) {
+        return;
+    }
+
+    // everything acknowledged, the source may produce the next file meanwhile
+    ReleaseData(file);
+    file->closing = true;
+    auto start = std::chrono::steady_clock::now();
+    channel->CloseHandle(file->handle, [this, file, start](const sftp_reply& reply) {
+        bool ok = reply.Ok();
+        Record(OP_CLOSE, start, ok);
+        open--;
+        if (file->failed) {
+            Finish(file, file->result.res);
+        }
+        else {
+            Finish(file, ok ? RES_OK : (reply.type ? RES_SFTP_WRITE_FAILED : RES_CHANNEL_FAILED));
+        }
+    });
+}
+
+void BulkPutter::ReleaseData(std::shared_ptr<file_state> file) {
+    bytesHeld -= file->data.size();
+    FILE_DATA().swap(file->data);
+}
+
+void BulkPutter::Finish(std::shared_ptr<file_state> file, MINSFTP_RES res) {
+    file->result.res = res;
+    if (res != RES_OK) {
+        failed++;
+    }
+    if (onFile) {
+        onFile(file->result);
+    }
+}
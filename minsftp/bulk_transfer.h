@@ -0,0 +1,94 @@
+#pragma once
+#include "minsftp.h"
+#include "sftp_channel.h"
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+// many small files over one SftpChannel with files in different stages at once: while some
+// are being opened others are reading or closing. per file: OPEN, then FSTAT and the first
+// READ back to back, the rest of the reads once the size is known, CLOSE in the background
+// used through minsftp::BulkGet
+class BulkGetter {
+public:
+	BulkGetter(SftpChannel* _channel, Metrics* _metrics, const bulk_get_fn& _onFile, const bulk_options& _options);
+
+	// RES_OK, RES_FAILED if some files failed, RES_CHANNEL_FAILED
+	MINSFTP_RES Run(const std::vector<std::string>& paths);
+	// start one file without driving the channel, for callers that pump it themselves
+	void Add(size_t index, const std::string& path);
+	// files started and not finished (their close may still be outstanding)
+	size_t Active() const;
+
+private:
+	struct file_state {
+		bulk_get_result result{};
+		std::string handle{};
+		uint64_t size{ UINT64_MAX }; // from fstat, UINT64_MAX while unknown
+		bool sizeKnown{ false }; // fstat answered (size may still be unknown if it failed)
+		bool eof{ false };
+		bool done{ false };
+		uint64_t nextOffset{};
+		size_t outstanding{}; // reads and the fstat
+	};
+
+	SftpChannel* channel{};
+	Metrics* metrics{};
+	bulk_get_fn onFile{};
+	bulk_options options{};
+
+	size_t open{}; // handles opened or being opened
+	size_t failed{};
+
+	void StartFile(size_t index, const std::string& path);
+	void IssueReads(std::shared_ptr<file_state> file);
+	void ReadChunk(std::shared_ptr<file_state> file, uint64_t offset, uint32_t len);
+	void CheckDone(std::shared_ptr<file_state> file);
+	void Finish(std::shared_ptr<file_state> file, MINSFTP_RES res);
+	void Record(METRIC_OP op, std::chrono::steady_clock::time_point start, bool ok, uint64_t bytes = 0);
+};
+
+// the upload side: OPEN (create, truncate), up to requestsPerFile WRITEs in flight, CLOSE
+// files are pulled from the source only while there is room, a file's data is released
+// as soon as all of its writes were acknowledged
+// used through minsftp::BulkPut
+class BulkPutter {
+public:
+	BulkPutter(SftpChannel* _channel, Metrics* _metrics, const bulk_put_fn& _onFile, const bulk_options& _options);
+
+	// RES_OK, RES_FAILED if some files failed, RES_CHANNEL_FAILED
+	MINSFTP_RES Run(const bulk_put_source& source);
+	// start one file without driving the channel, index is passed back in its result
+	void Add(size_t index, bulk_put_item& item);
+	size_t Active() const;
+
+private:
+	struct file_state {
+		bulk_put_result result{};
+		FILE_DATA data{};
+		long mode{};
+		std::string handle{};
+		uint64_t nextOffset{};
+		size_t outstanding{};
+		bool failed{ false };
+		bool closing{ false };
+	};
+
+	SftpChannel* channel{};
+	Metrics* metrics{};
+	bulk_put_fn onFile{};
+	bulk_options options{};
+
+	size_t open{}; // files between OPEN and the CLOSE reply
+	size_t bytesHeld{}; // data of those files not yet acknowledged
+	size_t failed{};
+
+	void StartFile(std::shared_ptr<file_state> file);
+	void IssueWrites(std::shared_ptr<file_state> file);
+	void CheckDone(std::shared_ptr<file_state> file);
+	void Finish(std::shared_ptr<file_state> file, MINSFTP_RES res);
+	void ReleaseData(std::shared_ptr<file_state> file);
+	void Record(METRIC_OP op, std::chrono::steady_clock::time_point start, bool ok, uint64_t bytes = 0);
+};
@@ -0,0 +1,142 @@
+#include "concurrency.h"
+#include "log.h"
+
+#include <algorithm>
+
+// replies an interval needs before its latency is compared with the baseline
+static const uint64_t MIN_INTERVAL_SAMPLES = 8;
+
+ConcurrencyController::ConcurrencyController(const concurrency_options& _options) {
+    options = _options;
+    options.minInFlight = std::max<size_t>(options.minInFlight, 1);
+    options.maxInFlight = std::max(options.maxInFlight, options.minInFlight);
+    options.minSessions = std::max<size_t>(options.minSessions, 1);
+    options.maxSessions = std::max(options.maxSessions, options.minSessions);
+    window = (double)std::clamp(options.initialInFlight, options.minInFlight, options.maxInFlight);
+    sessions = (double)std::clamp(options.initialSessions, options.minSessions, options.maxSessions);
+    intervalStart = baselineStart = std::chrono::steady_clock::now();
+}
+
+std::shared_ptr<ConcurrencyController> ConcurrencyController::ForHost(const std::string& host,
+    const concurrency_options& options) {
+    static std::mutex registryMutex;
+    static std::map<std::string, std::weak_ptr<ConcurrencyController>> registry;
+
+    std::lock_guard<std::mutex> lock(registryMutex);
+    std::shared_ptr<ConcurrencyController> controller = registry[host].lock();
+    if (!controller) {
+        controller = std::make_shared<ConcurrencyController>(options);
+        registry[host] = controller;
+    }
+    return controller;
+}
+
+void ConcurrencyController::OnSample(std::chrono::steady_clock::duration latency, uint64_t bytes, bool error) {
+    auto now = std::chrono::steady_clock::now();
+    double us = (double)std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    intervalSamples++;
+    intervalBytes += bytes;
+    intervalLatencyUs += us;
+    intervalErrors += error ? 1 : 0;
+    if (now - intervalStart >= std::chrono::milliseconds(options.intervalMs)) {
+        Evaluate(now);
+    }
+}
+
+void ConcurrencyController::OnBytes(uint64_t bytes) {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(mutex);
+    intervalBytes += bytes;
+    if (now - intervalStart >= std::chrono::milliseconds(options.intervalMs)) {
+        Evaluate(now);
+    }
+}
+
+void ConcurrencyController::OnError() {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(mutex);
+    intervalErrors++;
+    if (now - intervalStart >= std::chrono::milliseconds(options.intervalMs)) {
+        Evaluate(now);
+    }
+}
+
+void ConcurrencyController::Evaluate(std::chrono::steady_clock::time_point now) {
+    // a handful of replies says more about the request mix than about queueing, wait for more
+    // unless the host has been (nearly) idle for a while
+    bool judged = intervalSamples >= MIN_INTERVAL_SAMPLES;
+    // only OnBytes (large file chunks): no latency to judge, but throughput is still a signal
+    bool bytesOnly = !intervalSamples && intervalBytes > 0;
+    if (!judged && !bytesOnly && !intervalErrors && now - intervalStart < std::chrono::milliseconds(options.intervalMs * 8)) {
+        return;
+    }
+
+    double seconds = std::chrono::duration<double>(now - intervalStart).count();
+    double throughput = seconds > 0 ? intervalBytes / seconds : 0;
+    double averageUs = intervalSamples ? intervalLatencyUs / intervalSamples : 0;
+
+    // growing latency is only queueing if it bought no throughput; 1ms slack for loopback jitter
+    bool queueing = judged && baselineUs >= 0 && averageUs > baselineUs * options.latencyTolerance + 1000;
+    bool congested = intervalErrors > 0 || (queueing && throughput < lastThroughput * 1.1);
+
+    if (draining) {
+        // replies of the interval after a decrease were queued before it, judge the next one
+        draining = false;
+    }
+    else if (congested) {
+        window = std::max((double)options.minInFlight, window * options.decrease);
+        sessions = std::max((double)options.minSessions, sessions * options.decrease);
+        backoffs++;
+        draining = true;
+        MINSFTP_DEBUG("congestion (%llu errors, %.0fus vs %.0fus), window %.0f, sessions %.0f",
+            (unsigned long long)intervalErrors, averageUs, baselineUs, window, sessions);
+    }
+    else if (judged && throughput >= lastThroughput * 0.9) {
+        if (window >= (double)options.maxInFlight) {
+            sessions = std::min((double)options.maxSessions, sessions + 1);
+        }
+        window = std::min((double)options.maxInFlight, window + (double)options.inFlightStep);
+    }
+    else if (bytesOnly && throughput > lastThroughput * 1.1) {
+        // the in-flight window never fills without samples, so sessions grow on their own
+        // while each one added still buys throughput
+        sessions = std::min((double)options.maxSessions, sessions + 1);
+    }
+    if (intervalSamples || intervalBytes) {
+        lastThroughput = throughput;
+    }
+    if (judged && !intervalErrors) {
+        baselineUs = baselineUs < 0 ? averageUs : std::min(baselineUs, averageUs);
+        nextBaselineUs = nextBaselineUs < 0 ? averageUs : std::min(nextBaselineUs, averageUs);
+    }
+
+    // the baseline follows route changes: every baselineMs the period's minimum takes over
+    if (now - baselineStart >= std::chrono::milliseconds(options.baselineMs)) {
+        baselineUs = nextBaselineUs;
+        nextBaselineUs = -1;
+        baselineStart = now;
+    }
+
+    intervalStart = now;
+    intervalBytes = intervalSamples = intervalErrors = 0;
+    intervalLatencyUs = 0;
+}
+
+size_t ConcurrencyController::InFlightLimit() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return (size_t)window;
+}
+size_t ConcurrencyController::SessionLimit() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return (size_t)sessions;
+}
+double ConcurrencyController::Throughput() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return lastThroughput;
+}
+uint64_t ConcurrencyController::Backoffs() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return backoffs;
+}
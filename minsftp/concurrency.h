@@ -0,0 +1,72 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+struct concurrency_options {
+	size_t minInFlight{ 4 }; // requests outstanding per channel
+	size_t maxInFlight{ 256 };
+	size_t initialInFlight{ 16 };
+	size_t inFlightStep{ 4 }; // additive increase per healthy interval
+	size_t minSessions{ 1 }; // parallel sessions per host (TransferScheduler workers)
+	size_t maxSessions{ 16 };
+	size_t initialSessions{ 2 };
+	double decrease{ 0.7 }; // multiplicative decrease on congestion
+	double latencyTolerance{ 2.0 }; // congested once average latency exceeds the baseline by this factor
+	uint32_t intervalMs{ 250 }; // evaluation period
+	uint32_t baselineMs{ 10000 }; // the latency baseline is re-learned this often
+};
+
+// aimd limits for one remote host, shared by every session to it
+// replies are fed in as samples; every intervalMs the interval's average latency is compared
+// with the lowest interval average seen recently (the unloaded latency): a server error, or
+// latency growth beyond latencyTolerance that didn't raise throughput, is congestion and cuts
+// both limits by decrease, otherwise the in-flight window grows by inFlightStep while
+// throughput keeps up, and once it sits at its maximum one more session is allowed
+// intervals with only OnBytes (no latency samples) add a session while throughput still grows
+// thread safe
+class ConcurrencyController {
+public:
+	ConcurrencyController(const concurrency_options& _options = concurrency_options{});
+
+	// the controller for host (created with options on first use), one per host while in use
+	static std::shared_ptr<ConcurrencyController> ForHost(const std::string& host,
+		const concurrency_options& options = concurrency_options{});
+
+	// one request/response: its latency, payload bytes and whether the server failed it
+	void OnSample(std::chrono::steady_clock::duration latency, uint64_t bytes, bool error);
+	// transferred bytes without a latency worth comparing (multi round trip chunks)
+	void OnBytes(uint64_t bytes);
+	// a failure without a latency (connection refused, channel lost)
+	void OnError();
+
+	size_t InFlightLimit() const;
+	size_t SessionLimit() const;
+	// bytes/s over the last evaluated interval
+	double Throughput() const;
+	// decreases so far
+	uint64_t Backoffs() const;
+
+private:
+	concurrency_options options{};
+	mutable std::mutex mutex{};
+	double window{};
+	double sessions{};
+
+	std::chrono::steady_clock::time_point intervalStart{};
+	uint64_t intervalBytes{};
+	uint64_t intervalSamples{};
+	double intervalLatencyUs{};
+	uint64_t intervalErrors{};
+	double baselineUs{ -1 }; // lowest interval average, -1 until the first interval
+	double nextBaselineUs{ -1 }; // lowest of the current baseline period
+	std::chrono::steady_clock::time_point baselineStart{};
+	double lastThroughput{};
+	uint64_t backoffs{};
+	bool draining{ false }; // decreased last interval
+
+	void Evaluate(std::chrono::steady_clock::time_point now);
+};
@@ -0,0 +1,131 @@
+#include "exec_channel.h"
+
+ExecChannel::ExecChannel(LIBSSH2_SESSION* _session, libssh2_socket_t _sock, uint32_t _window) {
+    session = _session;
+    sock = _sock;
+    window = _window;
+}
+ExecChannel::~ExecChannel() {
+    Close();
+}
+
+MINSFTP_RES ExecChannel::Open(const std::string& command) {
+    if (channel) {
+        return RES_FAILED;
+    }
+
+    while (!(channel = libssh2_channel_open_ex(session, "session", sizeof("session") - 1,
+        window ? window : LIBSSH2_CHANNEL_WINDOW_DEFAULT, LIBSSH2_CHANNEL_PACKET_DEFAULT, NULL, 0))) {
+        if (libssh2_session_last_errno(session) != LIBSSH2_ERROR_EAGAIN) {
+            MINSFTP_ERROR("unable to open exec channel");
+            return RES_CHANNEL_FAILED;
+        }
+        WaitSessionSocket(session, sock, 1000);
+    }
+
+    // unread stderr would fill the shared window and stall stdout
+    libssh2_channel_handle_extended_data2(channel, LIBSSH2_CHANNEL_EXTENDED_DATA_IGNORE);
+
+    int rc;
+    while ((rc = libssh2_channel_exec(channel, command.c_str())) == LIBSSH2_ERROR_EAGAIN) {
+        WaitSessionSocket(session, sock, 1000);
+    }
+    if (rc) {
+        MINSFTP_WARN("exec refused (%d): %s", rc, command.c_str());
+        Close();
+        return RES_CHANNEL_FAILED;
+    }
+
+    MINSFTP_DEBUG("exec: %s", command.c_str());
+    return RES_OK;
+}
+
+ssize_t ExecChannel::Read(void* buffer, size_t len) {
+    if (!channel) {
+        return -1;
+    }
+
+    while (true) {
+        ssize_t n = libssh2_channel_read(channel, reinterpret_cast<char*>(buffer), len);
+        if (n == LIBSSH2_ERROR_EAGAIN) {
+            WaitSessionSocket(session, sock, 1000);
+            continue;
+        }
+        if (n == 0 && !libssh2_channel_eof(channel)) {
+            continue; // window adjust or stderr only
+        }
+        return n;
+    }
+}
+
+MINSFTP_RES ExecChannel::Write(const void* data, size_t len) {
+    if (!channel) {
+        return RES_CHANNEL_FAILED;
+    }
+
+    const char* p = reinterpret_cast<const char*>(data);
+    while (len) {
+        ssize_t n = libssh2_channel_write(channel, p, len);
+        if (n == LIBSSH2_ERROR_EAGAIN) {
+            WaitSessionSocket(session, sock, 1000);
+            continue;
+        }
+        if (n < 0) {
+            MINSFTP_ERROR("exec channel write failed: %zd", n);
+            return RES_CHANNEL_FAILED;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return RES_OK;
+}
+
+MINSFTP_RES ExecChannel::SendEof() {
+    if (!channel) {
+        return RES_CHANNEL_FAILED;
+    }
+
+    int rc;
+    while ((rc = libssh2_channel_send_eof(channel)) == LIBSSH2_ERROR_EAGAIN) {
+        WaitSessionSocket(session, sock, 1000);
+    }
+    return rc == 0 ? RES_OK : RES_CHANNEL_FAILED;
+}
+
+int ExecChannel::Close() {
+    if (!channel) {
+        return 0;
+    }
+
+    while (libssh2_channel_close(channel) == LIBSSH2_ERROR_EAGAIN) {
+        WaitSessionSocket(session, sock, 1000);
+    }
+    // the exit status arrives with or before the server's close (only waited for after eof,
+    // a command abandoned part way has no status)
+    if (libssh2_channel_eof(channel)) {
+        while (libssh2_channel_wait_closed(channel) == LIBSSH2_ERROR_EAGAIN) {
+            WaitSessionSocket(session, sock, 1000);
+        }
+    }
+    int status = libssh2_channel_get_exit_status(channel);
+    libssh2_channel_free(channel);
+    channel = nullptr;
+    return status;
+}
+
+bool ExecChannel::IsOpen() const {
+    return channel != nullptr;
+}
+
+std::string ExecChannel::Quote(const std::string& arg) {
+    std::string quoted = "'";
+    for (char c : arg) {
+        if (c == '\'') {
+            quoted += "'\\''";
+        }
+        else {
+            quoted += c;
+        }
+    }
+    return quoted + "'";
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include "minsftp.h"
+
+#include <string>
+
+// remote command on its own exec channel of an authenticated session
+// stdout is read and stdin written as plain byte streams, stderr is discarded
+// calls wait for progress on non-blocking sessions as well, so they behave like blocking i/o
+class ExecChannel {
+public:
+	// window: ssh receive window of the channel, 0 is libssh2's default
+	ExecChannel(LIBSSH2_SESSION* _session, libssh2_socket_t _sock, uint32_t _window = 0);
+	~ExecChannel();
+	ExecChannel(const ExecChannel&) = delete;
+	ExecChannel& operator=(const ExecChannel&) = delete;
+
+	// start command through the remote user's shell
+	MINSFTP_RES Open(const std::string& command);
+	// up to len bytes of stdout, 0 at eof, < 0 on error
+	ssize_t Read(void* buffer, size_t len);
+	// all of len bytes to stdin
+	MINSFTP_RES Write(const void* data, size_t len);
+	// close stdin, the command sees eof
+	MINSFTP_RES SendEof();
+	// close the channel and return the command's exit status (0 if the server sent none)
+	int Close();
+	bool IsOpen() const;
+
+	// quote arg for a posix shell
+	static std::string Quote(const std::string& arg);
+
+private:
+	LIBSSH2_SESSION* session{};
+	libssh2_socket_t sock{ LIBSSH2_INVALID_SOCKET };
+	uint32_t window{};
+	LIBSSH2_CHANNEL* channel{};
+};
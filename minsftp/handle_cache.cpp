@@ -0,0 +1,97 @@
+#include "handle_cache.h"
+
+HandleCache::HandleCache(close_fn _close) {
+    close = _close;
+}
+HandleCache::~HandleCache() {
+    Clear();
+}
+
+std::string HandleCache::Key(const std::string& path, unsigned long flags) {
+    return std::to_string(flags) + ":" + path;
+}
+
+void HandleCache::SetMaxOpen(size_t _maxOpen) {
+    maxOpen = _maxOpen;
+    while (lru.size() > maxOpen) {
+        Evict(std::prev(lru.end()));
+    }
+}
+size_t HandleCache::MaxOpen() const {
+    return maxOpen;
+}
+size_t HandleCache::Size() const {
+    return lru.size();
+}
+uint64_t HandleCache::Hits() const {
+    return hits;
+}
+uint64_t HandleCache::Misses() const {
+    return misses;
+}
+
+void HandleCache::Evict(std::list<entry>::iterator it) {
+    LIBSSH2_SFTP_HANDLE* handle = it->handle;
+    entries.erase(it->key);
+    lru.erase(it);
+    if (close) {
+        close(handle);
+    }
+}
+
+LIBSSH2_SFTP_HANDLE* HandleCache::Take(const std::string& path, unsigned long flags) {
+    if (!maxOpen) {
+        return nullptr;
+    }
+
+    auto it = entries.find(Key(path, flags));
+    if (it == entries.end()) {
+        misses++;
+        return nullptr;
+    }
+
+    hits++;
+    LIBSSH2_SFTP_HANDLE* handle = it->second->handle;
+    lru.erase(it->second);
+    entries.erase(it);
+    return handle;
+}
+
+void HandleCache::Put(const std::string& path, unsigned long flags, LIBSSH2_SFTP_HANDLE* handle) {
+    std::string key = Key(path, flags);
+    if (!maxOpen || entries.count(key)) {
+        // disabled, or someone else already gave back a handle for the same file
+        if (close) {
+            close(handle);
+        }
+        return;
+    }
+
+    lru.push_front(entry{ key, path, handle });
+    entries[key] = lru.begin();
+    while (lru.size() > maxOpen) {
+        Evict(std::prev(lru.end()));
+    }
+}
+
+void HandleCache::Invalidate(const std::string& path) {
+    for (auto it = lru.begin(); it != lru.end();) {
+        const std::string& p = it->path;
+        bool below = p.size() > path.size() && p.compare(0, path.size(), path) == 0 &&
+            (p[path.size()] == '/' || (!path.empty() && path.back() == '/'));
+        if (p == path || below) {
+            auto next = std::next(it);
+            Evict(it);
+            it = next;
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+void HandleCache::Clear() {
+    while (!lru.empty()) {
+        Evict(lru.begin());
+    }
+}
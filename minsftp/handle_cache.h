@@ -0,0 +1,53 @@
+#pragma once
+#include "libssh2_setup.h"
+#include <libssh2.h>
+#include <libssh2_sftp.h>
+
+#include <functional>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+// lru of open sftp handles keyed by path and open flags
+// a handle is owned by the cache only while idle: Take() hands it out, Put() gives it back
+// handles pushed out (eviction, invalidation) are closed with the callback from the constructor
+class HandleCache {
+public:
+	using close_fn = std::function<void(LIBSSH2_SFTP_HANDLE*)>;
+
+	HandleCache(close_fn _close);
+	~HandleCache();
+
+	// 0 disables caching and closes everything idle
+	void SetMaxOpen(size_t _maxOpen);
+	size_t MaxOpen() const;
+	size_t Size() const;
+
+	// idle handle for path/flags or nullptr
+	LIBSSH2_SFTP_HANDLE* Take(const std::string& path, unsigned long flags);
+	// keep handle for reuse, may close the least recently used one
+	void Put(const std::string& path, unsigned long flags, LIBSSH2_SFTP_HANDLE* handle);
+	// close handles for path and, when it is a directory, everything below it
+	void Invalidate(const std::string& path);
+	void Clear();
+
+	uint64_t Hits() const;
+	uint64_t Misses() const;
+
+private:
+	struct entry {
+		std::string key;
+		std::string path;
+		LIBSSH2_SFTP_HANDLE* handle;
+	};
+
+	close_fn close{};
+	size_t maxOpen{};
+	std::list<entry> lru{}; // most recently used first
+	std::unordered_map<std::string, std::list<entry>::iterator> entries{};
+	uint64_t hits{};
+	uint64_t misses{};
+
+	static std::string Key(const std::string& path, unsigned long flags);
+	void Evict(std::list<entry>::iterator it);
+};
@@ -0,0 +1,194 @@
+#include "log.h"
+
+#include <chrono>
+#include <cstdarg>
+#include <stdio.h>
+#include <time.h>
+
+// how long the flusher sleeps when the ring is empty
+constexpr auto LOG_IDLE_SLEEP = std::chrono::milliseconds(2);
+
+static uint64_t CurrentThreadId() {
+    return (uint64_t)std::hash<std::thread::id>{}(std::this_thread::get_id());
+}
+
+Logger& Logger::Instance() {
+    static Logger logger;
+    return logger;
+}
+
+Logger::Logger() {
+    // slot i is free for the writer that claims position i
+    for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+        ring[i].seq.store(i, std::memory_order_relaxed);
+    }
+    sink = &Logger::StderrSink;
+    flusher = std::thread(&Logger::Run, this);
+}
+
+Logger::~Logger() {
+    running = false;
+    if (flusher.joinable()) {
+        flusher.join();
+    }
+}
+
+void Logger::SetLevel(LOG_LEVEL level) {
+    minLevel.store(level, std::memory_order_relaxed);
+}
+LOG_LEVEL Logger::Level() const {
+    return minLevel.load(std::memory_order_relaxed);
+}
+
+void Logger::SetSink(sink_fn _sink) {
+    std::lock_guard<std::mutex> lock(sinkMutex);
+    sink = _sink ? _sink : sink_fn(&Logger::StderrSink);
+}
+
+void Logger::Write(LOG_LEVEL level, const char* func, const char* fmt, ...) {
+    // claim a slot (bounded mpmc queue, one sequence number per slot)
+    size_t pos = head.load(std::memory_order_relaxed);
+    slot* s = nullptr;
+    while (true) {
+        s = &ring[pos & (LOG_RING_SIZE - 1)];
+        size_t seq = s->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            // full, the flusher is behind
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        else {
+            pos = head.load(std::memory_order_relaxed);
+        }
+    }
+
+    log_record& r = s->record;
+    r.timeUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    r.threadId = CurrentThreadId();
+    r.level = level;
+    r.func = func ? func : "";
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(r.msg, sizeof(r.msg), fmt, args);
+    va_end(args);
+
+    // publish to the flusher
+    s->seq.store(pos + 1, std::memory_order_release);
+}
+
+bool Logger::Pop(log_record& out) {
+    slot& s = ring[tail & (LOG_RING_SIZE - 1)];
+    size_t seq = s.seq.load(std::memory_order_acquire);
+    if (seq != tail + 1) {
+        return false;
+    }
+
+    out = s.record;
+    // free the slot for the writer one lap ahead
+    s.seq.store(tail + LOG_RING_SIZE, std::memory_order_release);
+    tail++;
+    return true;
+}
+
+void Logger::Run() {
+    log_record record{};
+    while (true) {
+        bool any = false;
+        {
+            std::lock_guard<std::mutex> lock(sinkMutex);
+            while (Pop(record)) {
+                sink(record);
+                any = true;
+                flushed.fetch_add(1, std::memory_order_release);
+            }
+        }
+
+        if (!any) {
+            if (!running.load(std::memory_order_relaxed)) {
+                break;
+            }
+            std::this_thread::sleep_for(LOG_IDLE_SLEEP);
+        }
+    }
+}
+
+void Logger::Flush() {
+    // dropped records never claimed a position, so head is exactly what the sink will see
+    size_t target = head.load(std::memory_order_acquire);
+    while (flushed.load(std::memory_order_acquire) < target) {
+        if (!flusher.joinable()) {
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+uint64_t Logger::Dropped() const {
+    return dropped.load(std::memory_order_relaxed);
+}
+
+static void FormatTime(int64_t timeUs, char* out, size_t size) {
+    time_t sec = (time_t)(timeUs / 1000000);
+    struct tm tmv {};
+#ifdef _WIN32
+    localtime_s(&tmv, &sec);
+#else
+    localtime_r(&sec, &tmv);
+#endif
+    size_t n = strftime(out, size, "%Y-%m-%d %H:%M:%S", &tmv);
+    snprintf(out + n, size - n, ".%06d", (int)(timeUs % 1000000));
+}
+
+void Logger::StderrSink(const log_record& record) {
+    char timeStr[40];
+    FormatTime(record.timeUs, timeStr, sizeof(timeStr));
+    fprintf(stderr, "%s %-5s [%llx] %s: %s\n", timeStr, LevelName(record.level),
+        (unsigned long long)(record.threadId & 0xffffff), record.func, record.msg);
+}
+
+void Logger::JsonSink(const log_record& record) {
+    // escape the message, everything else is plain
+    char msg[LOG_MSG_SIZE * 2];
+    size_t n = 0;
+    for (const char* p = record.msg; *p && n + 7 < sizeof(msg); p++) {
+        unsigned char ch = (unsigned char)*p;
+        if (ch == '"' || ch == '\\') {
+            msg[n++] = '\\';
+            msg[n++] = (char)ch;
+        }
+        else if (ch < 0x20) {
+            n += snprintf(msg + n, sizeof(msg) - n, "\\u%04x", ch);
+        }
+        else {
+            msg[n++] = (char)ch;
+        }
+    }
+    msg[n] = '\0';
+
+    fprintf(stderr, "{\"ts_us\":%lld,\"level\":\"%s\",\"thread\":%llu,\"func\":\"%s\",\"msg\":\"%s\"}\n",
+        (long long)record.timeUs, LevelName(record.level), (unsigned long long)record.threadId, record.func, msg);
+}
+
+const char* Logger::LevelName(LOG_LEVEL level) {
+    switch (level) {
+    case LEVEL_TRACE:
+        return "TRACE";
+    case LEVEL_DEBUG:
+        return "DEBUG";
+    case LEVEL_INFO:
+        return "INFO";
+    case LEVEL_WARN:
+        return "WARN";
+    case LEVEL_ERROR:
+        return "ERROR";
+    default:
+        return "OFF";
+    }
+}
@@ -0,0 +1,104 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+enum LOG_LEVEL {
+	LEVEL_TRACE,
+	LEVEL_DEBUG,
+	LEVEL_INFO,
+	LEVEL_WARN,
+	LEVEL_ERROR,
+	LEVEL_OFF
+};
+
+// calls below this level are removed at compile time, define before including to change it
+#ifndef MINSFTP_LOG_MIN_LEVEL
+#define MINSFTP_LOG_MIN_LEVEL LEVEL_DEBUG
+#endif
+
+constexpr size_t LOG_MSG_SIZE = 224;
+constexpr size_t LOG_RING_SIZE = 4096; // power of two
+
+struct log_record {
+	int64_t timeUs{}; // system clock, microseconds since epoch
+	uint64_t threadId{};
+	LOG_LEVEL level{ LEVEL_INFO };
+	const char* func{ "" }; // function that logged, static storage
+	char msg[LOG_MSG_SIZE]{}; // formatted message, truncated to fit
+};
+
+// leveled logger: the calling thread formats into a slot of a lock-free ring buffer,
+// a background thread hands records to the sink
+// if the ring is full records are dropped (see Dropped()) instead of blocking the caller
+class Logger {
+public:
+	using sink_fn = std::function<void(const log_record&)>;
+
+	static Logger& Instance();
+	~Logger();
+
+	bool Enabled(LOG_LEVEL level) const {
+		return level >= minLevel.load(std::memory_order_relaxed);
+	}
+	void SetLevel(LOG_LEVEL level);
+	LOG_LEVEL Level() const;
+
+	// runs on the flusher thread, nullptr restores StderrSink
+	void SetSink(sink_fn sink);
+
+#if defined(__GNUC__)
+	__attribute__((format(printf, 4, 5)))
+#endif
+	void Write(LOG_LEVEL level, const char* func, const char* fmt, ...);
+
+	// block until everything logged so far reached the sink
+	void Flush();
+	uint64_t Dropped() const;
+
+	static void StderrSink(const log_record& record);
+	// one json object per line on stderr
+	static void JsonSink(const log_record& record);
+	static const char* LevelName(LOG_LEVEL level);
+
+private:
+	struct slot {
+		std::atomic<size_t> seq{};
+		log_record record{};
+	};
+
+	Logger();
+	void Run();
+	bool Pop(log_record& out);
+
+	slot ring[LOG_RING_SIZE];
+	std::atomic<size_t> head{}; // next slot to write
+	size_t tail{}; // next slot to read, flusher only
+	std::atomic<size_t> flushed{}; // records handed to the sink
+
+	std::atomic<LOG_LEVEL> minLevel{ LEVEL_INFO };
+	std::atomic<uint64_t> dropped{};
+	std::atomic<bool> running{ true };
+
+	std::mutex sinkMutex{};
+	sink_fn sink{};
+	std::thread flusher{};
+};
+
+#define MINSFTP_LOG(level, ...) \
+	do { \
+		if constexpr ((level) >= MINSFTP_LOG_MIN_LEVEL) { \
+			Logger& _logger = Logger::Instance(); \
+			if (_logger.Enabled(level)) { \
+				_logger.Write(level, __func__, __VA_ARGS__); \
+			} \
+		} \
+	} while (0)
+
+#define MINSFTP_TRACE(...) MINSFTP_LOG(LEVEL_TRACE, __VA_ARGS__)
+#define MINSFTP_DEBUG(...) MINSFTP_LOG(LEVEL_DEBUG, __VA_ARGS__)
+#define MINSFTP_INFO(...) MINSFTP_LOG(LEVEL_INFO, __VA_ARGS__)
+#define MINSFTP_WARN(...) MINSFTP_LOG(LEVEL_WARN, __VA_ARGS__)
+#define MINSFTP_ERROR(...) MINSFTP_LOG(LEVEL_ERROR, __VA_ARGS__)
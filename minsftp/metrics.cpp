@@ -0,0 +1,186 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <stdio.h>
+
+static int64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t histogram_snapshot::Count() const {
+    uint64_t total = 0;
+    for (uint64_t n : buckets) {
+        total += n;
+    }
+    return total;
+}
+
+uint64_t histogram_snapshot::PercentileUs(double p) const {
+    uint64_t total = Count();
+    if (!total) {
+        return 0;
+    }
+
+    // rank of the sample we are looking for, 1 based
+    uint64_t rank = (uint64_t)(p / 100.0 * total + 0.5);
+    rank = std::max<uint64_t>(1, std::min(rank, total));
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return Metrics::BucketUpperUs(i);
+        }
+    }
+    return Metrics::BucketUpperUs(buckets.size() - 1);
+}
+
+double op_snapshot::MeanUs() const {
+    return count ? (double)totalUs / count : 0;
+}
+
+std::string metrics_snapshot::ToJson() const {
+    std::string json{};
+    char line[512];
+    for (int op = 0; op < OP_COUNT; op++) {
+        const op_snapshot& s = ops[op];
+        if (!s.count) {
+            continue;
+        }
+        snprintf(line, sizeof(line),
+            "{\"op\":\"%s\",\"count\":%llu,\"errors\":%llu,\"bytes\":%llu,\"ops_per_s\":%.1f,\"mb_per_s\":%.3f,"
+            "\"mean_us\":%.1f,\"p50_us\":%llu,\"p90_us\":%llu,\"p99_us\":%llu,\"p999_us\":%llu,\"max_us\":%llu}\n",
+            Metrics::OpName((METRIC_OP)op), (unsigned long long)s.count, (unsigned long long)s.errors, (unsigned long long)s.bytes,
+            elapsedSec > 0 ? s.count / elapsedSec : 0, elapsedSec > 0 ? s.bytes / (1024.0 * 1024.0) / elapsedSec : 0,
+            s.MeanUs(), (unsigned long long)s.latency.PercentileUs(50), (unsigned long long)s.latency.PercentileUs(90),
+            (unsigned long long)s.latency.PercentileUs(99), (unsigned long long)s.latency.PercentileUs(99.9), (unsigned long long)s.maxUs);
+        json += line;
+    }
+    return json;
+}
+
+Metrics::Metrics() {
+    startNs = NowNs();
+}
+
+size_t Metrics::BucketIndex(uint64_t us) {
+    const uint64_t exact = (uint64_t)1 << HIST_SUB_BITS;
+    if (us < exact) {
+        return (size_t)us;
+    }
+
+    int msb = 63;
+    while (!(us >> msb)) {
+        msb--;
+    }
+    if (msb >= HIST_MAX_BITS) {
+        return HIST_BUCKETS - 1;
+    }
+
+    // keep the top HIST_SUB_BITS bits, the highest one is always set
+    int shift = msb - (HIST_SUB_BITS - 1);
+    size_t sub = (size_t)(us >> shift) - (exact >> 1);
+    return (size_t)exact + (size_t)(shift - 1) * (exact >> 1) + sub;
+}
+
+uint64_t Metrics::BucketUpperUs(size_t index) {
+    const uint64_t exact = (uint64_t)1 << HIST_SUB_BITS;
+    if (index < exact) {
+        return index;
+    }
+
+    size_t rel = index - (size_t)exact;
+    int shift = (int)(rel / (exact >> 1)) + 1;
+    uint64_t sub = (exact >> 1) + rel % (exact >> 1);
+    return ((sub + 1) << shift) - 1;
+}
+
+void Metrics::Record(METRIC_OP op, std::chrono::steady_clock::duration latency, uint64_t bytes, bool ok) {
+    if (op < 0 || op >= OP_COUNT) {
+        return;
+    }
+
+    int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+    uint64_t value = us > 0 ? (uint64_t)us : 0;
+
+    op_counters& c = ops[op];
+    c.count.fetch_add(1, std::memory_order_relaxed);
+    if (!ok) {
+        c.errors.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (bytes) {
+        c.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+    c.totalUs.fetch_add(value, std::memory_order_relaxed);
+    c.buckets[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t prevMax = c.maxUs.load(std::memory_order_relaxed);
+    while (value > prevMax && !c.maxUs.compare_exchange_weak(prevMax, value, std::memory_order_relaxed)) {
+    }
+}
+
+metrics_snapshot Metrics::Snapshot() const {
+    metrics_snapshot snap{};
+    snap.elapsedSec = (NowNs() - startNs.load(std::memory_order_relaxed)) / 1e9;
+
+    for (int op = 0; op < OP_COUNT; op++) {
+        const op_counters& c = ops[op];
+        op_snapshot& s = snap.ops[op];
+        s.count = c.count.load(std::memory_order_relaxed);
+        s.errors = c.errors.load(std::memory_order_relaxed);
+        s.bytes = c.bytes.load(std::memory_order_relaxed);
+        s.totalUs = c.totalUs.load(std::memory_order_relaxed);
+        s.maxUs = c.maxUs.load(std::memory_order_relaxed);
+        if (s.count) {
+            s.latency.buckets.resize(HIST_BUCKETS);
+            for (size_t i = 0; i < HIST_BUCKETS; i++) {
+                s.latency.buckets[i] = c.buckets[i].load(std::memory_order_relaxed);
+            }
+        }
+    }
+    return snap;
+}
+
+void Metrics::Reset() {
+    for (int op = 0; op < OP_COUNT; op++) {
+        op_counters& c = ops[op];
+        c.count.store(0, std::memory_order_relaxed);
+        c.errors.store(0, std::memory_order_relaxed);
+        c.bytes.store(0, std::memory_order_relaxed);
+        c.totalUs.store(0, std::memory_order_relaxed);
+        c.maxUs.store(0, std::memory_order_relaxed);
+        for (auto& bucket : c.buckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+    startNs = NowNs();
+}
+
+const char* Metrics::OpName(METRIC_OP op) {
+    switch (op) {
+    case OP_OPEN:
+        return "open";
+    case OP_READ:
+        return "read";
+    case OP_WRITE:
+        return "write";
+    case OP_CLOSE:
+        return "close";
+    case OP_STAT:
+        return "stat";
+    case OP_READDIR:
+        return "readdir";
+    case OP_RENAME:
+        return "rename";
+    case OP_REMOVE:
+        return "remove";
+    case OP_MKDIR:
+        return "mkdir";
+    case OP_HANDSHAKE:
+        return "handshake";
+    case OP_AUTH:
+        return "auth";
+    default:
+        return "unknown";
+    }
+}
@@ -0,0 +1,106 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum METRIC_OP {
+	OP_OPEN,
+	OP_READ,
+	OP_WRITE,
+	OP_CLOSE,
+	OP_STAT,
+	OP_READDIR,
+	OP_RENAME,
+	OP_REMOVE,
+	OP_MKDIR,
+	OP_HANDSHAKE,
+	OP_AUTH,
+	OP_COUNT
+};
+
+// log-linear (HdrHistogram style) latency buckets in microseconds:
+// values below 2^HIST_SUB_BITS are exact, above that every power of two is split
+// into 2^(HIST_SUB_BITS - 1) buckets, so the relative error stays below ~3%
+constexpr int HIST_SUB_BITS = 6;
+constexpr int HIST_MAX_BITS = 40; // ~12 days
+constexpr size_t HIST_BUCKETS = ((size_t)1 << HIST_SUB_BITS) + (size_t)(HIST_MAX_BITS - HIST_SUB_BITS + 1) * ((size_t)1 << (HIST_SUB_BITS - 1));
+
+struct histogram_snapshot {
+	std::vector<uint64_t> buckets{};
+
+	uint64_t Count() const;
+	// latency in microseconds at percentile p (0-100), upper edge of the bucket
+	uint64_t PercentileUs(double p) const;
+};
+
+struct op_snapshot {
+	uint64_t count{};
+	uint64_t errors{};
+	uint64_t bytes{};
+	uint64_t totalUs{};
+	uint64_t maxUs{};
+	histogram_snapshot latency{};
+
+	double MeanUs() const;
+};
+
+struct metrics_snapshot {
+	op_snapshot ops[OP_COUNT]{};
+	double elapsedSec{}; // since creation or the last Reset()
+
+	// one json object per op that has samples, one per line
+	std::string ToJson() const;
+};
+
+// per operation counters and latency histograms
+// recording is a few relaxed atomic increments, safe to share between sessions and threads
+class Metrics {
+public:
+	Metrics();
+
+	void Record(METRIC_OP op, std::chrono::steady_clock::duration latency, uint64_t bytes = 0, bool ok = true);
+	metrics_snapshot Snapshot() const;
+	// not atomic with concurrent Record() calls, samples recorded meanwhile may be split
+	void Reset();
+
+	static const char* OpName(METRIC_OP op);
+	static size_t BucketIndex(uint64_t us);
+	static uint64_t BucketUpperUs(size_t index);
+
+private:
+	struct op_counters {
+		std::atomic<uint64_t> count{};
+		std::atomic<uint64_t> errors{};
+		std::atomic<uint64_t> bytes{};
+		std::atomic<uint64_t> totalUs{};
+		std::atomic<uint64_t> maxUs{};
+		std::atomic<uint64_t> buckets[HIST_BUCKETS]{};
+	};
+
+	op_counters ops[OP_COUNT]{};
+	std::atomic<int64_t> startNs{};
+};
+
+// times one call and records it, metrics may be null
+class MetricTimer {
+public:
+	MetricTimer(Metrics* _metrics, METRIC_OP _op)
+		: metrics(_metrics), op(_op), start(_metrics ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{}) {}
+
+	void Stop(bool ok, uint64_t bytes = 0) {
+		if (metrics) {
+			metrics->Record(op, std::chrono::steady_clock::now() - start, bytes, ok);
+			metrics = nullptr;
+		}
+	}
+	~MetricTimer() {
+		Stop(true);
+	}
+
+private:
+	Metrics* metrics;
+	METRIC_OP op;
+	std::chrono::steady_clock::time_point start;
+};
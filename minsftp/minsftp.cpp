@@ -1,5 +1,46 @@
 #include "minsftp.h"
+#include "remote_file.h"
+#include "sftp_channel.h"
+#include "tree_walker.h"
+#include "exec_channel.h"
+#include "tar_stream.h"
+#include "bulk_transfer.h"
+#include "shared_session.h"
+
+constexpr size_t NATIVE_CHUNK_MIN = 32 * 1024; // the read/write size every server accepts
+constexpr size_t NATIVE_CHUNKS_IN_FLIGHT = 16; // per ReadBytes/WriteBytes in native mode, more on a large bdp
+
+// the parts of a reply native calls use after it was dispatched
+struct native_reply {
+    uint8_t type{}; // 0 if the channel is gone
+    uint32_t status{ LIBSSH2_FX_OK };
+    std::string handle{};
+    LIBSSH2_SFTP_ATTRIBUTES attrs{};
+
+    bool Ok() const {
+        return type != 0 && status == LIBSSH2_FX_OK;
+    }
+};
+
+// queue one request on the pipelining channel and wait for its reply, recorded as op
+static native_reply NativeCall(SftpChannel* ch, Metrics* metrics, METRIC_OP op,
+    const std::function<void(SftpChannel::reply_fn)>& submit) {
+    native_reply result{};
+    if (!ch) {
+        return result;
+    }
 
+    MetricTimer timer(metrics, op);
+    submit([&result](const sftp_reply& reply) {
+        result.type = reply.type;
+        result.status = reply.status;
+        result.handle = reply.handle;
+        result.attrs = reply.attrs;
+    });
+    ch->Drain();
+    timer.Stop(result.Ok());
+    return result;
+}
 
 static void kbd_callback(const char* name, int name_len,
     const char* instruction, int instruction_len,
@@ -13,6 +54,8 @@ static void kbd_callback(const char* name, int name_len,
     char buf[1024];
     (void)abstract;
 
+    // this is a prompt for the user at the terminal, not logging, so it stays on stderr
+
     fprintf(stderr, "keyboard-interactive authentication.\n");
 
     fprintf(stderr, "authentication name: '");
@@ -55,44 +98,37 @@ static void kbd_callback(const char* name, int name_len,
 
 Client::Client(const char* format) {
     if (!IsValidFormat(format)) {
-        fprintf(stderr, "invalid format: %s\n", format);
+        MINSFTP_ERROR("invalid format: %s", format);
         return;
     }
 
-    size_t hostAddrPos = strchr(format, '@') - format + 1;
-    size_t portPos = strchr(format, ':') - format + 1;
-
-    size_t userLen = hostAddrPos - 1;
-    size_t hostAddrLen = portPos - hostAddrPos - 1;
-    size_t portLen = strlen(format) - portPos;
-
     std::string fmt(format);
-    std::string _user = fmt.substr(0, userLen);
-    std::string _hostaddr = fmt.substr(hostAddrPos, hostAddrLen);
-    std::string _port = fmt.substr(portPos, portLen);
+    size_t hostPos = fmt.find('@') + 1;
+    size_t portPos = fmt.rfind(':') + 1;
+
+    user = fmt.substr(0, hostPos - 1);
+    host = fmt.substr(hostPos, portPos - hostPos - 1);
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+    port = (u_short)std::stoi(fmt.substr(portPos));
 
-    user = _user;
-    hostaddr = inet_addr(_hostaddr.c_str());
-    port = (u_short)std::stoi(_port.c_str());
+    Resolver::Prefetch(host, port);
 }
 
 bool Client::IsValidFormat(const char* format) {
-    size_t userPos{ 0 };
-    size_t hostAddrPos = NULL;
-    size_t portPos = NULL;
-
-    size_t len = strlen(format);
-    for (int i = 0; i < len; i++) {
-        char ch = format[i];
-        if (ch == '@') {
-            hostAddrPos = i;
-        }
-        else if (ch == ':') {
-            portPos = i;
-        }
+    std::string fmt(format);
+    size_t hostPos = fmt.find('@');
+    size_t portPos = fmt.rfind(':');
+    if (hostPos == std::string::npos || portPos == std::string::npos || portPos <= hostPos + 1) {
+        return false;
     }
-
-    return hostAddrPos != NULL && portPos != NULL;
+    if (portPos + 1 == fmt.size() || fmt.find_first_not_of("0123456789", portPos + 1) != std::string::npos) {
+        return false;
+    }
+    // an ipv6 address must be bracketed, its colons would be taken for the port separator
+    std::string host = fmt.substr(hostPos + 1, portPos - hostPos - 1);
+    return host.front() == '[' ? host.back() == ']' : host.find(':') == std::string::npos;
 }
 
 
@@ -120,30 +156,33 @@ minsftp::~minsftp() {
 
 MINSFTP_RES minsftp::Init() {
     int i, auth_pw = 0;
-    struct sockaddr_in sin;
     const char* fingerprint;
     char* userauthlist;
     int rc;
     
+#ifdef WIN32
     WSADATA wsadata;
+#endif
     
     // check if auth type is set
     if (authType == AUTH_NOT_SET) {
-        fprintf(stderr, "not auth type selected\n");
+        MINSFTP_ERROR("not auth type selected");
         return RES_NOT_INITIALIZED;
     }
 
+#ifdef WIN32
     // initialize Winsock library for windows
     rc = WSAStartup(MAKEWORD(2, 0), &wsadata);
     if (rc) {
-        fprintf(stderr, "WSAStartup failed with error: %d\n", rc);
+        MINSFTP_ERROR("WSAStartup failed with error: %d", rc);
         return RES_WSA_FAILED;
     }
+#endif
     
     // init libssh2 library
     rc = libssh2_init(0);
     if (rc) {
-        fprintf(stderr, "libssh2 initialization failed (%d)\n", rc);
+        MINSFTP_ERROR("libssh2 initialization failed (%d)", rc);
         return RES_INIT_LIBSSH2_FAILED;
     }
     
@@ -151,42 +190,70 @@ MINSFTP_RES minsftp::Init() {
         * The application code is responsible for creating the socket
         * and establishing the connection
         */
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == LIBSSH2_INVALID_SOCKET) {
-        fprintf(stderr, "failed to create socket.\n");
+    std::vector<resolved_address> addresses = Resolver::Lookup(client.host, client.port, connectOptions);
+    if (addresses.empty()) {
+        MINSFTP_ERROR("no address for %s", client.host.c_str());
         Shutdown();
-        return RES_SOCKET_FAILED;
+        return RES_CONNECTION_FAILED;
     }
-    
-    sin.sin_family = AF_INET;
-    sin.sin_port = htons(client.port);
-    sin.sin_addr.s_addr = client.hostaddr;
-    if (connect(sock, (struct sockaddr*)(&sin), sizeof(struct sockaddr_in))) {
-        fprintf(stderr, "failed to connect.\n");
+
+    // all addresses are raced, the first to accept the connection wins
+    size_t winner = 0;
+    auto connectStart = std::chrono::steady_clock::now();
+    sock = ConnectFastest(addresses, connectOptions, &winner,
+        [this](libssh2_socket_t s) { PrepareSocket(s, socketOptions); });
+    if (sock == LIBSSH2_INVALID_SOCKET) {
+        MINSFTP_ERROR("failed to connect to %s.", HostKey().c_str());
+        if (concurrency) {
+            concurrency->OnError();
+        }
         Shutdown();
         return RES_CONNECTION_FAILED;
     }
+    Resolver::Remember(client.host, client.port, addresses[winner]);
+    peer = addresses[winner].ToString();
+    bdp = TuneSocket(sock, socketOptions, std::chrono::steady_clock::now() - connectStart);
     
-    /* Create a session instance */
-    session = libssh2_session_init();
+    /* Create a session instance, callbacks find this object through the abstract */
+    session = libssh2_session_init_ex(NULL, NULL, NULL, this);
     
     if (!session) {
-        fprintf(stderr, "Could not initialize SSH session.\n");
+        MINSFTP_ERROR("Could not initialize SSH session.");
         Shutdown();
         return RES_INIT_SSH_SESSION_FAILED;
     }
     
     /* Since we have set non-blocking, tell libssh2 we are blocking */
     libssh2_session_set_blocking(session, 1);
+    libssh2_session_set_timeout(session, keepalive.timeoutMs);
+
+    if (transport || uploadLimit || downloadLimit) {
+        InstallTransport();
+    }
     
+    rc = ApplyMethodPrefs();
+    if (rc) {
+        MINSFTP_ERROR("failed to set method preferences: %d", rc);
+        Shutdown();
+        return RES_METHOD_PREF_FAILED;
+    }
     
     /* ... start it up. This will trade welcome banners, exchange keys,
         * and setup crypto, compression, and MAC layers
         */
+    auto handshakeStart = std::chrono::steady_clock::now();
     rc = libssh2_session_handshake(session, sock);
+    auto handshakeTime = std::chrono::steady_clock::now() - handshakeStart;
+    handshakeMs = std::chrono::duration<double, std::milli>(handshakeTime).count();
+    if (metrics) {
+        metrics->Record(OP_HANDSHAKE, handshakeTime, 0, rc == 0);
+    }
     
     if (rc) {
-        fprintf(stderr, "Failure establishing SSH session: %d\n", rc);
+        MINSFTP_ERROR("Failure establishing SSH session: %d", rc);
+        if (concurrency) {
+            concurrency->OnError();
+        }
         Shutdown();
         return RES_SSH_SESSION_START_FAILED;
     }
@@ -197,18 +264,20 @@ MINSFTP_RES minsftp::Init() {
         */
     fingerprint = libssh2_hostkey_hash(session, LIBSSH2_HOSTKEY_HASH_SHA1);
     
-    fprintf(stderr, "Fingerprint: ");
+    char fingerprintHex[20 * 3 + 1]{};
     for (i = 0; i < 20; i++) {
-        fprintf(stderr, "%02X ", (unsigned char)fingerprint[i]);
+        snprintf(fingerprintHex + i * 3, 4, "%02X ", (unsigned char)fingerprint[i]);
     }
-    fprintf(stderr, "\n");
+    MINSFTP_DEBUG("Fingerprint: %s", fingerprintHex);
     
+    MetricTimer authTimer(metrics.get(), OP_AUTH);
+
     /* check what authentication methods are available */
     userauthlist = libssh2_userauth_list(session, client.User(),
         (unsigned int)strlen(client.User()));
 
     if (userauthlist) {
-        fprintf(stderr, "Authentication methods: %s\n", userauthlist);
+        MINSFTP_DEBUG("Authentication methods: %s", userauthlist);
         if (strstr(userauthlist, "password")) {
             auth_pw |= 1;
         }
@@ -223,7 +292,8 @@ MINSFTP_RES minsftp::Init() {
         case AUTH_PASSWORD:
             // authenticate using password
             if (libssh2_userauth_password(session, client.User(), password.password.c_str())) {
-                fprintf(stderr, "Authentication by password failed.\n");
+                MINSFTP_ERROR("Authentication by password failed.");
+                authTimer.Stop(false);
                 Shutdown();
                 return RES_AUTH_PASS_FAILED;
             }
@@ -231,14 +301,13 @@ MINSFTP_RES minsftp::Init() {
         case AUTH_KEYBOARD:
             // authenticate via keyboard-interactive
             if (libssh2_userauth_keyboard_interactive(session, client.User(), &kbd_callback)) {
-                fprintf(stderr,
-                    "Authentication by keyboard-interactive failed.\n");
+                MINSFTP_ERROR("Authentication by keyboard-interactive failed.");
+                authTimer.Stop(false);
                 Shutdown();
                 return RES_AUTH_KEYBOARD_FAILED;
             }
             else {
-                fprintf(stderr,
-                    "Authentication by keyboard-interactive succeeded.\n");
+                MINSFTP_DEBUG("Authentication by keyboard-interactive succeeded.");
             }
             break;
         case AUTH_PUBKEY:
@@ -250,42 +319,54 @@ MINSFTP_RES minsftp::Init() {
                 reinterpret_cast<const char*>(pubkey.privKeyData.data()), pubkey.privKeyData.size(), pubkey.passphrase.c_str()); // priv key
             
             if (res) {
-                fprintf(
-                    stderr,
-                    "authentication by public key failed.\nuser: %s userlen: %llu\npassphrase %s\n",
-                    client.User(), client.user.length(), pubkey.passphrase.c_str());
+                MINSFTP_ERROR("authentication by public key failed. user: %s userlen: %zu",
+                    client.User(), client.user.length());
+                authTimer.Stop(false);
                 Shutdown();
                 return RES_AUTH_PUBKEY_FAILED;
             }
             else {
-                fprintf(stderr, "authentication by public key succeeded.\n");
+                MINSFTP_DEBUG("authentication by public key succeeded.");
             }
             break;
         }
         default:
-            fprintf(stderr, "no supported authentication methods found.\n");
+            MINSFTP_ERROR("no supported authentication methods found.");
+            authTimer.Stop(false);
             Shutdown();
             return RES_NO_AUTH_METHODS;
             break;
         }
     }
     
-    printf("libssh2_sftp_init().\n");
+    authTimer.Stop(true);
+
+    MINSFTP_DEBUG("libssh2_sftp_init().");
     
     sftp_session = libssh2_sftp_init(session);
     
     
     if (!sftp_session) {
-        fprintf(stderr, "unable to init sftp session\n");
+        MINSFTP_ERROR("unable to init sftp session");
         Shutdown();
         return RES_INIT_SFTP_FAILED;
     }
     
+    if (keepalive.intervalSec > 0) {
+        libssh2_keepalive_config(session, 1, (unsigned)keepalive.intervalSec);
+    }
+    lastActivity = std::chrono::steady_clock::now();
+
     libssh2_initialized = true;
     return RES_OK;
 }
 void minsftp::Shutdown() {
+    generation++;
+
+    channel.reset();
+
     if (sftp_session) {
+        handleCache.Clear();
         libssh2_sftp_shutdown(sftp_session);
         sftp_session = nullptr;
     }
@@ -305,6 +386,7 @@ void minsftp::Shutdown() {
 #endif
         sock = LIBSSH2_INVALID_SOCKET;  // set to invalid socket after closing
     }
+    peer.clear();
 
     // libssh2_exit() should be called only once per application lifetime
     // It might be best to ensure it's not called multiple times.
@@ -324,6 +406,210 @@ FILE_DATA minsftp::ReadPrivateKeyFromFile(const std::string path) {
     return data;
 }
 
+int minsftp::ApplyMethodPrefs() {
+    const std::pair<int, const std::string*> prefs[] = {
+        { LIBSSH2_METHOD_KEX, &methodPrefs.kex },
+        { LIBSSH2_METHOD_HOSTKEY, &methodPrefs.hostkey },
+        { LIBSSH2_METHOD_CRYPT_CS, &methodPrefs.crypt },
+        { LIBSSH2_METHOD_CRYPT_SC, &methodPrefs.crypt },
+        { LIBSSH2_METHOD_MAC_CS, &methodPrefs.mac },
+        { LIBSSH2_METHOD_MAC_SC, &methodPrefs.mac },
+        { LIBSSH2_METHOD_COMP_CS, &methodPrefs.comp },
+        { LIBSSH2_METHOD_COMP_SC, &methodPrefs.comp },
+    };
+
+    for (const auto& pref : prefs) {
+        if (pref.second->empty()) {
+            continue;
+        }
+
+        // libssh2 drops names it doesn't know and fails only if nothing is left
+        int rc = libssh2_session_method_pref(session, pref.first, pref.second->c_str());
+        if (rc) {
+            MINSFTP_ERROR("method_pref %d '%s' rejected: %d", pref.first, pref.second->c_str(), rc);
+            return rc;
+        }
+    }
+    return 0;
+}
+
+void minsftp::SetMethodPrefs(const method_prefs& prefs) {
+    methodPrefs = prefs;
+}
+const method_prefs& minsftp::MethodPrefs() const {
+    return methodPrefs;
+}
+method_prefs minsftp::FastMethodPrefs() {
+    method_prefs prefs{};
+    prefs.kex = "curve25519-sha256,curve25519-sha256@libssh.org,ecdh-sha2-nistp256,diffie-hellman-group14-sha256";
+
+    // with AES-NI aes-gcm/aes-ctr are several times faster than chacha20, without it the order flips
+    if (utils::CpuHasAesNi()) {
+        prefs.crypt = "aes128-gcm@openssh.com,aes128-ctr,aes256-gcm@openssh.com,aes256-ctr,chacha20-poly1305@openssh.com";
+    }
+    else {
+        prefs.crypt = "chacha20-poly1305@openssh.com,aes128-ctr,aes128-gcm@openssh.com,aes256-ctr,aes256-gcm@openssh.com";
+    }
+
+    // etm macs are cheaper to verify, ignored for aead ciphers
+    prefs.mac = "hmac-sha2-256-etm@openssh.com,hmac-sha2-256,hmac-sha1-etm@openssh.com,hmac-sha1,hmac-sha2-512";
+    return prefs;
+}
+double minsftp::HandshakeMs() const {
+    return handshakeMs;
+}
+
+// names from candidates that the linked libssh2 supports for methodType, in candidate order
+static std::vector<std::string> SupportedMethods(LIBSSH2_SESSION* session, int methodType, const std::vector<std::string>& candidates) {
+    std::vector<std::string> supported{};
+    const char** algs = nullptr;
+    int count = libssh2_session_supported_algs(session, methodType, &algs);
+    if (count <= 0) {
+        return supported;
+    }
+
+    for (const std::string& candidate : candidates) {
+        for (int i = 0; i < count; i++) {
+            if (candidate == algs[i]) {
+                supported.push_back(candidate);
+                break;
+            }
+        }
+    }
+    libssh2_free(session, algs);
+    return supported;
+}
+
+// connect with prefs and measure handshake and (if testBytes > 0) write/read throughput
+static method_bench_result BenchmarkTrial(const Client& client, AUTH_TYPE authType, void* authVal, const method_prefs& prefs,
+    const std::string& remoteTestPath, const FILE_DATA& testData) {
+    method_bench_result result{};
+    result.prefs = prefs;
+
+    minsftp sftp(client, authType, authVal);
+    sftp.SetMethodPrefs(prefs);
+    result.res = sftp.Init();
+    if (result.res != RES_OK) {
+        return result;
+    }
+    result.handshakeMs = sftp.HandshakeMs();
+
+    if (!testData.empty()) {
+        double mb = testData.size() / (1024.0 * 1024.0);
+
+        auto start = std::chrono::steady_clock::now();
+        result.res = sftp.WriteBytes(remoteTestPath, testData);
+        double writeSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (result.res != RES_OK) {
+            return result;
+        }
+
+        FILE_DATA readBack{};
+        start = std::chrono::steady_clock::now();
+        result.res = sftp.ReadBytes(remoteTestPath, readBack);
+        double readSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        sftp.SftpDeleteFile(remoteTestPath);
+        if (result.res != RES_OK) {
+            return result;
+        }
+
+        result.writeMBps = writeSec > 0 ? mb / writeSec : 0;
+        result.readMBps = readSec > 0 ? mb / readSec : 0;
+    }
+
+    sftp.Shutdown();
+    return result;
+}
+
+std::vector<method_bench_result> minsftp::BenchmarkMethods(Client client, AUTH_TYPE authType, void* authVal,
+    const std::string remoteTestPath, size_t testBytes, method_prefs* recommended) {
+    std::vector<method_bench_result> results{};
+
+    const std::vector<std::string> kexCandidates = {
+        "curve25519-sha256", "curve25519-sha256@libssh.org", "ecdh-sha2-nistp256", "ecdh-sha2-nistp384",
+        "diffie-hellman-group14-sha256", "diffie-hellman-group16-sha512", "diffie-hellman-group-exchange-sha256",
+    };
+    const std::vector<std::string> cryptCandidates = {
+        "aes128-gcm@openssh.com", "aes256-gcm@openssh.com", "aes128-ctr", "aes192-ctr", "aes256-ctr",
+        "chacha20-poly1305@openssh.com",
+    };
+    const std::vector<std::string> macCandidates = {
+        "hmac-sha2-256-etm@openssh.com", "hmac-sha2-512-etm@openssh.com", "hmac-sha1-etm@openssh.com",
+        "hmac-sha2-256", "hmac-sha2-512", "hmac-sha1",
+    };
+
+    // ask the linked libssh2 which of the candidates it implements
+    if (libssh2_init(0)) {
+        return results;
+    }
+    LIBSSH2_SESSION* probe = libssh2_session_init();
+    if (!probe) {
+        libssh2_exit();
+        return results;
+    }
+    std::vector<std::string> kexList = SupportedMethods(probe, LIBSSH2_METHOD_KEX, kexCandidates);
+    std::vector<std::string> cryptList = SupportedMethods(probe, LIBSSH2_METHOD_CRYPT_CS, cryptCandidates);
+    std::vector<std::string> macList = SupportedMethods(probe, LIBSSH2_METHOD_MAC_CS, macCandidates);
+    libssh2_session_free(probe);
+    libssh2_exit();
+
+    FILE_DATA testData(testBytes);
+    for (size_t i = 0; i < testData.size(); i++) {
+        testData[i] = (uint8_t)(i * 2654435761u >> 24); // not all zeroes in case compression gets negotiated
+    }
+
+    method_prefs best = FastMethodPrefs();
+
+    // key exchange only affects the handshake
+    double bestHandshake = -1;
+    for (const std::string& kex : kexList) {
+        method_prefs prefs = best;
+        prefs.kex = kex;
+        method_bench_result result = BenchmarkTrial(client, authType, authVal, prefs, remoteTestPath, FILE_DATA{});
+        if (result.res == RES_OK && (bestHandshake < 0 || result.handshakeMs < bestHandshake)) {
+            bestHandshake = result.handshakeMs;
+            best.kex = kex;
+        }
+        results.push_back(result);
+    }
+
+    // ciphers decide bulk throughput
+    double bestThroughput = -1;
+    for (const std::string& crypt : cryptList) {
+        method_prefs prefs = best;
+        prefs.crypt = crypt;
+        method_bench_result result = BenchmarkTrial(client, authType, authVal, prefs, remoteTestPath, testData);
+        double throughput = result.writeMBps + result.readMBps;
+        if (result.res == RES_OK && throughput > bestThroughput) {
+            bestThroughput = throughput;
+            best.crypt = crypt;
+        }
+        results.push_back(result);
+    }
+
+    // macs only matter for non aead ciphers
+    bool aead = best.crypt.find("gcm") != std::string::npos || best.crypt.find("poly1305") != std::string::npos;
+    if (!aead) {
+        bestThroughput = -1;
+        for (const std::string& mac : macList) {
+            method_prefs prefs = best;
+            prefs.mac = mac;
+            method_bench_result result = BenchmarkTrial(client, authType, authVal, prefs, remoteTestPath, testData);
+            double throughput = result.writeMBps + result.readMBps;
+            if (result.res == RES_OK && throughput > bestThroughput) {
+                bestThroughput = throughput;
+                best.mac = mac;
+            }
+            results.push_back(result);
+        }
+    }
+
+    if (recommended) {
+        *recommended = best;
+    }
+    return results;
+}
+
 const char* minsftp::ResToStr(const MINSFTP_RES res) {
     switch (res) {
     case RES_OK:
@@ -362,41 +648,80 @@ const char* minsftp::ResToStr(const MINSFTP_RES res) {
         return "Failed to move or rename file/directory.";
     case RES_DELETE_FAILED:
         return "Failed to delete file/directory.";
+    case RES_METHOD_PREF_FAILED:
+        return "Failed to set algorithm preferences.";
+    case RES_CHANNEL_FAILED:
+        return "Failed to open or use the sftp channel.";
+    case RES_EXEC_UNSUPPORTED:
+        return "Remote command execution is not available.";
     default:
         return "Unknown error.";
     }
 }
 
 MINSFTP_RES minsftp::ReadBytes(const std::string sftpFullPath, FILE_DATA& readData, bool nullTerminate) {
+    return Retry([&] { return ReadBytesOnce(sftpFullPath, readData, nullTerminate); },
+        [](MINSFTP_RES res) { return res != RES_OK; });
+}
+MINSFTP_RES minsftp::ReadBytesOnce(const std::string& sftpFullPath, FILE_DATA& readData, bool nullTerminate) {
     if (!IsInitialized()) {
-        fprintf(stderr, "sftp session is not initialized.\n");
+        MINSFTP_WARN("sftp session is not initialized.");
         return RES_NOT_INITIALIZED;
     }
 
-    LIBSSH2_SFTP_HANDLE* sftp_handle = nullptr;
+    if (nativeEngine) {
+        return NativeReadBytes(sftpFullPath, readData, nullTerminate);
+    }
+
+    bool reused = false;
 
-    // Open the file
-    sftp_handle = libssh2_sftp_open(sftp_session, sftpFullPath.c_str(), LIBSSH2_FXF_READ, 0);
+    // Open the file (or take it from the handle cache)
+    LIBSSH2_SFTP_HANDLE* sftp_handle = AcquireHandle(sftpFullPath, LIBSSH2_FXF_READ, 0, reused);
 
     if (!sftp_handle) {
-        fprintf(stderr, "unable to open file %s\n", sftpFullPath.c_str());
+        MINSFTP_ERROR("unable to open file %s", sftpFullPath.c_str());
         return RES_FAILED_OPEN_FILE_SFTP;
     }
 
+    if (reused) {
+        libssh2_sftp_seek64(sftp_handle, 0); // last user left it at eof
+    }
+
     // read the file
-    char buffer[BUFFER_SIZE];
+    std::vector<char> buffer(chunkSize);
     readData.clear();
+    bool scpChecked = !scpThreshold || scpUnsupported;
     while (true) {
-        ssize_t n = libssh2_sftp_read(sftp_handle, buffer, sizeof(buffer));
+        MetricTimer readTimer(metrics.get(), OP_READ);
+        ssize_t n = libssh2_sftp_read(sftp_handle, buffer.data(), buffer.size());
+        readTimer.Stop(n >= 0, n > 0 ? (uint64_t)n : 0);
         if (n > 0) {
-            readData.insert(readData.end(), buffer, buffer + n);
+            readData.insert(readData.end(), buffer.data(), buffer.data() + n);
+
+            // more than one chunk, large enough for scp?
+            if (!scpChecked && (size_t)n == buffer.size()) {
+                scpChecked = true;
+                LIBSSH2_SFTP_ATTRIBUTES attrs{};
+                if (libssh2_sftp_fstat(sftp_handle, &attrs) == 0 && attrs.filesize >= scpThreshold) {
+                    // readData is untouched unless scp worked, any failure just continues on sftp
+                    MINSFTP_RES res = ScpReadBytes(sftpFullPath, readData, nullTerminate);
+                    if (res == RES_OK) {
+                        ReleaseHandle(sftpFullPath, LIBSSH2_FXF_READ, sftp_handle, true);
+                        return res;
+                    }
+                    if (res == RES_CHANNEL_FAILED) {
+                        MINSFTP_INFO("scp unavailable, staying on sftp");
+                        scpUnsupported = true;
+                    }
+                }
+            }
         }
         else if (n == 0) { // end of file
             break;
         }
         else {
-            fprintf(stderr, "error reading file\n");
-            libssh2_sftp_close(sftp_handle);
+            MINSFTP_ERROR("error reading file %s: %zd", sftpFullPath.c_str(), n);
+            ReleaseHandle(sftpFullPath, LIBSSH2_FXF_READ, sftp_handle, false);
             return RES_FAILED;
         }
     }
@@ -405,62 +730,613 @@ MINSFTP_RES minsftp::ReadBytes(const std::string sftpFullPath, FILE_DATA& readDa
         utils::NullTerminate(readData);
     }
 
-    libssh2_sftp_close(sftp_handle);
+    ReleaseHandle(sftpFullPath, LIBSSH2_FXF_READ, sftp_handle, true);
     return RES_OK;
 }
 MINSFTP_RES minsftp::WriteBytes(const std::string sftpFullPath, const FILE_DATA& data) {
+    // the file is truncated and written from the start, repeating it is harmless
+    return Retry([&] { return WriteBytesOnce(sftpFullPath, data); },
+        [](MINSFTP_RES res) { return res != RES_OK; });
+}
+MINSFTP_RES minsftp::WriteBytesOnce(const std::string& sftpFullPath, const FILE_DATA& data) {
     if (!IsInitialized()) {
-        fprintf(stderr, "sftp session is not initialized.\n");
+        MINSFTP_WARN("sftp session is not initialized.");
         return RES_NOT_INITIALIZED;
     }
 
+    if (scpThreshold && !scpUnsupported && data.size() >= scpThreshold) {
+        MINSFTP_RES res = ScpWriteBytes(sftpFullPath, data);
+        if (res == RES_CHANNEL_FAILED) {
+            MINSFTP_INFO("scp unavailable, staying on sftp");
+            scpUnsupported = true;
+        }
+        else if (res != RES_FAILED) {
+            return res;
+        }
+        // RES_FAILED: scp refused this path, sftp reports why (or works with its own semantics)
+    }
+
+    if (nativeEngine) {
+        return NativeWriteBytes(sftpFullPath, data);
+    }
+
     // open file
-    LIBSSH2_SFTP_HANDLE* sftp_handle = libssh2_sftp_open(sftp_session, sftpFullPath.c_str(),
+    LIBSSH2_SFTP_HANDLE* sftp_handle = SftpOpen(sftpFullPath,
         LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT/*create file if not exists*/ | LIBSSH2_FXF_TRUNC /*write instead of append*/,
         LIBSSH2_SFTP_S_IRUSR);
 
     if (!sftp_handle) {
-        fprintf(stderr, "unable to open file %s\n", sftpFullPath.c_str());
+        MINSFTP_ERROR("unable to open file %s", sftpFullPath.c_str());
         return RES_FAILED_OPEN_FILE_SFTP;
     }
 
     // write file
     size_t bytesWritten = 0;
     while (data.size() > bytesWritten) {
-        size_t bytesToWrite = std::min(data.size(), BUFFER_SIZE); // dont want to write junk data if data is smaller than buffer
+        size_t bytesToWrite = std::min(data.size() - bytesWritten, chunkSize); // dont want to write past the end of data
+        MetricTimer writeTimer(metrics.get(), OP_WRITE);
         ssize_t rc = libssh2_sftp_write(sftp_handle, reinterpret_cast<const char*>(&(data.at(bytesWritten))), bytesToWrite);
+        writeTimer.Stop(rc >= 0, rc > 0 ? (uint64_t)rc : 0);
         if (rc < 0) { // wrote less than 0 bytes
-            fprintf(stderr, "error writing to sftp file: %s\n", sftpFullPath.c_str());
-            libssh2_sftp_close(sftp_handle);
+            MINSFTP_ERROR("error writing to sftp file: %s", sftpFullPath.c_str());
+            SftpClose(sftp_handle);
             return RES_SFTP_WRITE_FAILED;
         }
         bytesWritten += rc;
     }
     
-    libssh2_sftp_close(sftp_handle);
+    SftpClose(sftp_handle);
+    return RES_OK;
+}
+
+void minsftp::SetTransport(std::shared_ptr<Transport> shim) {
+    transport = shim;
+}
+
+void minsftp::InstallTransport() {
+    libssh2_session_callback_set(session, LIBSSH2_CALLBACK_SEND, (void*)&minsftp::TransportSend);
+    libssh2_session_callback_set(session, LIBSSH2_CALLBACK_RECV, (void*)&minsftp::TransportRecv);
+}
+
+LIBSSH2_SEND_FUNC(minsftp::TransportSend) {
+    minsftp* self = reinterpret_cast<minsftp*>(*abstract);
+    bool blocking = libssh2_session_get_blocking(self->session) != 0;
+    while (true) {
+        self->hold.sendUntil = Transport::clock::time_point::max();
+        ssize_t rc = -EAGAIN;
+        auto delay = self->uploadLimit ? self->uploadLimit->Delay() : Transport::clock::duration::zero();
+        if (delay.count() > 0) {
+            self->hold.sendUntil = Transport::clock::now() + delay;
+        }
+        else if (self->transport) {
+            rc = self->transport->Send(socket, buffer, length, flags);
+            if (rc == -EAGAIN) {
+                self->hold.sendUntil = self->transport->SendReady();
+            }
+        }
+        else {
+            rc = Transport::SocketSend(socket, buffer, length, flags);
+        }
+
+        if (rc > 0 && self->uploadLimit) {
+            self->uploadLimit->Take((uint64_t)rc);
+        }
+        if (rc != -EAGAIN || !blocking || self->hold.sendUntil == Transport::clock::time_point::max()) {
+            return rc;
+        }
+        WaitSocketUntil(socket, false, false, -1, self->hold.sendUntil);
+    }
+}
+LIBSSH2_RECV_FUNC(minsftp::TransportRecv) {
+    minsftp* self = reinterpret_cast<minsftp*>(*abstract);
+    bool blocking = libssh2_session_get_blocking(self->session) != 0;
+    while (true) {
+        self->hold.recvUntil = Transport::clock::time_point::max();
+        self->hold.recvWatchSocket = false;
+        ssize_t rc = -EAGAIN;
+        auto delay = self->downloadLimit ? self->downloadLimit->Delay() : Transport::clock::duration::zero();
+        if (delay.count() > 0) {
+            self->hold.recvUntil = Transport::clock::now() + delay; // the data waits in the socket
+        }
+        else if (self->transport) {
+            rc = self->transport->Recv(socket, buffer, length, flags);
+            if (rc == -EAGAIN) {
+                self->hold.recvUntil = self->transport->RecvReady();
+                self->hold.recvWatchSocket = true;
+            }
+        }
+        else {
+            rc = Transport::SocketRecv(socket, buffer, length, flags);
+        }
+
+        if (rc > 0 && self->downloadLimit) {
+            self->downloadLimit->Take((uint64_t)rc);
+        }
+        if (rc != -EAGAIN || !blocking || self->hold.recvUntil == Transport::clock::time_point::max()) {
+            return rc;
+        }
+        WaitSocketUntil(socket, self->hold.recvWatchSocket, false, -1, self->hold.recvUntil);
+    }
+}
+
+session_hold SessionHold(LIBSSH2_SESSION* session) {
+    void** abstract = libssh2_session_abstract(session);
+    minsftp* self = abstract ? reinterpret_cast<minsftp*>(*abstract) : nullptr;
+    return self ? self->hold : session_hold{};
+}
+
+void minsftp::SetRateLimit(std::shared_ptr<TokenBucket> upload, std::shared_ptr<TokenBucket> download) {
+    uploadLimit = upload;
+    downloadLimit = download;
+    if (session && (uploadLimit || downloadLimit)) {
+        InstallTransport();
+    }
+}
+std::shared_ptr<TokenBucket> minsftp::UploadLimit() const {
+    return uploadLimit;
+}
+std::shared_ptr<TokenBucket> minsftp::DownloadLimit() const {
+    return downloadLimit;
+}
+
+void minsftp::SetKeepalive(const keepalive_options& options) {
+    keepalive = options;
+    if (session) {
+        libssh2_session_set_timeout(session, keepalive.timeoutMs);
+        libssh2_keepalive_config(session, 1, (unsigned)std::max(keepalive.intervalSec, 0));
+    }
+}
+const keepalive_options& minsftp::Keepalive() const {
+    return keepalive;
+}
+uint64_t minsftp::Reconnects() const {
+    return reconnects;
+}
+
+MINSFTP_RES minsftp::Reconnect() {
+    Shutdown();
+    MINSFTP_RES res = Init();
+    if (res == RES_OK) {
+        reconnects++;
+        MINSFTP_INFO("reconnected to %s", HostKey().c_str());
+    }
+    return res;
+}
+
+int minsftp::Heartbeat() {
+    // heartbeats are no activity, a pooled session still gets probed every idleCheckSec
+    CheckIdle(false);
+    if (!IsInitialized()) {
+        return -1;
+    }
+    int next = keepalive.intervalSec;
+    if (keepalive.intervalSec > 0) {
+        libssh2_keepalive_send(session, &next);
+    }
+    if (keepalive.idleCheckSec > 0 && (next <= 0 || keepalive.idleCheckSec < next)) {
+        next = keepalive.idleCheckSec;
+    }
+    return next > 0 ? next : 1;
+}
+
+void minsftp::CheckIdle(bool operation) {
+    if (!IsInitialized()) {
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    bool idle = keepalive.idleCheckSec > 0 && now - lastActivity >= std::chrono::seconds(keepalive.idleCheckSec);
+    if (operation || idle) {
+        lastActivity = now;
+    }
+    // errors left from earlier calls must not make the next failure look like a lost connection
+    libssh2_session_set_last_error(session, 0, NULL);
+
+    if (idle && !Probe()) {
+        MINSFTP_WARN("idle connection to %s is gone", HostKey().c_str());
+        if (keepalive.reconnect) {
+            Reconnect();
+        }
+        return;
+    }
+    int next = 0;
+    if (keepalive.intervalSec > 0 && libssh2_keepalive_send(session, &next) != 0) {
+        MINSFTP_WARN("keepalive to %s failed", HostKey().c_str());
+        if (keepalive.reconnect) {
+            Reconnect();
+        }
+    }
+}
+
+bool minsftp::Probe() {
+    libssh2_session_set_timeout(session, keepalive.probeTimeoutMs);
+    char path[1024];
+    int rc = libssh2_sftp_realpath(sftp_session, ".", path, sizeof(path));
+    libssh2_session_set_timeout(session, keepalive.timeoutMs);
+    // an error status from the server still means it is there
+    bool alive = rc >= 0 || !ConnectionLost();
+    libssh2_session_set_last_error(session, 0, NULL);
+    return alive;
+}
+
+bool minsftp::ConnectionLost() const {
+    if (!session) {
+        return false;
+    }
+    switch (libssh2_session_last_errno(session)) {
+    case LIBSSH2_ERROR_SOCKET_SEND:
+    case LIBSSH2_ERROR_SOCKET_RECV:
+    case LIBSSH2_ERROR_SOCKET_DISCONNECT:
+    case LIBSSH2_ERROR_SOCKET_TIMEOUT:
+    case LIBSSH2_ERROR_TIMEOUT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool minsftp::Recover() {
+    if (!keepalive.reconnect || !IsInitialized() || !ConnectionLost()) {
+        return false;
+    }
+    MINSFTP_WARN("connection to %s lost, reconnecting", HostKey().c_str());
+    return Reconnect() == RES_OK;
+}
+
+void minsftp::SetMetrics(std::shared_ptr<Metrics> _metrics) {
+    metrics = _metrics;
+}
+std::shared_ptr<Metrics> minsftp::GetMetrics() const {
+    return metrics;
+}
+
+LIBSSH2_SFTP_HANDLE* minsftp::SftpOpen(const std::string& sftpFullPath, unsigned long flags, long mode, int openType) {
+    MetricTimer timer(metrics.get(), OP_OPEN);
+    LIBSSH2_SFTP_HANDLE* handle = libssh2_sftp_open_ex(sftp_session, sftpFullPath.c_str(), (unsigned int)sftpFullPath.length(), flags, mode, openType);
+    timer.Stop(handle != nullptr);
+    return handle;
+}
+int minsftp::SftpClose(LIBSSH2_SFTP_HANDLE* handle) {
+    MetricTimer timer(metrics.get(), OP_CLOSE);
+    int rc = libssh2_sftp_close_handle(handle);
+    timer.Stop(rc == 0);
+    return rc;
+}
+
+LIBSSH2_SFTP_HANDLE* minsftp::AcquireHandle(const std::string& sftpFullPath, unsigned long flags, long mode, bool& reused) {
+    LIBSSH2_SFTP_HANDLE* handle = handleCache.Take(sftpFullPath, flags);
+    reused = handle != nullptr;
+    if (!handle) {
+        handle = SftpOpen(sftpFullPath, flags, mode);
+    }
+    return handle;
+}
+void minsftp::ReleaseHandle(const std::string& sftpFullPath, unsigned long flags, LIBSSH2_SFTP_HANDLE* handle, bool ok) {
+    if (ok) {
+        handleCache.Put(sftpFullPath, flags, handle);
+    }
+    else {
+        SftpClose(handle);
+    }
+}
+
+SftpChannel* minsftp::Channel() {
+    if (channel && channel->IsOpen()) {
+        return channel.get();
+    }
+
+    channel = std::make_shared<SftpChannel>(session, sock, ChannelWindow());
+    if (channel->Open() != RES_OK) {
+        channel.reset();
+        return nullptr;
+    }
+    channel->SetController(concurrency);
+    return channel.get();
+}
+
+void minsftp::UseNativeEngine(bool enable) {
+    nativeEngine = enable;
+}
+bool minsftp::NativeEngine() const {
+    return nativeEngine;
+}
+std::string minsftp::HostKey() const {
+    bool v6 = client.host.find(':') != std::string::npos;
+    return (v6 ? "[" + client.host + "]" : client.host) + ":" + std::to_string(client.port);
+}
+
+void minsftp::SetConnectOptions(const connect_options& options) {
+    connectOptions = options;
+}
+const connect_options& minsftp::ConnectOptions() const {
+    return connectOptions;
+}
+std::string minsftp::PeerAddress() const {
+    return peer;
+}
+
+void minsftp::SetSocketOptions(const socket_options& options) {
+    socketOptions = options;
+}
+const socket_options& minsftp::SocketOptions() const {
+    return socketOptions;
+}
+uint64_t minsftp::BdpEstimate() const {
+    return bdp;
+}
+
+uint32_t minsftp::ChannelWindow() const {
+    if (socketOptions.channelWindow) {
+        return socketOptions.channelWindow;
+    }
+    // twice the bdp keeps the server sending while a window's worth of replies is read
+    uint64_t window = std::min<uint64_t>(bdp * 2, (uint64_t)std::max(socketOptions.maxBuffer, 0));
+    return (uint32_t)std::max<uint64_t>(window, SFTP_CHANNEL_WINDOW);
+}
+
+size_t minsftp::NativeChunksInFlight(size_t chunk) const {
+    // a bdp of requests outstanding, within the channel window
+    size_t wanted = (size_t)(bdp / chunk) + 1;
+    return std::clamp(wanted, NATIVE_CHUNKS_IN_FLIGHT, std::max<size_t>(ChannelWindow() / chunk, NATIVE_CHUNKS_IN_FLIGHT));
+}
+
+void minsftp::EnableAdaptiveConcurrency(const concurrency_options& options) {
+    concurrency = ConcurrencyController::ForHost(HostKey(), options);
+    if (channel) {
+        channel->SetController(concurrency);
+    }
+}
+void minsftp::DisableAdaptiveConcurrency() {
+    concurrency.reset();
+    if (channel) {
+        channel->SetController(nullptr);
+    }
+}
+std::shared_ptr<ConcurrencyController> minsftp::Concurrency() const {
+    return concurrency;
+}
+std::map<std::string, std::string> minsftp::ServerExtensions() {
+    if (!IsInitialized()) {
+        MINSFTP_WARN("sftp session is not initialized.");
+        return {};
+    }
+    CheckIdle();
+
+    SftpChannel* ch = Channel();
+    return ch ? ch->Extensions() : std::map<std::string, std::string>{};
+}
+
+MINSFTP_RES minsftp::NativeReadBytes(const std::string& sftpFullPath, FILE_DATA& readData, bool nullTerminate) {
+    SftpChannel* ch = Channel();
+    if (!ch) {
+        return RES_CHANNEL_FAILED;
+    }
+
+    // a bulk get of one file: open, fstat and reads go out together
+    bulk_options options{};
+    options.maxOpen = 1;
+    options.chunkSize = (uint32_t)std::max(chunkSize, NATIVE_CHUNK_MIN);
+    options.requestsPerFile = NativeChunksInFlight(options.chunkSize);
+    options.maxInFlight = options.requestsPerFile + 2;
+
+    MINSFTP_RES res = RES_CHANNEL_FAILED;
+    BulkGetter getter(ch, metrics.get(), [&](bulk_get_result& result) {
+        res = result.res;
+        readData = std::move(result.data);
+    }, options);
+    getter.Run({ sftpFullPath });
+
+    if (res != RES_OK) {
+        MINSFTP_ERROR("unable to read file %s: %s", sftpFullPath.c_str(), ResToStr(res));
+        return res;
+    }
+    if (nullTerminate) {
+        utils::NullTerminate(readData);
+    }
     return RES_OK;
 }
 
+MINSFTP_RES minsftp::NativeWriteBytes(const std::string& sftpFullPath, const FILE_DATA& data) {
+    SftpChannel* ch = Channel();
+    if (!ch) {
+        return RES_CHANNEL_FAILED;
+    }
+    size_t chunk = std::max(chunkSize, NATIVE_CHUNK_MIN);
+    size_t inFlight = NativeChunksInFlight(chunk);
+    ch->SetMaxInFlight(inFlight + 2);
+
+    native_reply open = NativeCall(ch, metrics.get(), OP_OPEN, [&](SftpChannel::reply_fn fn) {
+        ch->OpenFile(sftpFullPath, LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC, LIBSSH2_SFTP_S_IRUSR, fn);
+    });
+    if (!open.Ok() || open.type != FXP_HANDLE) {
+        MINSFTP_ERROR("unable to open file %s", sftpFullPath.c_str());
+        return open.type ? RES_FAILED_OPEN_FILE_SFTP : RES_CHANNEL_FAILED;
+    }
+
+    // keep inFlight writes outstanding until everything was acknowledged
+    size_t next = 0;
+    size_t outstanding = 0;
+    bool failed = false;
+    while ((next < data.size() && !failed) || outstanding) {
+        while (next < data.size() && !failed && outstanding < inFlight) {
+            size_t len = std::min(chunk, data.size() - next);
+            auto start = std::chrono::steady_clock::now();
+            outstanding++;
+            ch->Write(open.handle, next, data.data() + next, len, [&, len, start](const sftp_reply& reply) {
+                outstanding--;
+                if (metrics) {
+                    metrics->Record(OP_WRITE, std::chrono::steady_clock::now() - start, reply.Ok() ? len : 0, reply.Ok());
+                }
+                failed = failed || !reply.Ok();
+            });
+            next += len;
+        }
+        if (!outstanding) {
+            break;
+        }
+        if (ch->Pump() != RES_OK) {
+            break;
+        }
+        if (ch->WouldBlock()) {
+            ch->WaitSocket();
+        }
+    }
+
+    native_reply close = NativeCall(ch, metrics.get(), OP_CLOSE, [&](SftpChannel::reply_fn fn) {
+        ch->CloseHandle(open.handle, fn);
+    });
+    if (ch->Broken()) {
+        return RES_CHANNEL_FAILED;
+    }
+    if (failed || !close.Ok()) {
+        MINSFTP_ERROR("error writing to sftp file: %s", sftpFullPath.c_str());
+        return RES_SFTP_WRITE_FAILED;
+    }
+    return RES_OK;
+}
+
+MINSFTP_RES minsftp::NativeCopyFile(const std::string& oldSftpFullPath, const std::string& newSftpFullPath) {
+    SftpChannel* ch = Channel();
+    if (!ch) {
+        return RES_CHANNEL_FAILED;
+    }
+
+    // both opens in one round trip, then the copy and both closes in another
+    native_reply src{}, dst{};
+    MetricTimer openTimer(metrics.get(), OP_OPEN);
+    ch->OpenFile(oldSftpFullPath, LIBSSH2_FXF_READ, 0, [&src](const sftp_reply& reply) {
+        src.type = reply.type;
+        src.handle = reply.handle;
+    });
+    ch->OpenFile(newSftpFullPath, LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC, LIBSSH2_SFTP_S_IRUSR,
+        [&dst](const sftp_reply& reply) {
+        dst.type = reply.type;
+        dst.handle = reply.handle;
+    });
+    ch->Drain();
+    bool opened = src.type == FXP_HANDLE && dst.type == FXP_HANDLE;
+    openTimer.Stop(opened);
+
+    MINSFTP_RES res = RES_OK;
+    if (!opened) {
+        MINSFTP_ERROR("unable to open %s or %s", oldSftpFullPath.c_str(), newSftpFullPath.c_str());
+        res = (src.type && dst.type) ? RES_FAILED_OPEN_FILE_SFTP : RES_CHANNEL_FAILED;
+    }
+    else {
+        native_reply copied = NativeCall(ch, metrics.get(), OP_WRITE, [&](SftpChannel::reply_fn fn) {
+            ch->CopyData(src.handle, 0, 0, dst.handle, 0, fn);
+        });
+        if (!copied.Ok()) {
+            MINSFTP_ERROR("server side copy of %s failed: %u", oldSftpFullPath.c_str(), copied.status);
+            res = copied.type ? RES_SFTP_WRITE_FAILED : RES_CHANNEL_FAILED;
+        }
+    }
+
+    for (const native_reply* file : { &src, &dst }) {
+        if (file->type == FXP_HANDLE) {
+            ch->CloseHandle(file->handle, nullptr);
+        }
+    }
+    ch->Drain();
+    return res;
+}
+
+void minsftp::EnableHandleCache(size_t maxOpen) {
+    handleCache.SetMaxOpen(maxOpen);
+}
+size_t minsftp::HandleCacheSize() const {
+    return handleCache.Size();
+}
+
+void minsftp::SetChunkSize(size_t size) {
+    chunkSize = size ? size : BUFFER_SIZE;
+}
+size_t minsftp::ChunkSize() const {
+    return chunkSize;
+}
+
+MINSFTP_RES minsftp::SftpMakeDir(const std::string sftpFullPath, long mode) {
+    if (!IsInitialized()) {
+        return RES_NOT_INITIALIZED;
+    }
+    CheckIdle();
+
+    if (nativeEngine) {
+        SftpChannel* ch = Channel();
+        return NativeCall(ch, metrics.get(), OP_MKDIR, [&](SftpChannel::reply_fn fn) {
+            ch->MkDir(sftpFullPath, mode, fn);
+        }).Ok() ? RES_OK : RES_FAILED;
+    }
+
+    MetricTimer timer(metrics.get(), OP_MKDIR);
+    int rc = libssh2_sftp_mkdir_ex(sftp_session, sftpFullPath.c_str(), (unsigned int)sftpFullPath.length(), mode);
+    timer.Stop(rc == 0);
+    return rc == 0 ? RES_OK : RES_FAILED;
+}
+
+std::unique_ptr<RemoteFile> minsftp::OpenRemoteFile(const std::string sftpFullPath, unsigned long flags, long mode,
+    const remote_file_options& options) {
+    if (!IsInitialized()) {
+        MINSFTP_WARN("sftp session is not initialized.");
+        return nullptr;
+    }
+    CheckIdle();
+
+    LIBSSH2_SFTP_HANDLE* handle = SftpOpen(sftpFullPath, flags, mode);
+    if (!handle) {
+        MINSFTP_ERROR("unable to open file %s", sftpFullPath.c_str());
+        return nullptr;
+    }
+    return std::unique_ptr<RemoteFile>(new RemoteFile(this, handle, sftpFullPath, options));
+}
+
 MINSFTP_RES minsftp::SftpMove(const std::string oldSftpFullPath, const std::string newSftpFullPath) {
     if (!IsInitialized()) {
         return RES_NOT_INITIALIZED;
     }
+    CheckIdle();
+
+    // some servers refuse to rename open files
+    handleCache.Invalidate(oldSftpFullPath);
+    handleCache.Invalidate(newSftpFullPath);
 
+    if (nativeEngine) {
+        SftpChannel* ch = Channel();
+        return NativeCall(ch, metrics.get(), OP_RENAME, [&](SftpChannel::reply_fn fn) {
+            ch->Rename(oldSftpFullPath, newSftpFullPath, fn);
+        }).Ok() ? RES_OK : RES_MOVE_FAILED;
+    }
+
+    MetricTimer timer(metrics.get(), OP_RENAME);
     int rc = libssh2_sftp_rename(sftp_session, oldSftpFullPath.c_str(), newSftpFullPath.c_str());
+    timer.Stop(rc == 0);
     return rc == 0 ? RES_OK : RES_MOVE_FAILED;
 }
 MINSFTP_RES minsftp::SftpDeleteFile(const std::string sftpFullPath) {
     if (!IsInitialized()) {
         return RES_NOT_INITIALIZED;
     }
+    CheckIdle();
+
+    handleCache.Invalidate(sftpFullPath);
+
+    if (nativeEngine) {
+        SftpChannel* ch = Channel();
+        return NativeCall(ch, metrics.get(), OP_REMOVE, [&](SftpChannel::reply_fn fn) {
+            ch->Remove(sftpFullPath, fn);
+        }).Ok() ? RES_OK : RES_DELETE_FAILED;
+    }
 
+    MetricTimer timer(metrics.get(), OP_REMOVE);
     int rc = libssh2_sftp_unlink_ex(sftp_session, sftpFullPath.c_str(), (uint32_t)sftpFullPath.length());
+    timer.Stop(rc == 0);
     return rc == 0 ? RES_OK : RES_DELETE_FAILED;
 }
 MINSFTP_RES minsftp::SftpDeleteDir(const std::string sftpFullPath) {
     if (!IsInitialized()) {
         return RES_NOT_INITIALIZED;
     }
+    CheckIdle();
 
     std::vector<std::string> entries = ListDirectory(sftpFullPath);
 
@@ -481,36 +1357,78 @@ MINSFTP_RES minsftp::SftpDeleteDir(const std::string sftpFullPath) {
     }
 
     // delete the empty directories
-    int rc = libssh2_sftp_rmdir_ex(sftp_session, sftpFullPath.c_str(), (uint32_t)sftpFullPath.length());
+    handleCache.Invalidate(sftpFullPath);
+    int rc;
+    if (nativeEngine) {
+        SftpChannel* ch = Channel();
+        native_reply reply = NativeCall(ch, metrics.get(), OP_REMOVE, [&](SftpChannel::reply_fn fn) {
+            ch->RmDir(sftpFullPath, fn);
+        });
+        if (!reply.type) {
+            // no reply at all (no channel or it broke), status still holds its default FX_OK
+            MINSFTP_ERROR("failed to delete dir %s: channel lost", sftpFullPath.c_str());
+            return RES_CHANNEL_FAILED;
+        }
+        rc = reply.Ok() ? 0 : (int)reply.status;
+    }
+    else {
+        MetricTimer timer(metrics.get(), OP_REMOVE);
+        rc = libssh2_sftp_rmdir_ex(sftp_session, sftpFullPath.c_str(), (uint32_t)sftpFullPath.length());
+        timer.Stop(rc == 0);
+    }
     if (rc) {
-        fprintf(stderr, "failed to delete dir %s: %d\n", sftpFullPath.c_str(), rc);
+        MINSFTP_ERROR("failed to delete dir %s: %d", sftpFullPath.c_str(), rc);
         return RES_DELETE_FAILED;
     }
 
     return RES_OK;
 }
 MINSFTP_RES minsftp::SftpCopyFile(const std::string oldSftpFullPath, const std::string newSftpFullPath) {
+    return Retry([&] { return SftpCopyFileOnce(oldSftpFullPath, newSftpFullPath); },
+        [](MINSFTP_RES res) { return res != RES_OK; });
+}
+MINSFTP_RES minsftp::SftpCopyFileOnce(const std::string& oldSftpFullPath, const std::string& newSftpFullPath) {
     if (!IsInitialized()) {
         return RES_NOT_INITIALIZED;
     }
 
+    if (nativeEngine) {
+        SftpChannel* ch = Channel();
+        if (ch && ch->HasExtension("copy-data")) {
+            return NativeCopyFile(oldSftpFullPath, newSftpFullPath);
+        }
+    }
+
+    // SftpCopyFile retries the whole copy, the halves must not retry on their own
     FILE_DATA buffer{};
-    auto res = ReadBytes(oldSftpFullPath, buffer);
+    auto res = ReadBytesOnce(oldSftpFullPath, buffer, false);
     if (res != RES_OK) {
         return res;
     }
 
-    return WriteBytes(newSftpFullPath, buffer);
+    return WriteBytesOnce(newSftpFullPath, buffer);
 }
 MINSFTP_RES minsftp::SftpCopyDir(const std::string oldSftpFullPath, const std::string newSftpFullPath) {
     if (!IsInitialized()) {
         return RES_NOT_INITIALIZED;
     }
+    CheckIdle();
 
     // create destination dir
-    int rc = libssh2_sftp_mkdir(sftp_session, newSftpFullPath.c_str(), 0755);
-    if (rc != 0 && libssh2_sftp_last_error(sftp_session) != LIBSSH2_FX_FILE_ALREADY_EXISTS) {
-        return RES_FAILED;
+    if (nativeEngine) {
+        SftpChannel* ch = Channel();
+        native_reply reply = NativeCall(ch, metrics.get(), OP_MKDIR, [&](SftpChannel::reply_fn fn) {
+            ch->MkDir(newSftpFullPath, 0755, fn);
+        });
+        if (!reply.Ok() && reply.status != LIBSSH2_FX_FILE_ALREADY_EXISTS) {
+            return RES_FAILED;
+        }
+    }
+    else {
+        int rc = libssh2_sftp_mkdir(sftp_session, newSftpFullPath.c_str(), 0755);
+        if (rc != 0 && libssh2_sftp_last_error(sftp_session) != LIBSSH2_FX_FILE_ALREADY_EXISTS) {
+            return RES_FAILED;
+        }
     }
 
     // list items in source dir
@@ -536,23 +1454,460 @@ MINSFTP_RES minsftp::SftpCopyDir(const std::string oldSftpFullPath, const std::s
     return RES_OK;
 }
 
+MINSFTP_RES minsftp::Batch(const std::vector<batch_op>& ops, std::vector<batch_result>& results, size_t maxInFlight) {
+    if (!IsInitialized()) {
+        MINSFTP_WARN("sftp session is not initialized.");
+        return RES_NOT_INITIALIZED;
+    }
+    CheckIdle();
+
+    SftpChannel* ch = Channel();
+    if (!ch) {
+        return RES_CHANNEL_FAILED;
+    }
+    ch->SetMaxInFlight(maxInFlight);
+
+    results.assign(ops.size(), batch_result{});
+    size_t failed = 0;
+    for (size_t i = 0; i < ops.size(); i++) {
+        const batch_op& op = ops[i];
+        if (op.type == BATCH_RMDIR || op.type == BATCH_REMOVE || op.type == BATCH_RENAME) {
+            handleCache.Invalidate(op.path);
+        }
+        if (op.type == BATCH_RENAME) {
+            handleCache.Invalidate(op.newPath);
+        }
+
+        batch_result* result = &results[i];
+        SubmitBatchOp(ch, metrics.get(), op, [result, &failed](batch_result& done) {
+            failed += done.res == RES_OK ? 0 : 1;
+            *result = std::move(done);
+        });
+    }
+
+    if (ch->Drain() != RES_OK || ch->Broken()) {
+        MINSFTP_ERROR("batch aborted, sftp channel broke");
+        return RES_CHANNEL_FAILED;
+    }
+    return failed ? RES_FAILED : RES_OK;
+}
+
+MINSFTP_RES minsftp::WalkTree(const std::string root, const walk_fn& onEntry, const walk_options& options) {
+    if (!IsInitialized()) {
+        MINSFTP_WARN("sftp session is not initialized.");
+        return RES_NOT_INITIALIZED;
+    }
+    CheckIdle();
+
+    if (options.tryExec && !execFindUnsupported) {
+        FindWalker finder(session, sock, onEntry, options);
+        MINSFTP_RES res = finder.Run(root);
+        // entries already went to the caller, a second walk would repeat them
+        if (res == RES_OK || finder.Entries()) {
+            MINSFTP_DEBUG("listed %s with find: %zu entries", root.c_str(), finder.Entries());
+            return res;
+        }
+        if (res == RES_EXEC_UNSUPPORTED || res == RES_CHANNEL_FAILED) {
+            MINSFTP_INFO("exec listing unavailable, using sftp readdir");
+            execFindUnsupported = true;
+        }
+    }
+
+    SftpChannel* ch = Channel();
+    if (!ch) {
+        return RES_CHANNEL_FAILED;
+    }
+
+    TreeWalker walker(ch, metrics.get(), onEntry, options);
+    MINSFTP_RES res = walker.Run(root);
+    MINSFTP_DEBUG("walked %s: %zu entries, %zu errors", root.c_str(), walker.Entries(), walker.Errors());
+    return res;
+}
+
+MINSFTP_RES minsftp::BulkGet(const std::vector<std::string>& paths, const bulk_get_fn& onFile, const bulk_options& options) {
+    if (!IsInitialized()) {
+        MINSFTP_WARN("sftp session is not initialized.");
+        return RES_NOT_INITIALIZED;
+    }
+    CheckIdle();
+
+    SftpChannel* ch = Channel();
+    if (!ch) {
+        return RES_CHANNEL_FAILED;
+    }
+
+    BulkGetter getter(ch, metrics.get(), onFile, options);
+    return getter.Run(paths);
+}
+
+MINSFTP_RES minsftp::BulkPut(const bulk_put_source& source, const bulk_put_fn& onFile, const bulk_options& options) {
+    if (!IsInitialized()) {
+        MINSFTP_WARN("sftp session is not initialized.");
+        return RES_NOT_INITIALIZED;
+    }
+    CheckIdle();
+
+    SftpChannel* ch = Channel();
+    if (!ch) {
+        return RES_CHANNEL_FAILED;
+    }
+
+    BulkPutter putter(ch, metrics.get(), onFile, options);
+    return putter.Run(source);
+}
+MINSFTP_RES minsftp::BulkPut(std::vector<bulk_put_item>& items, const bulk_put_fn& onFile, const bulk_options& options) {
+    // items are moved out as they are sent
+    size_t next = 0;
+    return BulkPut([&items, &next](bulk_put_item& item) {
+        if (next == items.size()) {
+            return false;
+        }
+        item = std::move(items[next++]);
+        return true;
+    }, onFile, options);
+}
+
+std::unique_ptr<SharedSession> minsftp::Share(const bulk_options& options) {
+    if (!IsInitialized()) {
+        MINSFTP_WARN("sftp session is not initialized.");
+        return nullptr;
+    }
+    CheckIdle();
+
+    // changes made through the shared session don't invalidate cached handles
+    handleCache.Clear();
+
+    std::unique_ptr<SharedSession> shared(new SharedSession(session, sock, metrics, options));
+    shared->controller = concurrency;
+    shared->keepaliveSec = keepalive.intervalSec;
+    shared->window = ChannelWindow();
+    if (shared->Start() != RES_OK) {
+        MINSFTP_ERROR("unable to start shared session");
+        return nullptr;
+    }
+    return shared;
+}
+
+MINSFTP_RES minsftp::TarDownloadDir(const std::string sftpFullPath, const std::string localPath) {
+    if (!IsInitialized()) {
+        MINSFTP_WARN("sftp session is not initialized.");
+        return RES_NOT_INITIALIZED;
+    }
+    CheckIdle();
+
+    std::error_code ec;
+    fs::create_directories(localPath, ec);
+    if (ec) {
+        MINSFTP_ERROR("unable to create local dir %s", localPath.c_str());
+        return RES_FAILED;
+    }
+
+    ExecChannel exec(session, sock, ChannelWindow());
+    if (exec.Open("tar cf - -C " + ExecChannel::Quote(sftpFullPath) + " .") != RES_OK) {
+        return RES_EXEC_UNSUPPORTED;
+    }
+
+    MetricTimer timer(metrics.get(), OP_READ);
+    TarReader reader(localPath);
+    MINSFTP_RES res = RES_OK;
+    std::vector<uint8_t> buffer(256 * 1024);
+    while (res == RES_OK) {
+        ssize_t n = exec.Read(buffer.data(), buffer.size());
+        if (n == 0) {
+            res = reader.Finish();
+            break;
+        }
+        res = n < 0 ? RES_CHANNEL_FAILED : reader.Feed(buffer.data(), (size_t)n);
+    }
+
+    int status = exec.Close();
+    if (res == RES_OK && status) {
+        MINSFTP_ERROR("remote tar exited with %d", status);
+        res = (status == 126 || status == 127) ? RES_EXEC_UNSUPPORTED : RES_FAILED;
+    }
+    timer.Stop(res == RES_OK, reader.Bytes());
+    MINSFTP_DEBUG("tar download %s: %zu files, %llu bytes", sftpFullPath.c_str(), reader.Files(),
+        (unsigned long long)reader.Bytes());
+    return res;
+}
+
+MINSFTP_RES minsftp::TarUploadDir(const std::string localPath, const std::string sftpFullPath) {
+    if (!IsInitialized()) {
+        MINSFTP_WARN("sftp session is not initialized.");
+        return RES_NOT_INITIALIZED;
+    }
+    CheckIdle();
+
+    // tar replaces files, cached handles would keep reading the old ones
+    handleCache.Invalidate(sftpFullPath);
+
+    std::string dir = ExecChannel::Quote(sftpFullPath);
+    ExecChannel exec(session, sock, ChannelWindow());
+    if (exec.Open("mkdir -p " + dir + " && tar xf - -C " + dir) != RES_OK) {
+        return RES_EXEC_UNSUPPORTED;
+    }
+
+    MetricTimer timer(metrics.get(), OP_WRITE);
+    TarWriter writer([&exec](const uint8_t* data, size_t len) {
+        return exec.Write(data, len);
+    });
+    MINSFTP_RES res = writer.AddTree(localPath);
+    if (res == RES_OK) {
+        res = writer.Finish();
+    }
+
+    // eof tells tar the archive is complete, then wait for it to exit
+    if (res == RES_OK) {
+        res = exec.SendEof();
+        char discard[1024];
+        while (res == RES_OK && exec.Read(discard, sizeof(discard)) > 0) {
+        }
+    }
+    int status = exec.Close();
+    if (res == RES_OK && status) {
+        MINSFTP_ERROR("remote tar exited with %d", status);
+        res = (status == 126 || status == 127) ? RES_EXEC_UNSUPPORTED : RES_FAILED;
+    }
+    timer.Stop(res == RES_OK, writer.Bytes());
+    MINSFTP_DEBUG("tar upload %s: %zu files, %llu bytes", sftpFullPath.c_str(), writer.Files(),
+        (unsigned long long)writer.Bytes());
+    return res;
+}
+
+void minsftp::SetScpThreshold(uint64_t bytes) {
+    scpThreshold = bytes;
+}
+uint64_t minsftp::ScpThreshold() const {
+    return scpThreshold;
+}
+
+MINSFTP_RES minsftp::ScpStartFailure() const {
+    // the remote scp answered with an error (no such file, permission denied, ...): a problem
+    // with this path, not with scp
+    if (libssh2_session_last_errno(session) == LIBSSH2_ERROR_SCP_PROTOCOL) {
+        return RES_FAILED;
+    }
+    return RES_CHANNEL_FAILED;
+}
+
+MINSFTP_RES minsftp::ScpRecv(const std::string& sftpFullPath, const std::function<MINSFTP_RES(const uint8_t*, size_t)>& sink) {
+    libssh2_struct_stat fileinfo{};
+    LIBSSH2_CHANNEL* channel;
+    while (!(channel = libssh2_scp_recv2(session, sftpFullPath.c_str(), &fileinfo))) {
+        if (libssh2_session_last_errno(session) != LIBSSH2_ERROR_EAGAIN) {
+            char* msg = nullptr;
+            libssh2_session_last_error(session, &msg, NULL, 0);
+            MINSFTP_WARN("scp recv %s failed: %s", sftpFullPath.c_str(), msg ? msg : "");
+            return ScpStartFailure();
+        }
+        WaitSessionSocket(session, sock, 1000);
+    }
+
+    MetricTimer timer(metrics.get(), OP_READ);
+    MINSFTP_RES res = RES_OK;
+    uint64_t size = (uint64_t)fileinfo.st_size;
+    uint64_t received = 0;
+    std::vector<uint8_t> buffer(256 * 1024);
+    while (res == RES_OK && received < size) {
+        size_t want = (size_t)std::min<uint64_t>(buffer.size(), size - received);
+        ssize_t n = libssh2_channel_read(channel, reinterpret_cast<char*>(buffer.data()), want);
+        if (n == LIBSSH2_ERROR_EAGAIN) {
+            WaitSessionSocket(session, sock, 1000);
+            continue;
+        }
+        if (n < 0 || (n == 0 && libssh2_channel_eof(channel))) {
+            MINSFTP_ERROR("scp recv %s: stream ended after %llu of %llu bytes", sftpFullPath.c_str(),
+                (unsigned long long)received, (unsigned long long)size);
+            res = RES_FAILED;
+            break;
+        }
+        received += (uint64_t)n;
+        res = sink(buffer.data(), (size_t)n);
+    }
+    timer.Stop(res == RES_OK, received);
+
+    libssh2_channel_free(channel);
+    return res;
+}
+
+MINSFTP_RES minsftp::ScpSend(const std::string& sftpFullPath, uint64_t size, long mode,
+    const std::function<size_t(uint8_t*, size_t)>& source) {
+    LIBSSH2_CHANNEL* channel;
+    while (!(channel = libssh2_scp_send64(session, sftpFullPath.c_str(), (int)(mode & 0777), (libssh2_int64_t)size, 0, 0))) {
+        if (libssh2_session_last_errno(session) != LIBSSH2_ERROR_EAGAIN) {
+            char* msg = nullptr;
+            libssh2_session_last_error(session, &msg, NULL, 0);
+            MINSFTP_WARN("scp send %s failed: %s", sftpFullPath.c_str(), msg ? msg : "");
+            return ScpStartFailure();
+        }
+        WaitSessionSocket(session, sock, 1000);
+    }
+
+    MetricTimer timer(metrics.get(), OP_WRITE);
+    MINSFTP_RES res = RES_OK;
+    uint64_t sent = 0;
+    std::vector<uint8_t> buffer(256 * 1024);
+    while (res == RES_OK && sent < size) {
+        size_t len = source(buffer.data(), (size_t)std::min<uint64_t>(buffer.size(), size - sent));
+        if (!len) {
+            MINSFTP_ERROR("scp send %s: source ended after %llu of %llu bytes", sftpFullPath.c_str(),
+                (unsigned long long)sent, (unsigned long long)size);
+            res = RES_SFTP_WRITE_FAILED;
+            break;
+        }
+        size_t off = 0;
+        while (off < len) {
+            ssize_t n = libssh2_channel_write(channel, reinterpret_cast<const char*>(buffer.data() + off), len - off);
+            if (n == LIBSSH2_ERROR_EAGAIN) {
+                WaitSessionSocket(session, sock, 1000);
+                continue;
+            }
+            if (n < 0) {
+                MINSFTP_ERROR("scp send %s: write failed: %zd", sftpFullPath.c_str(), n);
+                res = RES_SFTP_WRITE_FAILED;
+                break;
+            }
+            off += (size_t)n;
+        }
+        sent += off;
+    }
+
+    // a nul byte ends the file in the scp protocol (without it the remote scp exits with 1), then
+    // eof ends the session and the remote scp exits
+    while (res == RES_OK) {
+        ssize_t n = libssh2_channel_write(channel, "", 1);
+        if (n == LIBSSH2_ERROR_EAGAIN) {
+            WaitSessionSocket(session, sock, 1000);
+            continue;
+        }
+        if (n < 0) {
+            res = RES_SFTP_WRITE_FAILED;
+        }
+        break;
+    }
+    if (res == RES_OK) {
+        while (libssh2_channel_send_eof(channel) == LIBSSH2_ERROR_EAGAIN) {
+            WaitSessionSocket(session, sock, 1000);
+        }
+        while (libssh2_channel_wait_eof(channel) == LIBSSH2_ERROR_EAGAIN) {
+            WaitSessionSocket(session, sock, 1000);
+        }
+        while (libssh2_channel_wait_closed(channel) == LIBSSH2_ERROR_EAGAIN) {
+            WaitSessionSocket(session, sock, 1000);
+        }
+        if (libssh2_channel_get_exit_status(channel)) {
+            MINSFTP_ERROR("scp send %s: remote scp failed", sftpFullPath.c_str());
+            res = RES_SFTP_WRITE_FAILED;
+        }
+    }
+    timer.Stop(res == RES_OK, sent);
+
+    libssh2_channel_free(channel);
+    return res;
+}
+
+MINSFTP_RES minsftp::ScpReadBytes(const std::string sftpFullPath, FILE_DATA& readData, bool nullTerminate) {
+    if (!IsInitialized()) {
+        MINSFTP_WARN("sftp session is not initialized.");
+        return RES_NOT_INITIALIZED;
+    }
+
+    // readData is left alone unless the transfer worked, ReadBytes falls back on it
+    FILE_DATA data{};
+    MINSFTP_RES res = ScpRecv(sftpFullPath, [&data](const uint8_t* chunk, size_t len) {
+        data.insert(data.end(), chunk, chunk + len);
+        return RES_OK;
+    });
+    if (res != RES_OK) {
+        return res;
+    }
+
+    if (nullTerminate) {
+        utils::NullTerminate(data);
+    }
+    readData.swap(data);
+    return RES_OK;
+}
+
+MINSFTP_RES minsftp::ScpWriteBytes(const std::string sftpFullPath, const FILE_DATA& data, long mode) {
+    if (!IsInitialized()) {
+        MINSFTP_WARN("sftp session is not initialized.");
+        return RES_NOT_INITIALIZED;
+    }
+
+    size_t pos = 0;
+    return ScpSend(sftpFullPath, data.size(), mode, [&data, &pos](uint8_t* buffer, size_t len) {
+        len = std::min(len, data.size() - pos);
+        memcpy(buffer, data.data() + pos, len);
+        pos += len;
+        return len;
+    });
+}
+
+MINSFTP_RES minsftp::ScpGet(const std::string sftpFullPath, std::ostream& out) {
+    if (!IsInitialized()) {
+        MINSFTP_WARN("sftp session is not initialized.");
+        return RES_NOT_INITIALIZED;
+    }
+    CheckIdle();
+
+    return ScpRecv(sftpFullPath, [&out](const uint8_t* chunk, size_t len) {
+        out.write(reinterpret_cast<const char*>(chunk), (std::streamsize)len);
+        return out ? RES_OK : RES_FAILED;
+    });
+}
+
+MINSFTP_RES minsftp::ScpPut(const std::string sftpFullPath, std::istream& in, uint64_t size, long mode) {
+    if (!IsInitialized()) {
+        MINSFTP_WARN("sftp session is not initialized.");
+        return RES_NOT_INITIALIZED;
+    }
+    CheckIdle();
+
+    return ScpSend(sftpFullPath, size, mode, [&in](uint8_t* buffer, size_t len) {
+        in.read(reinterpret_cast<char*>(buffer), (std::streamsize)len);
+        return (size_t)in.gcount();
+    });
+}
+
 std::vector<std::string> minsftp::ListDirectory(const std::string sftpFullPath) {
+    return Retry([&] { return ListDirectoryOnce(sftpFullPath); },
+        [](const std::vector<std::string>& entries) { return entries.empty(); });
+}
+std::vector<std::string> minsftp::ListDirectoryOnce(const std::string& sftpFullPath) {
     std::vector<std::string> entries {};
 
     if (!IsInitialized()) {
-        fprintf(stderr, "sftp session is not initialized.\n");
+        MINSFTP_WARN("sftp session is not initialized.");
+        return entries;
+    }
+
+    if (nativeEngine) {
+        SftpChannel* ch = Channel();
+        if (!ch) {
+            return entries;
+        }
+        walk_options options{};
+        options.maxDepth = 1;
+        TreeWalker walker(ch, metrics.get(), [&entries](const tree_entry& entry) {
+            entries.push_back(entry.name);
+            return true;
+        }, options);
+        walker.Run(sftpFullPath);
         return entries;
     }
 
     char buffer[512] {};
-    LIBSSH2_SFTP_HANDLE* dir = libssh2_sftp_opendir(sftp_session, sftpFullPath.c_str());
+    LIBSSH2_SFTP_HANDLE* dir = SftpOpen(sftpFullPath, 0, 0, LIBSSH2_SFTP_OPENDIR);
     if (!dir) {
         return entries;
     }
 
     while (true) {
         LIBSSH2_SFTP_ATTRIBUTES attrs;
+        MetricTimer readdirTimer(metrics.get(), OP_READDIR);
         int rc = libssh2_sftp_readdir(dir, buffer, sizeof(buffer), &attrs);
+        readdirTimer.Stop(rc >= 0);
         if (rc <= 0) {
             break;
         }
@@ -562,7 +1917,7 @@ std::vector<std::string> minsftp::ListDirectory(const std::string sftpFullPath)
             entries.push_back(name);
         }
     }
-    libssh2_sftp_closedir(dir);
+    SftpClose(dir);
     return entries;
 }
 
@@ -570,20 +1925,33 @@ bool minsftp::IsInitialized() const {
     return libssh2_initialized;
 }
 bool minsftp::IsDirectory(const std::string sftpFullPath) {
+    return Retry([&] { return IsDirectoryOnce(sftpFullPath); }, [](bool dir) { return !dir; });
+}
+bool minsftp::IsDirectoryOnce(const std::string& sftpFullPath) {
     if (!IsInitialized()) {
         return false;
     }
 
+    if (nativeEngine) {
+        // a single STAT instead of open, fstat, close
+        SftpChannel* ch = Channel();
+        native_reply reply = NativeCall(ch, metrics.get(), OP_STAT, [&](SftpChannel::reply_fn fn) {
+            ch->Stat(sftpFullPath, fn);
+        });
+        return reply.type == FXP_ATTRS && LIBSSH2_SFTP_S_ISDIR(reply.attrs.permissions);
+    }
+
     LIBSSH2_SFTP_ATTRIBUTES attrs;
-    LIBSSH2_SFTP_HANDLE* handle = libssh2_sftp_open(sftp_session, sftpFullPath.c_str(), LIBSSH2_FXF_READ, 0);
+    bool reused = false;
+    LIBSSH2_SFTP_HANDLE* handle = AcquireHandle(sftpFullPath, LIBSSH2_FXF_READ, 0, reused);
     if (!handle) {
         return false;
     }
 
-    if (libssh2_sftp_fstat(handle, &attrs) == 0) {
-        libssh2_sftp_close(handle);
-        return LIBSSH2_SFTP_S_ISDIR(attrs.permissions);
-    }
-    libssh2_sftp_close(handle);
-    return false;
+    MetricTimer statTimer(metrics.get(), OP_STAT);
+    int rc = libssh2_sftp_fstat(handle, &attrs);
+    statTimer.Stop(rc == 0);
+
+    ReleaseHandle(sftpFullPath, LIBSSH2_FXF_READ, handle, rc == 0);
+    return rc == 0 && LIBSSH2_SFTP_S_ISDIR(attrs.permissions);
 }
@@ -18,19 +18,40 @@
 #include <libssh2_sftp.h>
 #include <openssl/bio.h>
 #include <openssl/evp.h>
+#ifdef WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #include <Windows.h>
 #pragma comment (lib, "Ws2_32.lib")
 #pragma comment (lib, "crypt32.lib")
+#else
+// posix build (benchmarks against a local sshd)
+#include <sys/socket.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+typedef const char* LPCSTR;
+#endif
 
 #include <iostream>
 #include <filesystem>
 #include <sstream>
 #include <algorithm>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
 namespace fs = std::filesystem;
 
 #include "utils.h"
+#include "transport.h"
+#include "metrics.h"
+#include "log.h"
+#include "handle_cache.h"
+#include "concurrency.h"
+#include "rate_limit.h"
+#include "resolver.h"
+#include "socket_tuning.h"
 
 //#ifdef WIN32
 //#define write(f, b, c)  write((f), (b), (unsigned int)(c))
@@ -85,7 +106,10 @@ enum MINSFTP_RES {
 	RES_NOT_INITIALIZED,
 	RES_SFTP_WRITE_FAILED,
 	RES_MOVE_FAILED,
-	RES_DELETE_FAILED
+	RES_DELETE_FAILED,
+	RES_METHOD_PREF_FAILED,
+	RES_CHANNEL_FAILED,
+	RES_EXEC_UNSUPPORTED
 };
 
 
@@ -98,13 +122,32 @@ struct auth_password {
 	std::string password;
 };
 
+// algorithm preferences passed to libssh2_session_method_pref before the handshake
+// every field is a comma separated list in order of preference, empty keeps the libssh2 default
+struct method_prefs {
+	std::string kex;
+	std::string hostkey;
+	std::string crypt; // used for both directions
+	std::string mac; // used for both directions
+	std::string comp; // used for both directions
+};
+
+struct method_bench_result {
+	method_prefs prefs{};
+	MINSFTP_RES res{ RES_FAILED };
+	double handshakeMs{};
+	double writeMBps{};
+	double readMBps{};
+};
+
 class Client {
 public:
 	std::string user{};
-	uint32_t hostaddr{};
+	std::string host{}; // name or address, ipv6 without brackets
 	u_short port{};
 
-	// format: user@hostaddr:port
+	// format: user@host:port, host is a name, an ipv4 address or an ipv6 address in brackets
+	// ([::1]); resolution starts right away in the background (see Resolver)
 	Client(const char* format);
 	Client() {}
 
@@ -116,8 +159,126 @@ private:
 	bool IsValidFormat(const char* format);
 };
 
+struct remote_file_options {
+	size_t blockSize{ 64 * 1024 };
+	size_t cacheBlocks{ 64 }; // lru capacity in blocks, 0 disables the cache
+	size_t readAheadBlocks{ 16 }; // blocks fetched past a miss once access is sequential
+	int sequentialTrigger{ 2 }; // back to back reads before access counts as sequential
+};
+
+// scheduling class of pipelined requests (SharedSession, TransferScheduler)
+// interactive requests go out ahead of queued bulk ones and bulk traffic is held back while
+// they are answered, so small operations stay fast during a large transfer
+enum PRIORITY_CLASS {
+	PRIORITY_BULK,
+	PRIORITY_INTERACTIVE,
+};
+
+enum BATCH_OP {
+	BATCH_STAT,
+	BATCH_LSTAT,
+	BATCH_MKDIR,
+	BATCH_RMDIR,
+	BATCH_REMOVE,
+	BATCH_RENAME,
+	BATCH_SETSTAT,
+	BATCH_REALPATH,
+};
+
+struct batch_op {
+	BATCH_OP type{};
+	std::string path{};
+	std::string newPath{}; // BATCH_RENAME target
+	long mode{ 0755 }; // BATCH_MKDIR
+	LIBSSH2_SFTP_ATTRIBUTES attrs{}; // BATCH_SETSTAT, only fields named in attrs.flags are sent
+};
+
+struct batch_result {
+	MINSFTP_RES res{ RES_FAILED };
+	unsigned long status{}; // LIBSSH2_FX_* from the server
+	LIBSSH2_SFTP_ATTRIBUTES attrs{}; // BATCH_STAT, BATCH_LSTAT
+	std::string path{}; // BATCH_REALPATH
+};
+
+struct tree_entry {
+	std::string path{}; // full remote path
+	std::string name{};
+	LIBSSH2_SFTP_ATTRIBUTES attrs{}; // as returned by readdir (not following symlinks)
+	int depth{}; // 1 for direct children of the root
+};
+
+// return false to stop the walk
+using walk_fn = std::function<bool(const tree_entry&)>;
+
+struct walk_options {
+	size_t maxDirsInFlight{ 16 }; // directories listed concurrently
+	// deepest level reported, as find -maxdepth: 1 lists the root's children only, 0 reports
+	// nothing (the root itself is never an entry), -1 for no limit
+	int maxDepth{ -1 };
+	// return true to skip an entry, a skipped directory is never opened
+	std::function<bool(const tree_entry&)> prune{};
+	// list with a single remote `find -printf` when the server allows exec, falls back to
+	// sftp readdir when it doesn't (or find is not GNU find)
+	bool tryExec{ false };
+};
+
+struct bulk_options {
+	size_t maxOpen{ 32 }; // files with an open handle at once (bounds memory as well)
+	size_t maxInFlight{ 256 }; // requests outstanding on the channel
+	uint32_t chunkSize{ 32 * 1024 }; // bytes per read/write request
+	size_t requestsPerFile{ 4 }; // reads/writes in flight for one file
+	size_t maxBytesInFlight{ 64 * 1024 * 1024 }; // BulkPut: file data taken from the source but not yet written
+};
+
+struct bulk_get_result {
+	size_t index{}; // into the paths passed to BulkGet
+	std::string path{};
+	MINSFTP_RES res{ RES_FAILED };
+	FILE_DATA data{}; // may be moved out by the callback
+};
+
+// called once per file as soon as it is complete (in completion order, not request order)
+using bulk_get_fn = std::function<void(bulk_get_result&)>;
+
+struct bulk_put_item {
+	std::string path{};
+	FILE_DATA data{};
+	long mode{ LIBSSH2_SFTP_S_IRUSR }; // for created files, same default as WriteBytes
+};
+
+// fill item and return true, or return false when there are no more files
+// only called when there is room under maxOpen/maxBytesInFlight, so files can be produced lazily
+using bulk_put_source = std::function<bool(bulk_put_item& item)>;
+
+struct bulk_put_result {
+	size_t index{}; // order in which the source produced the file
+	std::string path{};
+	MINSFTP_RES res{ RES_FAILED };
+};
+
+// called once per file after its handle was closed (close errors count, the server may
+// report write failures only then)
+using bulk_put_fn = std::function<void(const bulk_put_result&)>;
+
+struct keepalive_options {
+	int intervalSec{ 30 }; // ssh keepalive after this much silence (sent by operations and Heartbeat), 0 off
+	int idleCheckSec{ 60 }; // a session idle this long is probed before it is used again, 0 off
+	int probeTimeoutMs{ 3000 }; // the probe is a realpath round trip, no answer in time means dead
+	int timeoutMs{}; // blocking libssh2 calls give up after this, so a dead link fails instead of hanging; 0 never
+	// reconnect (and retry idempotent operations) when the connection turns out to be lost
+	bool reconnect{ true };
+	int maxRetries{ 1 };
+};
+
+class RemoteFile; // remote_file.h
+class SftpChannel; // sftp_channel.h
+class SharedSession; // shared_session.h
+
 class minsftp {
 private:
+	friend class RemoteFile;
+	friend session_hold SessionHold(LIBSSH2_SESSION* session);
+
 	AUTH_TYPE authType{};
 
 	Client client;
@@ -125,10 +286,100 @@ private:
 	auth_password password{};
 
 	bool libssh2_initialized{ false };
-	libssh2_socket_t sock{};
+	libssh2_socket_t sock{ LIBSSH2_INVALID_SOCKET };
 	LIBSSH2_SESSION* session = NULL;
 	LIBSSH2_SFTP* sftp_session{ nullptr };
-	LIBSSH2_SFTP_HANDLE* sftp_handle{ nullptr };
+
+	size_t chunkSize{ BUFFER_SIZE };
+	method_prefs methodPrefs{};
+	double handshakeMs{};
+	std::shared_ptr<Transport> transport{};
+	std::shared_ptr<Metrics> metrics{ std::make_shared<Metrics>() };
+	uint64_t generation{}; // bumped by Shutdown, handles from an older session are gone
+	std::shared_ptr<SftpChannel> channel{}; // raw sftp channel for pipelined requests, opened on first use
+	bool execFindUnsupported{ false }; // WalkTree tryExec failed once, don't ask again
+	uint64_t scpThreshold{}; // ReadBytes/WriteBytes switch to scp at this size, 0 never
+	bool scpUnsupported{ false }; // scp couldn't be started once, stay on sftp
+	bool nativeEngine{ false }; // plain api over the pipelining channel, see UseNativeEngine
+	std::shared_ptr<ConcurrencyController> concurrency{}; // per host limits, see EnableAdaptiveConcurrency
+	std::shared_ptr<TokenBucket> uploadLimit{}; // see SetRateLimit
+	std::shared_ptr<TokenBucket> downloadLimit{};
+	session_hold hold{}; // what TransportSend/Recv held back last, see WaitSessionSocket
+	connect_options connectOptions{};
+	socket_options socketOptions{};
+	uint64_t bdp{}; // bytes, estimated by Init
+	std::string peer{}; // address Init connected to
+	keepalive_options keepalive{};
+	std::chrono::steady_clock::time_point lastActivity{}; // start of the last operation
+	uint64_t reconnects{};
+
+	int ApplyMethodPrefs();
+	// open/close with metrics, openType is LIBSSH2_SFTP_OPENFILE or LIBSSH2_SFTP_OPENDIR
+	LIBSSH2_SFTP_HANDLE* SftpOpen(const std::string& sftpFullPath, unsigned long flags, long mode, int openType = LIBSSH2_SFTP_OPENFILE);
+	int SftpClose(LIBSSH2_SFTP_HANDLE* handle);
+	// scp transfer on its own channel, data streamed through sink/source
+	// RES_CHANNEL_FAILED only if the channel or the remote scp couldn't be started, RES_FAILED
+	// if scp started but refused the path (no such file, permission denied)
+	// result of a failed libssh2_scp_recv2/send64, see above
+	MINSFTP_RES ScpStartFailure() const;
+	MINSFTP_RES ScpRecv(const std::string& sftpFullPath, const std::function<MINSFTP_RES(const uint8_t*, size_t)>& sink);
+	MINSFTP_RES ScpSend(const std::string& sftpFullPath, uint64_t size, long mode,
+		const std::function<size_t(uint8_t*, size_t)>& source);
+	// open (or reopen after it broke) the pipelining channel, nullptr if the server refused
+	SftpChannel* Channel();
+	// ReadBytes/WriteBytes/SftpCopyFile on the pipelining channel
+	MINSFTP_RES NativeReadBytes(const std::string& sftpFullPath, FILE_DATA& readData, bool nullTerminate);
+	MINSFTP_RES NativeWriteBytes(const std::string& sftpFullPath, const FILE_DATA& data);
+	MINSFTP_RES NativeCopyFile(const std::string& oldSftpFullPath, const std::string& newSftpFullPath);
+
+	// idle handles kept open between calls, off until EnableHandleCache
+	HandleCache handleCache{ [this](LIBSSH2_SFTP_HANDLE* handle) { SftpClose(handle); } };
+	// cached handle for path/flags (reused: true) or a freshly opened one
+	LIBSSH2_SFTP_HANDLE* AcquireHandle(const std::string& sftpFullPath, unsigned long flags, long mode, bool& reused);
+	// give the handle back to the cache, or close it when it failed or caching is off
+	void ReleaseHandle(const std::string& sftpFullPath, unsigned long flags, LIBSSH2_SFTP_HANDLE* handle, bool ok);
+
+	// libssh2 send/recv callbacks, session abstract is the owning minsftp
+	// they never wait on a non-blocking session: held back i/o returns -EAGAIN and is
+	// recorded in hold. a blocking session is polled by libssh2 on the socket alone, so
+	// there they wait for the hold to end themselves
+	static LIBSSH2_SEND_FUNC(TransportSend);
+	static LIBSSH2_RECV_FUNC(TransportRecv);
+	// route the session socket through TransportSend/Recv
+	void InstallTransport();
+
+	// channel receive window for socketOptions and the bdp
+	uint32_t ChannelWindow() const;
+	// native ReadBytes/WriteBytes requests outstanding, enough to cover the bdp
+	size_t NativeChunksInFlight(size_t chunk) const;
+
+	// connection checks around operations, see keepalive_options
+	// send a due keepalive, probe the session if it sat idle for idleCheckSec (reconnecting a
+	// dead one) and, for an operation, mark its start
+	void CheckIdle(bool operation = true);
+	// realpath round trip within probeTimeoutMs, false if the connection is gone
+	bool Probe();
+	// the last libssh2 error was the connection failing (socket error, eof, timeout)
+	bool ConnectionLost() const;
+	// after a failed operation: reconnect if the connection was lost and that is allowed
+	bool Recover();
+	// run op (CheckIdle first) and again after each Recover() while failed(result), up to
+	// maxRetries times; for operations that are safe to repeat
+	template <typename Op, typename Failed>
+	auto Retry(Op op, Failed failed) -> decltype(op()) {
+		CheckIdle();
+		auto result = op();
+		for (int i = 0; i < keepalive.maxRetries && failed(result) && Recover(); i++) {
+			result = op();
+		}
+		return result;
+	}
+	// the plain api without Retry
+	MINSFTP_RES ReadBytesOnce(const std::string& sftpFullPath, FILE_DATA& readData, bool nullTerminate);
+	MINSFTP_RES WriteBytesOnce(const std::string& sftpFullPath, const FILE_DATA& data);
+	MINSFTP_RES SftpCopyFileOnce(const std::string& oldSftpFullPath, const std::string& newSftpFullPath);
+	std::vector<std::string> ListDirectoryOnce(const std::string& sftpFullPath);
+	bool IsDirectoryOnce(const std::string& sftpFullPath);
 
 public:
     minsftp() {}
@@ -141,6 +392,21 @@ public:
 
 	static FILE_DATA ReadPrivateKeyFromFile(const std::string path);
 
+	// set algorithm preferences, takes effect on the next Init()
+	void SetMethodPrefs(const method_prefs& prefs);
+	const method_prefs& MethodPrefs() const;
+	// preferences tuned for bulk throughput on this cpu:
+	// aes-gcm/aes-ctr first when AES-NI is available, curve25519 kex for a fast handshake
+	static method_prefs FastMethodPrefs();
+	// duration of the last successful key exchange in milliseconds
+	double HandshakeMs() const;
+
+	// connect once per candidate kex, cipher and mac and measure handshake time and
+	// bulk throughput by writing and reading testBytes at remoteTestPath (deleted afterwards)
+	// recommended (optional) receives the fastest combination that worked
+	static std::vector<method_bench_result> BenchmarkMethods(Client client, AUTH_TYPE authType, void* authVal,
+		const std::string remoteTestPath, size_t testBytes, method_prefs* recommended = nullptr);
+
 	const char* ResToStr(const MINSFTP_RES res);
 
 	// read bytes from a file into vector
@@ -149,6 +415,106 @@ public:
 	// write bytes to a file from vector
 	MINSFTP_RES WriteBytes(std::string sftpFullPath, const FILE_DATA& data);
 
+	// route the session socket through a transport shim (e.g. NetEm), takes effect on the next Init()
+	// nullptr restores plain socket i/o
+	void SetTransport(std::shared_ptr<Transport> shim);
+
+	// how Init resolves the host and races its addresses, see connect_options
+	void SetConnectOptions(const connect_options& options);
+	const connect_options& ConnectOptions() const;
+	// the address the session is connected to ("a.b.c.d:port" or "[v6]:port"), empty before Init
+	std::string PeerAddress() const;
+	// tcp options and buffer/window sizing of the connection (see socket_options), used by Init
+	void SetSocketOptions(const socket_options& options);
+	const socket_options& SocketOptions() const;
+	// bandwidth-delay product Init estimated from the handshake rtt and linkBps
+	uint64_t BdpEstimate() const;
+
+	// keepalives, idle checks and reconnects (see keepalive_options), on by default
+	// ReadBytes, WriteBytes, SftpCopyFile, ListDirectory and IsDirectory are retried on a new
+	// connection when the old one was lost, the other operations only reconnect before they start
+	// timeouts and keepalives apply to the current session right away
+	void SetKeepalive(const keepalive_options& options);
+	const keepalive_options& Keepalive() const;
+	// for a session sitting idle (e.g. in a pool): sends a keepalive when one is due and runs
+	// the idle check, call from the thread that uses this minsftp
+	// returns seconds until it should be called again, -1 if the connection is gone
+	int Heartbeat();
+	// Shutdown and Init with the same settings
+	MINSFTP_RES Reconnect();
+	// successful reconnects so far (automatic ones included)
+	uint64_t Reconnects() const;
+
+	// cap the bytes per second this session sends (upload) and receives (download), nullptr
+	// is unlimited. a bucket may sit under host/global buckets (TokenBucket::ForHost, Global)
+	// and the same bucket can be passed for both directions to limit them together
+	// limits everything on the connection (sftp, scp, exec, shared sessions), ssh overhead
+	// included. swap buckets between operations, change a bucket's rate at any time
+	void SetRateLimit(std::shared_ptr<TokenBucket> upload, std::shared_ptr<TokenBucket> download);
+	std::shared_ptr<TokenBucket> UploadLimit() const;
+	std::shared_ptr<TokenBucket> DownloadLimit() const;
+	// "host:port" as given to Client ("[v6]:port" for ipv6), the key of per host state
+	// (TokenBucket::ForHost, ConcurrencyController::ForHost)
+	std::string HostKey() const;
+
+	// per operation counts, bytes and latency histograms, on by default
+	// share one Metrics between sessions to aggregate, nullptr turns recording off
+	void SetMetrics(std::shared_ptr<Metrics> _metrics);
+	std::shared_ptr<Metrics> GetMetrics() const;
+
+	// size of each read/write request in ReadBytes/WriteBytes (default BUFFER_SIZE)
+	void SetChunkSize(size_t size);
+	size_t ChunkSize() const;
+
+	// keep up to maxOpen idle read handles open so repeated ReadBytes/IsDirectory on hot
+	// files skip the open/close round trips, 0 (default) closes them and turns caching off
+	// Move/Delete through this session invalidate affected entries, changes made by other
+	// clients are not seen (a cached handle keeps reading the file it was opened on)
+	void EnableHandleCache(size_t maxOpen);
+	size_t HandleCacheSize() const;
+
+	// whole file transfers over scp: one channel streaming the file with no per chunk
+	// request/response, usually faster than sftp for large files
+	MINSFTP_RES ScpReadBytes(const std::string sftpFullPath, FILE_DATA& readData, bool nullTerminate = false);
+	MINSFTP_RES ScpWriteBytes(const std::string sftpFullPath, const FILE_DATA& data, long mode = LIBSSH2_SFTP_S_IRUSR);
+	MINSFTP_RES ScpGet(const std::string sftpFullPath, std::ostream& out);
+	// size bytes from in, the size has to be known up front
+	MINSFTP_RES ScpPut(const std::string sftpFullPath, std::istream& in, uint64_t size, long mode = 0644);
+	// let ReadBytes/WriteBytes use scp for files of at least bytes (0, the default, turns it off)
+	// reads find out the size with an fstat once the first chunk came back full
+	// if scp can't be started the session remembers it and stays on sftp, a path scp refused
+	// (missing dir, permissions) just goes through sftp
+	void SetScpThreshold(uint64_t bytes);
+	uint64_t ScpThreshold() const;
+
+	// run ReadBytes/WriteBytes, SftpMakeDir/Move/Delete*/Copy*, ListDirectory and IsDirectory
+	// over the pipelining channel instead of libssh2's sftp layer: transfers keep several
+	// chunks in flight (chunks of at least 32 KB) and server extensions are used where
+	// they exist (copy-data makes SftpCopyFile a server side copy). off by default
+	// OpenRemoteFile, the handle cache and the scp threshold for reads stay on libssh2 sftp
+	void UseNativeEngine(bool enable);
+	bool NativeEngine() const;
+	// extensions the server announced in its VERSION packet (name -> data), opens the
+	// pipelining channel if needed, empty if that failed
+	std::map<std::string, std::string> ServerExtensions();
+
+	// size the pipelining window by the host's ConcurrencyController (concurrency.h), shared
+	// by every session to the same address:port: it grows while throughput keeps up and backs
+	// off when latency climbs or the server fails requests. channels opened afterwards follow
+	// it (Batch, WalkTree, BulkGet/BulkPut, the native engine, Share); options only count
+	// for the first session that creates the host's controller
+	void EnableAdaptiveConcurrency(const concurrency_options& options = concurrency_options{});
+	void DisableAdaptiveConcurrency();
+	// the host's controller, nullptr unless enabled
+	std::shared_ptr<ConcurrencyController> Concurrency() const;
+
+	// create a single directory
+	MINSFTP_RES SftpMakeDir(const std::string sftpFullPath, long mode = 0755);
+	// open a file for random access (see remote_file.h), nullptr on failure
+	// flags are LIBSSH2_FXF_*, mode is used when the file is created
+	std::unique_ptr<RemoteFile> OpenRemoteFile(const std::string sftpFullPath, unsigned long flags = LIBSSH2_FXF_READ,
+		long mode = 0, const remote_file_options& options = remote_file_options{});
+
 	// move/rename file or dir
 	MINSFTP_RES SftpMove(const std::string oldSftpFullPath, const std::string newSftpFullPath);
 	// delete file
@@ -160,6 +526,47 @@ public:
 	// copy dir
 	MINSFTP_RES SftpCopyDir(const std::string oldSftpFullPath, const std::string newSftpFullPath);
 
+	// send all ops back to back on a separate sftp channel with up to maxInFlight outstanding,
+	// so n metadata operations cost about one round trip instead of n
+	// results[i] belongs to ops[i]; ops are independent and the server may run them in any order
+	// returns RES_OK if every op succeeded, RES_FAILED if some failed (see results) and
+	// RES_CHANNEL_FAILED if the channel broke (unanswered ops get RES_CHANNEL_FAILED)
+	MINSFTP_RES Batch(const std::vector<batch_op>& ops, std::vector<batch_result>& results, size_t maxInFlight = 64);
+
+	// recursive listing below root (root itself isn't reported), entries are streamed to onEntry
+	// as replies arrive with several directories being read at once, so order is not sorted
+	// returns RES_FAILED if some directories couldn't be read (the rest is still walked)
+	MINSFTP_RES WalkTree(const std::string root, const walk_fn& onEntry, const walk_options& options = walk_options{});
+
+	// download many (small) files over the pipelining channel, keeping up to options.maxOpen
+	// files in different stages (open, fstat+read, close) at once instead of 4 round trips per file
+	// files are read up to the size fstat reported, onFile runs inside this call and must not
+	// call back into this minsftp
+	// returns RES_OK if every file was read, RES_FAILED if some failed, RES_CHANNEL_FAILED
+	MINSFTP_RES BulkGet(const std::vector<std::string>& paths, const bulk_get_fn& onFile,
+		const bulk_options& options = bulk_options{});
+
+	// upload many (small) files the same way: open, writes and close of up to maxOpen files overlap
+	// source is pulled lazily while fewer than maxOpen files and maxBytesInFlight bytes are pending,
+	// so memory stays bounded however many files there are; existing files are truncated
+	MINSFTP_RES BulkPut(const bulk_put_source& source, const bulk_put_fn& onFile,
+		const bulk_options& options = bulk_options{});
+	MINSFTP_RES BulkPut(std::vector<bulk_put_item>& items, const bulk_put_fn& onFile,
+		const bulk_options& options = bulk_options{});
+
+	// hand the connection to a SharedSession that many threads can use at once, their requests
+	// are multiplexed on one channel by a driver thread (options: maxOpen/chunkSize/requestsPerFile
+	// for its reads and writes, maxInFlight for the channel)
+	// don't use this minsftp until the SharedSession is destroyed, nullptr if it couldn't start
+	std::unique_ptr<SharedSession> Share(const bulk_options& options = bulk_options{});
+
+	// whole directory as one tar stream over an exec channel (needs a shell and tar on the
+	// server), unpacked/packed locally as it streams with no temp files. per file cost is a
+	// few header bytes instead of open/close round trips, for trees of many small files
+	// RES_EXEC_UNSUPPORTED if the server won't run it, use SftpCopyDir style transfers then
+	MINSFTP_RES TarDownloadDir(const std::string sftpFullPath, const std::string localPath);
+	MINSFTP_RES TarUploadDir(const std::string localPath, const std::string sftpFullPath);
+
 	std::vector<std::string> ListDirectory(const std::string sftpFullPath);
 
 	bool IsInitialized() const;
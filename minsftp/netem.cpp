@@ -0,0 +1,129 @@
+#include "netem.h"
+
+#include <algorithm>
+#include <cstring>
+
+// largest piece handed to send() at once so pacing stays smooth
+constexpr size_t NETEM_SEND_SLICE = 16 * 1024;
+constexpr size_t NETEM_RECV_SLICE = 64 * 1024;
+
+NetEm::NetEm(const netem_config& _config) {
+    config = _config;
+    start = clock::now();
+    sendNext = start;
+    recvLast = start;
+    rng.seed(std::random_device{}());
+}
+
+const netem_config& NetEm::Config() const {
+    return config;
+}
+
+// time the link needs to carry bytes at the configured bandwidth
+NetEm::clock::duration NetEm::Transmit(size_t bytes) const {
+    if (!config.bandwidthBps) {
+        return clock::duration::zero();
+    }
+    return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>((double)bytes / config.bandwidthBps));
+}
+
+// first point in time >= t that isn't inside a stall window
+NetEm::clock::time_point NetEm::AfterStall(clock::time_point t) const {
+    if (!config.stallEveryMs || !config.stallMs) {
+        return t;
+    }
+
+    auto period = std::chrono::milliseconds(config.stallEveryMs);
+    auto stall = std::chrono::milliseconds(std::min(config.stallMs, config.stallEveryMs));
+    auto intoPeriod = (t - start) % period;
+    // the stall sits at the end of every period
+    if (intoPeriod >= period - stall) {
+        return t - intoPeriod + period;
+    }
+    return t;
+}
+
+NetEm::clock::time_point NetEm::SendReady() const {
+    return sendReady;
+}
+NetEm::clock::time_point NetEm::RecvReady() const {
+    return inbound.empty() ? clock::time_point::max() : inbound.front().release;
+}
+
+ssize_t NetEm::Send(libssh2_socket_t sock, const void* buffer, size_t length, int flags) {
+    auto now = clock::now();
+    auto ready = AfterStall(std::max(now, sendNext));
+    if (ready > now) {
+        sendReady = ready;
+        return -EAGAIN;
+    }
+    sendReady = clock::time_point::max();
+
+    size_t slice = config.bandwidthBps ? std::min(length, NETEM_SEND_SLICE) : length;
+    ssize_t rc = SocketSend(sock, buffer, slice, flags);
+    if (rc > 0) {
+        sendNext = std::max(ready, sendNext) + Transmit((size_t)rc);
+    }
+    return rc;
+}
+
+// move everything the socket has into inbound, stamped with the time it may be delivered
+void NetEm::Drain(libssh2_socket_t sock, int flags) {
+    while (inboundEnd == -EAGAIN) {
+        chunk c{};
+        c.data.resize(NETEM_RECV_SLICE);
+        ssize_t rc = SocketRecv(sock, c.data.data(), c.data.size(), flags);
+        if (rc <= 0) {
+            if (rc != -EAGAIN) {
+                inboundEnd = rc; // eof or error, reported after the queued data
+            }
+            return;
+        }
+        c.data.resize((size_t)rc);
+
+        auto now = clock::now();
+        auto delay = std::chrono::milliseconds(config.rttMs);
+        if (config.jitterMs) {
+            std::uniform_int_distribution<int> dist(-(int)config.jitterMs, (int)config.jitterMs);
+            delay = std::max(std::chrono::milliseconds(0), delay + std::chrono::milliseconds(dist(rng)));
+        }
+
+        // keep order, serialize at the link bandwidth and skip stalls
+        c.release = std::max(now + delay, recvLast + Transmit(c.data.size()));
+        c.release = AfterStall(c.release);
+        recvLast = c.release;
+        inbound.push_back(std::move(c));
+    }
+}
+
+ssize_t NetEm::Recv(libssh2_socket_t sock, void* buffer, size_t length, int flags) {
+    Drain(sock, flags);
+
+    if (inbound.empty()) {
+        ssize_t rc = inboundEnd;
+        if (rc != -EAGAIN) {
+            inboundEnd = -EAGAIN;
+        }
+        return rc;
+    }
+
+    // data is on its way: the real socket may stay quiet until then, RecvReady tells the
+    // wait helpers when to come back (new arrivals still wake them and get stamped on time)
+    auto now = clock::now();
+    if (now < inbound.front().release) {
+        return -EAGAIN;
+    }
+
+    size_t copied = 0;
+    while (copied < length && !inbound.empty() && inbound.front().release <= now) {
+        chunk& c = inbound.front();
+        size_t n = std::min(length - copied, c.data.size() - c.offset);
+        memcpy((char*)buffer + copied, c.data.data() + c.offset, n);
+        copied += n;
+        c.offset += n;
+        if (c.offset == c.data.size()) {
+            inbound.pop_front();
+        }
+    }
+    return (ssize_t)copied;
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include "transport.h"
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <random>
+#include <vector>
+
+// link conditions injected by NetEm
+struct netem_config {
+	uint32_t rttMs{}; // added round trip time
+	uint32_t jitterMs{}; // rttMs varies by +-jitterMs, data stays in order
+	uint64_t bandwidthBps{}; // bytes per second in each direction, 0 = unlimited
+	uint32_t stallEveryMs{}; // every stallEveryMs the link stops moving data...
+	uint32_t stallMs{}; // ...for stallMs
+};
+
+// network emulation shim for measuring latency sensitive behaviour against localhost
+// received data is held back until rtt (+jitter) after it arrived, so pipelined requests
+// overlap like on a real wan link instead of paying the delay one after another
+// bandwidth is paced in both directions, stalls hold back both directions
+// nothing waits inside Send/Recv: data that isn't due yet returns -EAGAIN and SendReady/
+// RecvReady tell the session's wait helpers when to try again
+class NetEm : public Transport {
+public:
+	NetEm(const netem_config& config);
+
+	ssize_t Send(libssh2_socket_t sock, const void* buffer, size_t length, int flags) override;
+	ssize_t Recv(libssh2_socket_t sock, void* buffer, size_t length, int flags) override;
+	clock::time_point SendReady() const override;
+	clock::time_point RecvReady() const override;
+
+	const netem_config& Config() const;
+
+private:
+	struct chunk {
+		std::vector<char> data;
+		size_t offset{};
+		clock::time_point release;
+	};
+
+	netem_config config{};
+	clock::time_point start{};
+	std::mt19937 rng{};
+
+	clock::time_point sendNext{};
+	clock::time_point sendReady{ clock::time_point::max() }; // when a paced Send may go, max if it wasn't held
+	clock::time_point recvLast{};
+	std::deque<chunk> inbound{};
+	ssize_t inboundEnd{ -EAGAIN }; // what to return once inbound is empty: -EAGAIN, 0 (eof) or error
+
+	clock::duration Transmit(size_t bytes) const;
+	clock::time_point AfterStall(clock::time_point t) const;
+	void Drain(libssh2_socket_t sock, int flags);
+};
@@ -0,0 +1,91 @@
+#include "rate_limit.h"
+
+#include <algorithm>
+#include <thread>
+
+TokenBucket::TokenBucket(uint64_t bytesPerSecond, uint64_t burstBytes, std::shared_ptr<TokenBucket> _parent) {
+    parent = _parent;
+    SetRate(bytesPerSecond, burstBytes);
+}
+
+std::shared_ptr<TokenBucket> TokenBucket::Global() {
+    static std::shared_ptr<TokenBucket> global = std::make_shared<TokenBucket>();
+    return global;
+}
+
+std::shared_ptr<TokenBucket> TokenBucket::ForHost(const std::string& host) {
+    static std::mutex registryMutex;
+    static std::map<std::string, std::shared_ptr<TokenBucket>> registry;
+
+    // kept for the whole process, a limit set before connecting must still be there after
+    std::lock_guard<std::mutex> lock(registryMutex);
+    std::shared_ptr<TokenBucket>& bucket = registry[host];
+    if (!bucket) {
+        bucket = std::make_shared<TokenBucket>(0, 0, Global());
+    }
+    return bucket;
+}
+
+void TokenBucket::SetRate(uint64_t bytesPerSecond, uint64_t burstBytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    bool wasUnlimited = !rate;
+    rate = bytesPerSecond;
+    burst = burstBytes ? burstBytes : std::max<uint64_t>(rate / 10, 32 * 1024);
+    if (wasUnlimited) {
+        // start full rather than with whatever was left from before
+        tokens = (double)burst;
+        last = std::chrono::steady_clock::now();
+    }
+    tokens = std::min(tokens, (double)burst);
+}
+
+uint64_t TokenBucket::Rate() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return rate;
+}
+uint64_t TokenBucket::Burst() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return burst;
+}
+std::shared_ptr<TokenBucket> TokenBucket::Parent() const {
+    return parent;
+}
+
+std::chrono::steady_clock::duration TokenBucket::Take(uint64_t bytes) {
+    auto now = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::duration wait{};
+    for (TokenBucket* bucket = this; bucket; bucket = bucket->parent.get()) {
+        wait = std::max(wait, bucket->TakeOwn(bytes, now));
+    }
+    return wait;
+}
+
+void TokenBucket::Acquire(uint64_t bytes) {
+    std::chrono::steady_clock::duration wait = Take(bytes);
+    if (wait.count() > 0) {
+        std::this_thread::sleep_for(wait);
+    }
+}
+
+std::chrono::steady_clock::duration TokenBucket::Delay() {
+    return Take(0);
+}
+
+std::chrono::steady_clock::duration TokenBucket::TakeOwn(uint64_t bytes, std::chrono::steady_clock::time_point now) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!rate) {
+        return {};
+    }
+
+    // another thread may have refilled with a later now already
+    if (now > last) {
+        tokens = std::min((double)burst, tokens + std::chrono::duration<double>(now - last).count() * rate);
+        last = now;
+    }
+    tokens -= (double)bytes;
+    if (tokens >= 0) {
+        return {};
+    }
+    return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(-tokens / rate));
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// token bucket bandwidth limit, optionally nested under a parent (global -> host -> session
+// -> transfer): bytes are taken from the bucket and every ancestor, the slowest one decides
+// how long the caller has to wait. buckets may go into debt, a caller sends its block and then
+// waits it off (Delay before the next block), so the sender never has to split writes. rates
+// can change at any time and apply to the next block. thread safe
+class TokenBucket {
+public:
+	// bytesPerSecond 0 is unlimited, burstBytes 0 picks 100ms worth of rate (at least 32 KB)
+	TokenBucket(uint64_t bytesPerSecond = 0, uint64_t burstBytes = 0, std::shared_ptr<TokenBucket> _parent = nullptr);
+
+	// root of the hierarchy, unlimited until SetRate
+	static std::shared_ptr<TokenBucket> Global();
+	// bucket for host ("address:port") under Global(), created unlimited on first use and kept
+	static std::shared_ptr<TokenBucket> ForHost(const std::string& host);
+
+	void SetRate(uint64_t bytesPerSecond, uint64_t burstBytes = 0);
+	uint64_t Rate() const;
+	uint64_t Burst() const;
+	std::shared_ptr<TokenBucket> Parent() const;
+
+	// account for bytes that were just transferred, returns how long to wait before the next
+	// transfer (zero while every bucket up the chain still has tokens)
+	std::chrono::steady_clock::duration Take(uint64_t bytes);
+	// Take and sleep it off
+	void Acquire(uint64_t bytes);
+	// how long until every bucket up the chain is out of debt, takes nothing
+	std::chrono::steady_clock::duration Delay();
+
+private:
+	std::shared_ptr<TokenBucket> parent{};
+	mutable std::mutex mutex{};
+	uint64_t rate{};
+	uint64_t burst{};
+	double tokens{};
+	std::chrono::steady_clock::time_point last{};
+
+	std::chrono::steady_clock::duration TakeOwn(uint64_t bytes, std::chrono::steady_clock::time_point now);
+};
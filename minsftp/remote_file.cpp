@@ -0,0 +1,295 @@
+#include "remote_file.h"
+
+#include <cstring>
+
+RemoteFile::RemoteFile(minsftp* _owner, LIBSSH2_SFTP_HANDLE* _handle, const std::string& _path, const remote_file_options& _options) {
+    owner = _owner;
+    ownerGeneration = _owner->generation;
+    handle = _handle;
+    path = _path;
+    options = _options;
+    if (!options.blockSize) {
+        options.blockSize = BUFFER_SIZE;
+    }
+}
+RemoteFile::~RemoteFile() {
+    Close();
+}
+
+MINSFTP_RES RemoteFile::Close() {
+    if (!handle) {
+        return RES_OK;
+    }
+
+    // the session this handle belonged to is already gone
+    if (owner->generation != ownerGeneration) {
+        handle = nullptr;
+        return RES_NOT_INITIALIZED;
+    }
+
+    int rc = owner->SftpClose(handle);
+    handle = nullptr;
+    InvalidateCache();
+    return rc == 0 ? RES_OK : RES_FAILED;
+}
+bool RemoteFile::IsOpen() const {
+    return handle != nullptr && owner->generation == ownerGeneration;
+}
+
+const std::string& RemoteFile::Path() const {
+    return path;
+}
+uint64_t RemoteFile::CacheHits() const {
+    return hits;
+}
+uint64_t RemoteFile::CacheMisses() const {
+    return misses;
+}
+
+Metrics* RemoteFile::GetMetrics() const {
+    return owner->metrics.get();
+}
+
+MINSFTP_RES RemoteFile::Size(uint64_t& size) {
+    if (!IsOpen()) {
+        return RES_NOT_INITIALIZED;
+    }
+
+    LIBSSH2_SFTP_ATTRIBUTES attrs{};
+    MetricTimer timer(GetMetrics(), OP_STAT);
+    int rc = libssh2_sftp_fstat(handle, &attrs);
+    timer.Stop(rc == 0);
+    if (rc || !(attrs.flags & LIBSSH2_SFTP_ATTR_SIZE)) {
+        return RES_FAILED;
+    }
+
+    size = attrs.filesize;
+    return RES_OK;
+}
+
+// read straight from the handle, seeking only when the handle isn't already at offset
+// (a seek makes libssh2 throw away the read requests it has in flight)
+ssize_t RemoteFile::ReadRaw(uint64_t offset, char* buffer, size_t len) {
+    if (handlePos != offset) {
+        libssh2_sftp_seek64(handle, offset);
+        handlePos = offset;
+    }
+
+    size_t total = 0;
+    while (total < len) {
+        MetricTimer timer(GetMetrics(), OP_READ);
+        ssize_t n = libssh2_sftp_read(handle, buffer + total, len - total);
+        timer.Stop(n >= 0, n > 0 ? (uint64_t)n : 0);
+
+        if (n < 0) {
+            MINSFTP_ERROR("error reading %s at %llu: %zd", path.c_str(), (unsigned long long)(offset + total), n);
+            handlePos = UINT64_MAX;
+            return -1;
+        }
+        if (n == 0) {
+            knownSize = offset + total;
+            break;
+        }
+        total += (size_t)n;
+        handlePos += (uint64_t)n;
+    }
+    readLast = true;
+    return (ssize_t)total;
+}
+
+const RemoteFile::block* RemoteFile::CachedBlock(uint64_t index) {
+    auto it = blocks.find(index);
+    if (it == blocks.end()) {
+        return nullptr;
+    }
+
+    // move to the front of the lru
+    lru.splice(lru.begin(), lru, it->second);
+    return &*it->second;
+}
+
+void RemoteFile::EraseBlock(uint64_t index) {
+    auto it = blocks.find(index);
+    if (it != blocks.end()) {
+        lru.erase(it->second);
+        blocks.erase(it);
+    }
+}
+
+void RemoteFile::InvalidateCache() {
+    lru.clear();
+    blocks.clear();
+    knownSize = UINT64_MAX;
+}
+
+// read count blocks starting at block first with one pipelined read and cache them
+bool RemoteFile::FetchBlocks(uint64_t first, size_t count) {
+    const size_t bs = options.blockSize;
+    FILE_DATA data(bs * count);
+    ssize_t n = ReadRaw(first * bs, reinterpret_cast<char*>(data.data()), data.size());
+    if (n < 0) {
+        return false;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        size_t begin = i * bs;
+        if (begin >= (size_t)n && i > 0) {
+            break; // past the end of file, but keep one empty block so eof is cached
+        }
+
+        block b{};
+        b.index = first + i;
+        size_t end = std::min((size_t)n, begin + bs);
+        if (end > begin) {
+            b.data.assign(data.begin() + begin, data.begin() + end);
+        }
+
+        EraseBlock(b.index);
+        lru.push_front(std::move(b));
+        blocks[first + i] = lru.begin();
+    }
+
+    while (lru.size() > options.cacheBlocks) {
+        blocks.erase(lru.back().index);
+        lru.pop_back();
+    }
+    return true;
+}
+
+ssize_t RemoteFile::ReadAt(uint64_t offset, void* buffer, size_t len) {
+    if (!IsOpen()) {
+        return -1;
+    }
+
+    // sequential detection: this read starts where the previous one ended
+    if (offset == lastReadEnd) {
+        sequentialReads++;
+    }
+    else {
+        sequentialReads = 0;
+    }
+
+    ssize_t result = 0;
+    if (!options.cacheBlocks) {
+        result = ReadRaw(offset, reinterpret_cast<char*>(buffer), len);
+    }
+    else {
+        const size_t bs = options.blockSize;
+        char* out = reinterpret_cast<char*>(buffer);
+        size_t copied = 0;
+
+        while (copied < len) {
+            uint64_t pos = offset + copied;
+            if (pos >= knownSize) {
+                break;
+            }
+
+            uint64_t index = pos / bs;
+            const block* b = CachedBlock(index);
+            if (b) {
+                hits++;
+            }
+            else {
+                misses++;
+                // blocks the caller asked for plus read-ahead when sequential,
+                // stopping before blocks we already have
+                uint64_t lastWanted = (offset + len - 1) / bs;
+                size_t count = (size_t)(lastWanted - index + 1);
+                if (sequentialReads >= options.sequentialTrigger) {
+                    count += options.readAheadBlocks;
+                }
+                count = std::min(count, std::max<size_t>(1, options.cacheBlocks));
+                for (size_t i = 1; i < count; i++) {
+                    if (blocks.count(index + i)) {
+                        count = i;
+                        break;
+                    }
+                }
+
+                if (!FetchBlocks(index, count)) {
+                    return -1;
+                }
+                b = CachedBlock(index);
+                if (!b) {
+                    return -1;
+                }
+            }
+
+            size_t inBlock = (size_t)(pos - index * bs);
+            if (inBlock >= b->data.size()) {
+                break; // end of file
+            }
+            size_t n = std::min(len - copied, b->data.size() - inBlock);
+            memcpy(out + copied, b->data.data() + inBlock, n);
+            copied += n;
+            if (b->data.size() < bs) {
+                if (copied < len) {
+                    break; // short block is the last one
+                }
+            }
+        }
+        result = (ssize_t)copied;
+    }
+
+    if (result >= 0) {
+        lastReadEnd = offset + (uint64_t)result;
+    }
+    return result;
+}
+
+MINSFTP_RES RemoteFile::ReadAt(uint64_t offset, size_t len, FILE_DATA& out) {
+    out.resize(len);
+    ssize_t n = ReadAt(offset, out.data(), len);
+    if (n < 0) {
+        out.clear();
+        return IsOpen() ? RES_FAILED : RES_NOT_INITIALIZED;
+    }
+    out.resize((size_t)n);
+    return RES_OK;
+}
+
+MINSFTP_RES RemoteFile::WriteAt(uint64_t offset, const void* data, size_t len) {
+    if (!IsOpen()) {
+        return RES_NOT_INITIALIZED;
+    }
+
+    // after a read libssh2's own offset is past handlePos by its read-ahead and a write would
+    // go there, the seek puts it back and drops the read-ahead
+    if (handlePos != offset || readLast) {
+        libssh2_sftp_seek64(handle, offset);
+    }
+    readLast = false;
+    // reads queued by libssh2 before this write would be stale, make the next read seek
+    handlePos = UINT64_MAX;
+
+    const char* in = reinterpret_cast<const char*>(data);
+    size_t written = 0;
+    while (written < len) {
+        MetricTimer timer(GetMetrics(), OP_WRITE);
+        ssize_t rc = libssh2_sftp_write(handle, in + written, len - written);
+        timer.Stop(rc >= 0, rc > 0 ? (uint64_t)rc : 0);
+        if (rc < 0) {
+            MINSFTP_ERROR("error writing %s at %llu: %zd", path.c_str(), (unsigned long long)(offset + written), rc);
+            InvalidateCache();
+            return RES_SFTP_WRITE_FAILED;
+        }
+        written += (size_t)rc;
+    }
+
+    // drop the blocks this write touched
+    if (options.cacheBlocks && len) {
+        const size_t bs = options.blockSize;
+        for (uint64_t index = offset / bs; index <= (offset + len - 1) / bs; index++) {
+            EraseBlock(index);
+        }
+    }
+    if (knownSize != UINT64_MAX) {
+        if (offset + len > knownSize) {
+            // the old last block may have grown
+            EraseBlock(knownSize / options.blockSize);
+        }
+        knownSize = std::max<uint64_t>(knownSize, offset + len);
+    }
+    lastReadEnd = UINT64_MAX;
+    return RES_OK;
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include "minsftp.h"
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+// random access handle to a remote file that stays open between calls
+// reads go through a block lru cache; once reads are sequential a miss fetches
+// readAheadBlocks extra blocks in one pipelined read, and since the handle isn't seeked
+// libssh2 keeps the following read requests in flight while the caller works on the data
+// must be closed (or destroyed) before the owning minsftp is shut down or destroyed
+class RemoteFile {
+public:
+	~RemoteFile();
+	RemoteFile(const RemoteFile&) = delete;
+	RemoteFile& operator=(const RemoteFile&) = delete;
+
+	// pread: up to len bytes at offset, fewer only at end of file
+	// returns bytes read or -1 on error
+	ssize_t ReadAt(uint64_t offset, void* buffer, size_t len);
+	MINSFTP_RES ReadAt(uint64_t offset, size_t len, FILE_DATA& out);
+	// pwrite: all of len bytes at offset
+	MINSFTP_RES WriteAt(uint64_t offset, const void* data, size_t len);
+
+	MINSFTP_RES Size(uint64_t& size);
+	MINSFTP_RES Close();
+	bool IsOpen() const;
+
+	const std::string& Path() const;
+	uint64_t CacheHits() const;
+	uint64_t CacheMisses() const;
+	// drop cached blocks, e.g. after the file was changed through another handle
+	void InvalidateCache();
+
+private:
+	friend class minsftp;
+
+	struct block {
+		uint64_t index{};
+		FILE_DATA data{};
+	};
+
+	RemoteFile(minsftp* _owner, LIBSSH2_SFTP_HANDLE* _handle, const std::string& _path, const remote_file_options& _options);
+
+	minsftp* owner{};
+	uint64_t ownerGeneration{};
+	LIBSSH2_SFTP_HANDLE* handle{};
+	std::string path{};
+	remote_file_options options{};
+
+	// offset of the libssh2 handle, UINT64_MAX when unknown (forces a seek)
+	uint64_t handlePos{ 0 };
+	bool readLast{ false }; // libssh2 may have read-ahead in flight past handlePos
+	uint64_t lastReadEnd{ UINT64_MAX };
+	int sequentialReads{};
+	uint64_t knownSize{ UINT64_MAX }; // set once a read hit the end of file
+
+	std::list<block> lru{}; // most recently used first
+	std::unordered_map<uint64_t, std::list<block>::iterator> blocks{};
+	uint64_t hits{};
+	uint64_t misses{};
+
+	ssize_t ReadRaw(uint64_t offset, char* buffer, size_t len);
+	bool FetchBlocks(uint64_t first, size_t count);
+	const block* CachedBlock(uint64_t index);
+	void EraseBlock(uint64_t index);
+	Metrics* GetMetrics() const;
+};
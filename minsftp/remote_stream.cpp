@@ -0,0 +1,281 @@
+#include "remote_stream.h"
+
+#include <cstring>
+
+// the stream buffer does the caching, RemoteFile only forwards to the handle
+static remote_file_options StreamFileOptions() {
+    remote_file_options options{};
+    options.cacheBlocks = 0;
+    return options;
+}
+
+RemoteInBuf::RemoteInBuf(minsftp& sftp, const std::string path, size_t bufferSize) {
+    file = sftp.OpenRemoteFile(path, LIBSSH2_FXF_READ, 0, StreamFileOptions());
+    buffer.resize(bufferSize ? bufferSize : BUFFER_SIZE);
+    setg(buffer.data(), buffer.data(), buffer.data());
+}
+
+bool RemoteInBuf::IsOpen() const {
+    return file && file->IsOpen();
+}
+
+uint64_t RemoteInBuf::Position() const {
+    return bufferStart + (uint64_t)(gptr() - eback());
+}
+
+RemoteInBuf::int_type RemoteInBuf::underflow() {
+    if (gptr() < egptr()) {
+        return traits_type::to_int_type(*gptr());
+    }
+    if (!IsOpen()) {
+        return traits_type::eof();
+    }
+
+    uint64_t pos = Position();
+    ssize_t n = file->ReadAt(pos, buffer.data(), buffer.size());
+    bufferStart = pos;
+    if (n <= 0) {
+        if (n == 0) {
+            fileSize = pos;
+        }
+        setg(buffer.data(), buffer.data(), buffer.data());
+        return traits_type::eof();
+    }
+
+    setg(buffer.data(), buffer.data(), buffer.data() + n);
+    return traits_type::to_int_type(*gptr());
+}
+
+std::streamsize RemoteInBuf::xsgetn(char_type* s, std::streamsize count) {
+    std::streamsize done = 0;
+
+    // whatever is buffered first
+    std::streamsize buffered = std::min<std::streamsize>(count, egptr() - gptr());
+    if (buffered > 0) {
+        memcpy(s, gptr(), (size_t)buffered);
+        gbump((int)buffered);
+        done += buffered;
+    }
+
+    // big reads go straight to the caller's memory
+    while (done < count) {
+        std::streamsize left = count - done;
+        if ((size_t)left < buffer.size()) {
+            if (traits_type::eq_int_type(underflow(), traits_type::eof())) {
+                break;
+            }
+            std::streamsize n = std::min<std::streamsize>(left, egptr() - gptr());
+            memcpy(s + done, gptr(), (size_t)n);
+            gbump((int)n);
+            done += n;
+            continue;
+        }
+
+        if (!IsOpen()) {
+            break;
+        }
+        uint64_t pos = Position();
+        ssize_t n = file->ReadAt(pos, s + done, (size_t)left);
+        // empty buffer positioned after what we just read
+        bufferStart = pos + (n > 0 ? (uint64_t)n : 0);
+        setg(buffer.data(), buffer.data(), buffer.data());
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+std::streamsize RemoteInBuf::showmanyc() {
+    std::streamsize buffered = egptr() - gptr();
+    if (buffered > 0) {
+        return buffered;
+    }
+    return fileSize != UINT64_MAX && Position() >= fileSize ? -1 : 0;
+}
+
+RemoteInBuf::pos_type RemoteInBuf::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+    if (!(which & std::ios_base::in) || !IsOpen()) {
+        return pos_type(off_type(-1));
+    }
+
+    int64_t base = 0;
+    if (dir == std::ios_base::cur) {
+        base = (int64_t)Position();
+    }
+    else if (dir == std::ios_base::end) {
+        if (fileSize == UINT64_MAX) {
+            uint64_t size{};
+            if (file->Size(size) != RES_OK) {
+                return pos_type(off_type(-1));
+            }
+            fileSize = size;
+        }
+        base = (int64_t)fileSize;
+    }
+    return seekpos(pos_type(off_type(base + off)), which);
+}
+
+RemoteInBuf::pos_type RemoteInBuf::seekpos(pos_type pos, std::ios_base::openmode which) {
+    if (!(which & std::ios_base::in) || !IsOpen() || off_type(pos) < 0) {
+        return pos_type(off_type(-1));
+    }
+
+    uint64_t target = (uint64_t)off_type(pos);
+    uint64_t bufferEnd = bufferStart + (uint64_t)(egptr() - eback());
+    if (target >= bufferStart && target <= bufferEnd) {
+        // still inside what we have
+        setg(eback(), eback() + (target - bufferStart), egptr());
+    }
+    else {
+        bufferStart = target;
+        setg(buffer.data(), buffer.data(), buffer.data());
+    }
+    return pos;
+}
+
+RemoteOutBuf::RemoteOutBuf(minsftp& sftp, const std::string path, size_t bufferSize, long mode) {
+    file = sftp.OpenRemoteFile(path, LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC, mode, StreamFileOptions());
+    buffer.resize(bufferSize ? bufferSize : BUFFER_SIZE);
+    setp(buffer.data(), buffer.data() + buffer.size());
+}
+RemoteOutBuf::~RemoteOutBuf() {
+    Close();
+}
+
+bool RemoteOutBuf::IsOpen() const {
+    return file && file->IsOpen();
+}
+
+bool RemoteOutBuf::FlushBuffer() {
+    size_t n = (size_t)(pptr() - pbase());
+    if (!n) {
+        return !failed;
+    }
+    if (failed || !IsOpen()) {
+        failed = true;
+        return false;
+    }
+
+    if (file->WriteAt(bufferStart, pbase(), n) != RES_OK) {
+        failed = true;
+        return false;
+    }
+    bufferStart += n;
+    setp(buffer.data(), buffer.data() + buffer.size());
+    return true;
+}
+
+MINSFTP_RES RemoteOutBuf::Close() {
+    if (!file) {
+        return failed ? RES_SFTP_WRITE_FAILED : RES_OK;
+    }
+
+    bool flushed = FlushBuffer();
+    MINSFTP_RES res = file->Close();
+    file.reset();
+    if (!flushed) {
+        return RES_SFTP_WRITE_FAILED;
+    }
+    return res;
+}
+
+RemoteOutBuf::int_type RemoteOutBuf::overflow(int_type ch) {
+    if (!FlushBuffer()) {
+        return traits_type::eof();
+    }
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+std::streamsize RemoteOutBuf::xsputn(const char_type* s, std::streamsize count) {
+    // small writes fill the buffer
+    if ((size_t)count < buffer.size()) {
+        std::streamsize done = 0;
+        while (done < count) {
+            std::streamsize room = epptr() - pptr();
+            if (!room) {
+                if (!FlushBuffer()) {
+                    return done;
+                }
+                continue;
+            }
+            std::streamsize n = std::min(room, count - done);
+            memcpy(pptr(), s + done, (size_t)n);
+            pbump((int)n);
+            done += n;
+        }
+        return done;
+    }
+
+    // big ones go out directly after what is buffered
+    if (!FlushBuffer()) {
+        return 0;
+    }
+    if (file->WriteAt(bufferStart, s, (size_t)count) != RES_OK) {
+        failed = true;
+        return 0;
+    }
+    bufferStart += (uint64_t)count;
+    return count;
+}
+
+int RemoteOutBuf::sync() {
+    return FlushBuffer() ? 0 : -1;
+}
+
+RemoteOutBuf::pos_type RemoteOutBuf::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+    if (!(which & std::ios_base::out)) {
+        return pos_type(off_type(-1));
+    }
+    uint64_t current = bufferStart + (uint64_t)(pptr() - pbase());
+    if (dir == std::ios_base::cur) {
+        return seekpos(pos_type(off_type((int64_t)current + off)), which);
+    }
+    if (dir == std::ios_base::beg) {
+        return seekpos(pos_type(off), which);
+    }
+    // seeking from the end needs a stat, not supported for output
+    return pos_type(off_type(-1));
+}
+
+RemoteOutBuf::pos_type RemoteOutBuf::seekpos(pos_type pos, std::ios_base::openmode which) {
+    if (!(which & std::ios_base::out) || off_type(pos) < 0 || !FlushBuffer()) {
+        return pos_type(off_type(-1));
+    }
+    bufferStart = (uint64_t)off_type(pos);
+    return pos;
+}
+
+RemoteIStream::RemoteIStream(minsftp& sftp, const std::string path, size_t bufferSize)
+    : std::istream(nullptr), buf(sftp, path, bufferSize) {
+    rdbuf(&buf);
+    if (!buf.IsOpen()) {
+        setstate(std::ios_base::failbit);
+    }
+}
+bool RemoteIStream::IsOpen() const {
+    return buf.IsOpen();
+}
+
+RemoteOStream::RemoteOStream(minsftp& sftp, const std::string path, size_t bufferSize)
+    : std::ostream(nullptr), buf(sftp, path, bufferSize) {
+    rdbuf(&buf);
+    if (!buf.IsOpen()) {
+        setstate(std::ios_base::failbit);
+    }
+}
+bool RemoteOStream::IsOpen() const {
+    return buf.IsOpen();
+}
+MINSFTP_RES RemoteOStream::Close() {
+    MINSFTP_RES res = buf.Close();
+    if (res != RES_OK) {
+        setstate(std::ios_base::badbit);
+    }
+    return res;
+}
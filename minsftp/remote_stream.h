@@ -0,0 +1,82 @@
+#pragma once
+#include "remote_file.h"
+
+#include <istream>
+#include <ostream>
+#include <streambuf>
+
+constexpr size_t REMOTE_STREAM_BUFFER = 1024 * 1024;
+
+// std::streambuf reading a remote file through a large buffer
+// refills are sequential ReadAt calls on a kept-open handle, so libssh2 keeps read requests
+// pipelined ahead of the parser; reads bigger than the buffer bypass it
+class RemoteInBuf : public std::streambuf {
+public:
+	RemoteInBuf(minsftp& sftp, const std::string path, size_t bufferSize = REMOTE_STREAM_BUFFER);
+
+	bool IsOpen() const;
+
+protected:
+	int_type underflow() override;
+	std::streamsize xsgetn(char_type* s, std::streamsize count) override;
+	std::streamsize showmanyc() override;
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+	pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+
+private:
+	std::unique_ptr<RemoteFile> file{};
+	std::vector<char> buffer{};
+	uint64_t bufferStart{}; // file offset of eback()
+	uint64_t fileSize{ UINT64_MAX };
+
+	uint64_t Position() const;
+};
+
+// std::streambuf writing a remote file (created/truncated) through a large buffer
+// libssh2 pipelines the write requests of every flush
+class RemoteOutBuf : public std::streambuf {
+public:
+	RemoteOutBuf(minsftp& sftp, const std::string path, size_t bufferSize = REMOTE_STREAM_BUFFER,
+		long mode = LIBSSH2_SFTP_S_IRUSR | LIBSSH2_SFTP_S_IWUSR);
+	~RemoteOutBuf();
+
+	bool IsOpen() const;
+	// flush and close the handle, the result tells if everything made it
+	MINSFTP_RES Close();
+
+protected:
+	int_type overflow(int_type ch) override;
+	std::streamsize xsputn(const char_type* s, std::streamsize count) override;
+	int sync() override;
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+	pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+
+private:
+	std::unique_ptr<RemoteFile> file{};
+	std::vector<char> buffer{};
+	uint64_t bufferStart{}; // file offset of pbase()
+	bool failed{};
+
+	bool FlushBuffer();
+};
+
+class RemoteIStream : public std::istream {
+public:
+	RemoteIStream(minsftp& sftp, const std::string path, size_t bufferSize = REMOTE_STREAM_BUFFER);
+
+	bool IsOpen() const;
+
+private:
+	RemoteInBuf buf;
+};
+
+class RemoteOStream : public std::ostream {
+public:
+	RemoteOStream(minsftp& sftp, const std::string path, size_t bufferSize = REMOTE_STREAM_BUFFER);
+
+	bool IsOpen() const;
+	MINSFTP_RES Close();
+
+private:
+	RemoteOutBuf buf;
+};
@@ -0,0 +1,346 @@
+#include "resolver.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cstring>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#ifdef WIN32
+#pragma comment (lib, "Ws2_32.lib")
+#else
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+struct resolve_entry {
+    std::string host{};
+    uint16_t port{};
+    std::shared_future<std::vector<resolved_address>> result{};
+    std::chrono::steady_clock::time_point started{};
+    std::string preferred{}; // ToString() of the last winner
+};
+
+static std::mutex resolveMutex;
+static std::map<std::pair<std::string, uint16_t>, resolve_entry> resolveCache;
+
+// the cache entry for host:port, resolved again once older than cacheTtlSec (resolveMutex held)
+static resolve_entry& StartLookup(const std::string& host, uint16_t port, int cacheTtlSec,
+    std::vector<resolved_address> (*resolve)(const std::string&, uint16_t)) {
+    auto now = std::chrono::steady_clock::now();
+    resolve_entry& entry = resolveCache[{ host, port }];
+    bool fresh = entry.result.valid() && now - entry.started < std::chrono::seconds(cacheTtlSec);
+    if (fresh) {
+        return entry;
+    }
+
+    entry.host = host;
+    entry.port = port;
+    entry.started = now;
+    // a detached thread rather than std::async, whose future would block on destruction
+    // when the caller gives up waiting
+    auto promise = std::make_shared<std::promise<std::vector<resolved_address>>>();
+    entry.result = promise->get_future().share();
+    std::thread([promise, host, port, resolve] {
+        promise->set_value(resolve(host, port));
+    }).detach();
+    return entry;
+}
+
+std::string resolved_address::ToString() const {
+    char text[INET6_ADDRSTRLEN]{};
+    if (addr.ss_family == AF_INET6) {
+        const sockaddr_in6* in6 = (const sockaddr_in6*)&addr;
+        inet_ntop(AF_INET6, (void*)&in6->sin6_addr, text, sizeof(text));
+        return "[" + std::string(text) + "]:" + std::to_string(ntohs(in6->sin6_port));
+    }
+    const sockaddr_in* in = (const sockaddr_in*)&addr;
+    inet_ntop(AF_INET, (void*)&in->sin_addr, text, sizeof(text));
+    return std::string(text) + ":" + std::to_string(ntohs(in->sin_port));
+}
+
+void Resolver::Prefetch(const std::string& host, uint16_t port, int cacheTtlSec) {
+    std::lock_guard<std::mutex> lock(resolveMutex);
+    StartLookup(host, port, cacheTtlSec, &Resolver::Resolve);
+}
+
+std::vector<resolved_address> Resolver::Lookup(const std::string& host, uint16_t port,
+    const connect_options& options) {
+    std::shared_future<std::vector<resolved_address>> result;
+    {
+        std::lock_guard<std::mutex> lock(resolveMutex);
+        result = StartLookup(host, port, options.cacheTtlSec, &Resolver::Resolve).result;
+    }
+    if (result.wait_for(std::chrono::milliseconds(options.resolveTimeoutMs)) != std::future_status::ready) {
+        MINSFTP_ERROR("resolving %s timed out", host.c_str());
+        return {};
+    }
+    std::vector<resolved_address> resolved = result.get();
+    if (resolved.empty()) {
+        // don't keep the failure for a whole ttl
+        std::lock_guard<std::mutex> lock(resolveMutex);
+        auto it = resolveCache.find({ host, port });
+        if (it != resolveCache.end() && it->second.result.valid() &&
+            it->second.result.wait_for(std::chrono::seconds(0)) == std::future_status::ready &&
+            it->second.result.get().empty()) {
+            resolveCache.erase(it);
+        }
+        return {};
+    }
+
+    // interleave the families (rfc 8305 section 4), preferred family first
+    int first = options.preferIPv6 ? AF_INET6 : AF_INET;
+    std::vector<resolved_address> primary, secondary, ordered;
+    for (const resolved_address& address : resolved) {
+        (address.addr.ss_family == first ? primary : secondary).push_back(address);
+    }
+    if (primary.empty()) {
+        primary.swap(secondary);
+    }
+    for (size_t i = 0; i < std::max(primary.size(), secondary.size()); i++) {
+        if (i < primary.size()) {
+            ordered.push_back(primary[i]);
+        }
+        if (i < secondary.size()) {
+            ordered.push_back(secondary[i]);
+        }
+    }
+
+    // the last winner goes first, it is most likely to work again
+    std::string preferred;
+    {
+        std::lock_guard<std::mutex> lock(resolveMutex);
+        auto it = resolveCache.find({ host, port });
+        if (it != resolveCache.end()) {
+            preferred = it->second.preferred;
+        }
+    }
+    auto winner = std::find_if(ordered.begin(), ordered.end(),
+        [&preferred](const resolved_address& address) { return address.ToString() == preferred; });
+    if (winner != ordered.end()) {
+        std::rotate(ordered.begin(), winner, winner + 1);
+    }
+    return ordered;
+}
+
+void Resolver::Remember(const std::string& host, uint16_t port, const resolved_address& address) {
+    std::lock_guard<std::mutex> lock(resolveMutex);
+    auto it = resolveCache.find({ host, port });
+    if (it != resolveCache.end()) {
+        it->second.preferred = address.ToString();
+    }
+}
+
+void Resolver::Forget(const std::string& host) {
+    std::lock_guard<std::mutex> lock(resolveMutex);
+    for (auto it = resolveCache.begin(); it != resolveCache.end();) {
+        if (host.empty() || it->second.host == host) {
+            it = resolveCache.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+std::vector<resolved_address> Resolver::Resolve(const std::string& host, uint16_t port) {
+#ifdef WIN32
+    // the lookup can run before minsftp::Init started winsock
+    WSADATA wsadata;
+    if (WSAStartup(MAKEWORD(2, 0), &wsadata)) {
+        return {};
+    }
+#endif
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = AI_ADDRCONFIG;
+    addrinfo* list = nullptr;
+    std::string service = std::to_string(port);
+    int rc = getaddrinfo(host.c_str(), service.c_str(), &hints, &list);
+    // AI_ADDRCONFIG hides loopback-only families (e.g. ::1 without a global ipv6 address)
+    bool retry = rc == EAI_NONAME;
+#ifdef EAI_ADDRFAMILY
+    retry = retry || rc == EAI_ADDRFAMILY;
+#endif
+    if (retry) {
+        hints.ai_flags = 0;
+        rc = getaddrinfo(host.c_str(), service.c_str(), &hints, &list);
+    }
+
+    std::vector<resolved_address> addresses;
+    if (rc != 0) {
+        MINSFTP_ERROR("unable to resolve %s: %s", host.c_str(), gai_strerror(rc));
+    }
+    else {
+        for (addrinfo* ai = list; ai; ai = ai->ai_next) {
+            if ((ai->ai_family != AF_INET && ai->ai_family != AF_INET6) || ai->ai_addrlen > sizeof(sockaddr_storage)) {
+                continue;
+            }
+            resolved_address address{};
+            memcpy(&address.addr, ai->ai_addr, ai->ai_addrlen);
+            address.len = (socklen_t)ai->ai_addrlen;
+            addresses.push_back(address);
+        }
+        freeaddrinfo(list);
+        MINSFTP_DEBUG("%s resolved to %zu addresses", host.c_str(), addresses.size());
+    }
+
+#ifdef WIN32
+    WSACleanup();
+#endif
+    return addresses;
+}
+
+static void CloseSocket(libssh2_socket_t sock) {
+#ifdef WIN32
+    closesocket(sock);
+#else
+    close(sock);
+#endif
+}
+
+static void SetBlocking(libssh2_socket_t sock, bool blocking) {
+#ifdef WIN32
+    u_long nonBlocking = blocking ? 0 : 1;
+    ioctlsocket(sock, FIONBIO, &nonBlocking);
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK));
+#endif
+}
+
+// non-blocking connect, true while it is in progress or done
+static bool StartConnect(const resolved_address& address, libssh2_socket_t* sock,
+    const std::function<void(libssh2_socket_t)>& prepare) {
+    *sock = socket(address.addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+    if (*sock == LIBSSH2_INVALID_SOCKET) {
+        return false;
+    }
+    if (prepare) {
+        prepare(*sock);
+    }
+    SetBlocking(*sock, false);
+    if (connect(*sock, (const sockaddr*)&address.addr, address.len) == 0) {
+        return true;
+    }
+#ifdef WIN32
+    bool pending = WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    bool pending = errno == EINPROGRESS;
+#endif
+    if (!pending) {
+        CloseSocket(*sock);
+        *sock = LIBSSH2_INVALID_SOCKET;
+    }
+    return pending;
+}
+
+libssh2_socket_t ConnectFastest(const std::vector<resolved_address>& addresses,
+    const connect_options& options, size_t* winner, const std::function<void(libssh2_socket_t)>& prepare) {
+    using clock = std::chrono::steady_clock;
+    std::vector<std::pair<libssh2_socket_t, size_t>> attempts; // socket, address index
+    libssh2_socket_t connected = LIBSSH2_INVALID_SOCKET;
+    size_t connectedIndex = 0;
+    size_t next = 0;
+    clock::time_point start = clock::now();
+    clock::time_point nextAttempt = start;
+
+    while (connected == LIBSSH2_INVALID_SOCKET) {
+        clock::time_point now = clock::now();
+        if (next < addresses.size() && (now >= nextAttempt || attempts.empty())) {
+            libssh2_socket_t sock;
+            if (StartConnect(addresses[next], &sock, prepare)) {
+                attempts.push_back({ sock, next });
+                nextAttempt = now + std::chrono::milliseconds(options.attemptDelayMs);
+            }
+            else {
+                MINSFTP_DEBUG("connect to %s failed right away", addresses[next].ToString().c_str());
+            }
+            next++;
+            continue;
+        }
+        if (attempts.empty()) {
+            break; // every address failed
+        }
+        if (options.connectTimeoutMs > 0 && now - start >= std::chrono::milliseconds(options.connectTimeoutMs)) {
+            MINSFTP_ERROR("connect timed out after %d ms", options.connectTimeoutMs);
+            break;
+        }
+
+        // wait for an attempt to finish, the next one to be due or the timeout
+        clock::duration wait = std::chrono::seconds(1);
+        if (next < addresses.size()) {
+            wait = std::min(wait, nextAttempt - now);
+        }
+        if (options.connectTimeoutMs > 0) {
+            wait = std::min(wait, start + std::chrono::milliseconds(options.connectTimeoutMs) - now);
+        }
+        int waitMs = (int)std::max<long long>(0, std::chrono::ceil<std::chrono::milliseconds>(wait).count());
+
+        // poll rather than select, sockets of a busy process easily pass FD_SETSIZE
+#ifdef WIN32
+        std::vector<WSAPOLLFD> fds;
+#else
+        std::vector<pollfd> fds;
+#endif
+        for (auto& attempt : attempts) {
+            fds.push_back({ attempt.first, POLLOUT, 0 });
+        }
+#ifdef WIN32
+        int ready = WSAPoll(fds.data(), (ULONG)fds.size(), waitMs);
+#else
+        int ready = poll(fds.data(), (nfds_t)fds.size(), waitMs);
+#endif
+        if (ready <= 0) {
+            continue;
+        }
+
+        // a failed connect shows up as POLLERR/POLLHUP, SO_ERROR tells which
+        size_t i = 0;
+        for (auto it = attempts.begin(); it != attempts.end(); i++) {
+            if (!fds[i].revents) {
+                ++it;
+                continue;
+            }
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(it->first, SOL_SOCKET, SO_ERROR, (char*)&err, &len);
+            if (err == 0 && connected == LIBSSH2_INVALID_SOCKET) {
+                connected = it->first;
+                connectedIndex = it->second;
+                it = attempts.erase(it);
+                continue;
+            }
+            MINSFTP_DEBUG("connect to %s failed: %d", addresses[it->second].ToString().c_str(), err);
+            CloseSocket(it->first);
+            it = attempts.erase(it);
+            nextAttempt = clock::now(); // don't wait out the delay after a failure
+        }
+    }
+
+    for (auto& attempt : attempts) {
+        CloseSocket(attempt.first);
+    }
+    if (connected == LIBSSH2_INVALID_SOCKET) {
+        return connected;
+    }
+
+    SetBlocking(connected, true);
+    if (winner) {
+        *winner = connectedIndex;
+    }
+    MINSFTP_DEBUG("connected to %s in %.1f ms", addresses[connectedIndex].ToString().c_str(),
+        std::chrono::duration<double, std::milli>(clock::now() - start).count());
+    return connected;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include "libssh2_setup.h"
+#include <libssh2.h>
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#endif
+
+struct connect_options {
+	int resolveTimeoutMs{ 5000 }; // waiting for dns, a late answer still fills the cache
+	int cacheTtlSec{ 60 }; // resolved addresses are reused this long
+	int attemptDelayMs{ 250 }; // head start of each address before the next one is tried as well
+	int connectTimeoutMs{ 10000 }; // whole race, 0 waits as long as the os does
+	bool preferIPv6{ true }; // which family goes first when both resolved
+};
+
+struct resolved_address {
+	sockaddr_storage addr{};
+	socklen_t len{};
+
+	std::string ToString() const; // "a.b.c.d:port" or "[v6]:port"
+};
+
+// getaddrinfo off the calling thread with a per host:port cache shared by the process
+// a lookup in flight is shared too, so a Client created early resolves while other setup runs
+// the address that connected last time is tried first on the next connect (ConnectFastest)
+// thread safe
+class Resolver {
+public:
+	// start resolving if there is no fresh cache entry, doesn't wait
+	static void Prefetch(const std::string& host, uint16_t port, int cacheTtlSec = connect_options{}.cacheTtlSec);
+	// addresses in connection order (families interleaved, preferred family and the last
+	// winner first), empty if resolution failed or took longer than resolveTimeoutMs
+	static std::vector<resolved_address> Lookup(const std::string& host, uint16_t port,
+		const connect_options& options = connect_options{});
+	// the address that connected, goes first next time
+	static void Remember(const std::string& host, uint16_t port, const resolved_address& address);
+	// drop cached results (e.g. after a dns change), all hosts if host is empty
+	static void Forget(const std::string& host = "");
+
+private:
+	static std::vector<resolved_address> Resolve(const std::string& host, uint16_t port);
+};
+
+// happy eyeballs (rfc 8305): connect to addresses in order, starting the next attempt after
+// attemptDelayMs or as soon as the previous one fails, and keep the first that succeeds
+// returns a connected blocking socket or LIBSSH2_INVALID_SOCKET, winner is its index
+// prepare runs on every socket before its connect (socket options)
+libssh2_socket_t ConnectFastest(const std::vector<resolved_address>& addresses,
+	const connect_options& options, size_t* winner = nullptr,
+	const std::function<void(libssh2_socket_t)>& prepare = nullptr);
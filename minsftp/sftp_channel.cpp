@@ -0,0 +1,583 @@
+#include "sftp_channel.h"
+
+#include <algorithm>
+#include <cstring>
+
+SftpChannel::SftpChannel(LIBSSH2_SESSION* _session, libssh2_socket_t _sock, uint32_t _window) {
+    session = _session;
+    sock = _sock;
+    channelWindow = _window;
+}
+SftpChannel::~SftpChannel() {
+    Close();
+}
+
+MINSFTP_RES SftpChannel::Open() {
+    if (channel) {
+        return RES_OK;
+    }
+
+    broken = false;
+    versionReceived = false;
+    tx.clear();
+    txPos = txCommitted = txHead = urgentEnd = 0;
+    interactivePending = 0;
+    rxStart = rxEnd = 0;
+    // room for a full read reply up front, Receive() only grows it for larger packets
+    if (rx.size() < 256 * 1024) {
+        rx.resize(256 * 1024);
+    }
+
+    while (!(channel = libssh2_channel_open_ex(session, "session", sizeof("session") - 1,
+        channelWindow, LIBSSH2_CHANNEL_PACKET_DEFAULT, NULL, 0))) {
+        if (libssh2_session_last_errno(session) != LIBSSH2_ERROR_EAGAIN) {
+            MINSFTP_ERROR("unable to open channel for sftp subsystem");
+            return RES_CHANNEL_FAILED;
+        }
+        WaitSocket();
+    }
+
+    int rc;
+    while ((rc = libssh2_channel_subsystem(channel, "sftp")) == LIBSSH2_ERROR_EAGAIN) {
+        WaitSocket();
+    }
+    if (rc) {
+        MINSFTP_ERROR("unable to start sftp subsystem: %d", rc);
+        Close();
+        return RES_CHANNEL_FAILED;
+    }
+
+    // INIT carries no request id
+    packetStart = tx.size();
+    PutU32(0);
+    PutU8(FXP_INIT);
+    PutU32(3);
+    uint32_t len = (uint32_t)(tx.size() - packetStart - 4);
+    for (int i = 0; i < 4; i++) {
+        tx[packetStart + i] = (uint8_t)(len >> (24 - 8 * i));
+    }
+
+    while (!versionReceived) {
+        if (Pump() != RES_OK) {
+            MINSFTP_ERROR("sftp version exchange failed");
+            Close();
+            return RES_CHANNEL_FAILED;
+        }
+        if (wouldBlock) {
+            WaitSocket();
+        }
+    }
+
+    MINSFTP_DEBUG("sftp channel open, server version %u, %zu extensions", version, extensions.size());
+    return RES_OK;
+}
+
+void SftpChannel::Close() {
+    Fail();
+    if (channel) {
+        while (libssh2_channel_close(channel) == LIBSSH2_ERROR_EAGAIN) {
+            WaitSocket();
+        }
+        libssh2_channel_free(channel);
+        channel = nullptr;
+    }
+}
+bool SftpChannel::IsOpen() const {
+    return channel != nullptr && !broken;
+}
+bool SftpChannel::Broken() const {
+    return broken;
+}
+uint32_t SftpChannel::Version() const {
+    return version;
+}
+const std::map<std::string, std::string>& SftpChannel::Extensions() const {
+    return extensions;
+}
+bool SftpChannel::HasExtension(const std::string& name) const {
+    return extensions.count(name) != 0;
+}
+
+void SftpChannel::SetMaxInFlight(size_t _maxInFlight) {
+    maxInFlight = _maxInFlight ? _maxInFlight : 1;
+}
+void SftpChannel::SetController(std::shared_ptr<ConcurrencyController> _controller) {
+    controller = _controller;
+}
+size_t SftpChannel::Window() const {
+    return controller ? std::min(maxInFlight, controller->InFlightLimit()) : maxInFlight;
+}
+void SftpChannel::SetPriority(PRIORITY_CLASS _priority) {
+    priority = _priority;
+}
+PRIORITY_CLASS SftpChannel::Priority() const {
+    return priority;
+}
+size_t SftpChannel::InFlight() const {
+    return pending.size();
+}
+bool SftpChannel::WouldBlock() const {
+    return wouldBlock;
+}
+
+void SftpChannel::WaitSocket(int timeoutMs) {
+    WaitSessionSocket(session, sock, timeoutMs);
+}
+
+uint32_t SftpChannel::Begin(SFTP_PACKET type) {
+    uint32_t id = nextId++;
+    if (!nextId) {
+        nextId = 1; // 0 means "not queued"
+    }
+    packetStart = tx.size();
+    PutU32(0); // length, patched by Submit
+    PutU8(type);
+    PutU32(id);
+    return id;
+}
+void SftpChannel::PutU8(uint8_t v) {
+    tx.push_back(v);
+}
+void SftpChannel::PutU32(uint32_t v) {
+    uint8_t b[4] = { (uint8_t)(v >> 24), (uint8_t)(v >> 16), (uint8_t)(v >> 8), (uint8_t)v };
+    tx.insert(tx.end(), b, b + 4);
+}
+void SftpChannel::PutU64(uint64_t v) {
+    PutU32((uint32_t)(v >> 32));
+    PutU32((uint32_t)v);
+}
+void SftpChannel::PutString(const void* data, size_t len) {
+    PutU32((uint32_t)len);
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    tx.insert(tx.end(), p, p + len);
+}
+void SftpChannel::PutString(const std::string& s) {
+    PutString(s.data(), s.size());
+}
+void SftpChannel::PutAttrs(const LIBSSH2_SFTP_ATTRIBUTES& attrs) {
+    uint32_t flags = (uint32_t)attrs.flags & ~LIBSSH2_SFTP_ATTR_EXTENDED;
+    PutU32(flags);
+    if (flags & LIBSSH2_SFTP_ATTR_SIZE) {
+        PutU64(attrs.filesize);
+    }
+    if (flags & LIBSSH2_SFTP_ATTR_UIDGID) {
+        PutU32((uint32_t)attrs.uid);
+        PutU32((uint32_t)attrs.gid);
+    }
+    if (flags & LIBSSH2_SFTP_ATTR_PERMISSIONS) {
+        PutU32((uint32_t)attrs.permissions);
+    }
+    if (flags & LIBSSH2_SFTP_ATTR_ACMODTIME) {
+        PutU32((uint32_t)attrs.atime);
+        PutU32((uint32_t)attrs.mtime);
+    }
+}
+
+uint32_t SftpChannel::Submit(uint32_t id, reply_fn fn, size_t bytes) {
+    if (!IsOpen()) {
+        tx.resize(packetStart);
+        if (fn) {
+            fn(sftp_reply{});
+        }
+        return 0;
+    }
+
+    uint32_t len = (uint32_t)(tx.size() - packetStart - 4);
+    for (int i = 0; i < 4; i++) {
+        tx[packetStart + i] = (uint8_t)(len >> (24 - 8 * i));
+    }
+    pending_request& request = pending[id];
+    request.fn = std::move(fn);
+    request.bytes = bytes;
+    request.priority = priority;
+    if (controller) {
+        request.sent = std::chrono::steady_clock::now();
+    }
+    if (priority == PRIORITY_INTERACTIVE) {
+        interactivePending++;
+        Expedite();
+    }
+
+    // callbacks may queue follow-up requests, those go out with the next Pump()
+    // interactive requests don't wait at all, the window is for bulk traffic
+    if (dispatching || priority == PRIORITY_INTERACTIVE) {
+        return id;
+    }
+    size_t window = Window();
+    while (pending.size() > window && IsOpen()) {
+        if (Pump() != RES_OK) {
+            break;
+        }
+        if (wouldBlock) {
+            WaitSocket();
+        }
+    }
+    return id;
+}
+
+void SftpChannel::Expedite() {
+    // libssh2 may hold everything up to txCommitted already, splice at the boundary after it
+    while (txHead < std::max(txPos, txCommitted)) {
+        const uint8_t* p = tx.data() + txHead;
+        txHead += 4 + ((size_t)p[0] << 24 | (size_t)p[1] << 16 | (size_t)p[2] << 8 | p[3]);
+    }
+    // behind earlier interactive packets, in front of the bulk ones
+    size_t at = std::max(txHead, urgentEnd);
+    if (at < packetStart) {
+        std::rotate(tx.begin() + at, tx.begin() + packetStart, tx.end());
+    }
+    urgentEnd = at + (tx.size() - packetStart);
+}
+
+uint32_t SftpChannel::PathRequest(SFTP_PACKET type, const std::string& path, reply_fn fn) {
+    uint32_t id = Begin(type);
+    PutString(path);
+    return Submit(id, std::move(fn));
+}
+uint32_t SftpChannel::Stat(const std::string& path, reply_fn fn) {
+    return PathRequest(FXP_STAT, path, std::move(fn));
+}
+uint32_t SftpChannel::LStat(const std::string& path, reply_fn fn) {
+    return PathRequest(FXP_LSTAT, path, std::move(fn));
+}
+uint32_t SftpChannel::RmDir(const std::string& path, reply_fn fn) {
+    return PathRequest(FXP_RMDIR, path, std::move(fn));
+}
+uint32_t SftpChannel::Remove(const std::string& path, reply_fn fn) {
+    return PathRequest(FXP_REMOVE, path, std::move(fn));
+}
+uint32_t SftpChannel::RealPath(const std::string& path, reply_fn fn) {
+    return PathRequest(FXP_REALPATH, path, std::move(fn));
+}
+uint32_t SftpChannel::OpenDir(const std::string& path, reply_fn fn) {
+    return PathRequest(FXP_OPENDIR, path, std::move(fn));
+}
+uint32_t SftpChannel::ReadDir(const std::string& handle, reply_fn fn) {
+    return PathRequest(FXP_READDIR, handle, std::move(fn));
+}
+uint32_t SftpChannel::CloseHandle(const std::string& handle, reply_fn fn) {
+    return PathRequest(FXP_CLOSE, handle, std::move(fn));
+}
+uint32_t SftpChannel::OpenFile(const std::string& path, unsigned long flags, long mode, reply_fn fn) {
+    LIBSSH2_SFTP_ATTRIBUTES attrs{};
+    if (flags & LIBSSH2_FXF_CREAT) {
+        attrs.flags = LIBSSH2_SFTP_ATTR_PERMISSIONS;
+        attrs.permissions = (unsigned long)mode;
+    }
+    uint32_t id = Begin(FXP_OPEN);
+    PutString(path);
+    PutU32((uint32_t)flags);
+    PutAttrs(attrs);
+    return Submit(id, std::move(fn));
+}
+uint32_t SftpChannel::FStat(const std::string& handle, reply_fn fn) {
+    return PathRequest(FXP_FSTAT, handle, std::move(fn));
+}
+uint32_t SftpChannel::Read(const std::string& handle, uint64_t offset, uint32_t len, reply_fn fn) {
+    uint32_t id = Begin(FXP_READ);
+    PutString(handle);
+    PutU64(offset);
+    PutU32(len);
+    return Submit(id, std::move(fn));
+}
+uint32_t SftpChannel::Write(const std::string& handle, uint64_t offset, const void* data, size_t len, reply_fn fn) {
+    uint32_t id = Begin(FXP_WRITE);
+    PutString(handle);
+    PutU64(offset);
+    PutString(data, len);
+    return Submit(id, std::move(fn), len);
+}
+uint32_t SftpChannel::Extended(const std::string& name, const void* payload, size_t len, reply_fn fn) {
+    uint32_t id = Begin(FXP_EXTENDED);
+    PutString(name);
+    const uint8_t* p = static_cast<const uint8_t*>(payload);
+    tx.insert(tx.end(), p, p + len);
+    return Submit(id, std::move(fn));
+}
+uint32_t SftpChannel::CopyData(const std::string& readHandle, uint64_t readOffset, uint64_t length,
+    const std::string& writeHandle, uint64_t writeOffset, reply_fn fn) {
+    uint32_t id = Begin(FXP_EXTENDED);
+    PutString("copy-data");
+    PutString(readHandle);
+    PutU64(readOffset);
+    PutU64(length);
+    PutString(writeHandle);
+    PutU64(writeOffset);
+    return Submit(id, std::move(fn));
+}
+uint32_t SftpChannel::MkDir(const std::string& path, long mode, reply_fn fn) {
+    LIBSSH2_SFTP_ATTRIBUTES attrs{};
+    attrs.flags = LIBSSH2_SFTP_ATTR_PERMISSIONS;
+    attrs.permissions = (unsigned long)mode;
+    uint32_t id = Begin(FXP_MKDIR);
+    PutString(path);
+    PutAttrs(attrs);
+    return Submit(id, std::move(fn));
+}
+uint32_t SftpChannel::Rename(const std::string& oldPath, const std::string& newPath, reply_fn fn) {
+    uint32_t id = Begin(FXP_RENAME);
+    PutString(oldPath);
+    PutString(newPath);
+    return Submit(id, std::move(fn));
+}
+uint32_t SftpChannel::SetStat(const std::string& path, const LIBSSH2_SFTP_ATTRIBUTES& attrs, reply_fn fn) {
+    uint32_t id = Begin(FXP_SETSTAT);
+    PutString(path);
+    PutAttrs(attrs);
+    return Submit(id, std::move(fn));
+}
+
+MINSFTP_RES SftpChannel::Pump() {
+    if (!channel || broken) {
+        return RES_CHANNEL_FAILED;
+    }
+
+    wouldBlock = false;
+    MINSFTP_RES res = Flush();
+    if (res != RES_OK) {
+        return res;
+    }
+
+    // only read when a reply is owed, a blocking read would otherwise never return
+    if (pending.empty() && versionReceived) {
+        return RES_OK;
+    }
+    return Receive();
+}
+
+MINSFTP_RES SftpChannel::Drain() {
+    while (!pending.empty() || txPos < tx.size()) {
+        MINSFTP_RES res = Pump();
+        if (res != RES_OK) {
+            return res;
+        }
+        if (wouldBlock) {
+            WaitSocket();
+        }
+    }
+    return RES_OK;
+}
+
+MINSFTP_RES SftpChannel::Flush() {
+    // the server answers in order: bulk packets wait while interactive replies are owed, so
+    // the next round trip of an interactive operation doesn't queue behind them
+    // a write that returned EAGAIN is finished with what libssh2 committed, whatever the class
+    size_t end = interactivePending ? std::min(urgentEnd, tx.size()) : tx.size();
+    end = std::max(end, txCommitted);
+    while (txPos < end) {
+        ssize_t n = libssh2_channel_write(channel, reinterpret_cast<const char*>(tx.data() + txPos), end - txPos);
+        if (n == LIBSSH2_ERROR_EAGAIN) {
+            // libssh2 packs at most one channel packet per write
+            txCommitted = std::max(txCommitted, txPos + std::min<size_t>(end - txPos, LIBSSH2_CHANNEL_PACKET_DEFAULT));
+            wouldBlock = true;
+            break;
+        }
+        if (n < 0) {
+            MINSFTP_ERROR("sftp channel write failed: %zd", n);
+            Fail();
+            return RES_CHANNEL_FAILED;
+        }
+        txPos += (size_t)n;
+        txCommitted = 0; // a completed write leaves nothing behind in libssh2
+    }
+
+    if (txPos == tx.size()) {
+        tx.clear();
+        txPos = txCommitted = txHead = urgentEnd = 0;
+    }
+    return RES_OK;
+}
+
+MINSFTP_RES SftpChannel::Receive() {
+    if (rx.size() - rxEnd < 32 * 1024) {
+        // compact, then grow if a large packet doesn't fit
+        if (rxStart) {
+            memmove(rx.data(), rx.data() + rxStart, rxEnd - rxStart);
+            rxEnd -= rxStart;
+            rxStart = 0;
+        }
+        if (rx.size() - rxEnd < 32 * 1024) {
+            rx.resize(rxEnd + 64 * 1024);
+        }
+    }
+
+    ssize_t n = libssh2_channel_read(channel, reinterpret_cast<char*>(rx.data() + rxEnd), rx.size() - rxEnd);
+    if (n == LIBSSH2_ERROR_EAGAIN) {
+        wouldBlock = true;
+        return RES_OK;
+    }
+    if (n < 0 || (n == 0 && libssh2_channel_eof(channel))) {
+        MINSFTP_ERROR("sftp channel read failed: %zd", n);
+        Fail();
+        return RES_CHANNEL_FAILED;
+    }
+    rxEnd += (size_t)n;
+
+    // callbacks of the previous batch are done with their names
+    arena.Reset();
+    dispatching = true;
+    while (rxEnd - rxStart >= 4) {
+        const uint8_t* p = rx.data() + rxStart;
+        size_t len = (size_t)p[0] << 24 | (size_t)p[1] << 16 | (size_t)p[2] << 8 | p[3];
+        if (len == 0 || len > SFTP_MAX_PACKET) {
+            MINSFTP_ERROR("bad sftp packet length %zu", len);
+            dispatching = false;
+            Fail();
+            return RES_CHANNEL_FAILED;
+        }
+        if (rxEnd - rxStart < 4 + len) {
+            if (rx.size() - rxStart < 4 + len) {
+                memmove(rx.data(), p, rxEnd - rxStart);
+                rxEnd -= rxStart;
+                rxStart = 0;
+                rx.resize(4 + len + 32 * 1024);
+            }
+            break;
+        }
+        rxStart += 4 + len;
+        if (!Dispatch(p + 4, len)) {
+            dispatching = false;
+            Fail();
+            return RES_CHANNEL_FAILED;
+        }
+    }
+    dispatching = false;
+
+    if (rxStart == rxEnd) {
+        rxStart = rxEnd = 0;
+    }
+    return RES_OK;
+}
+
+bool SftpChannel::Dispatch(const uint8_t* packet, size_t len) {
+    if (!versionReceived) {
+        if (!ParseVersion(packet, len, version, extensions)) {
+            return false;
+        }
+        versionReceived = true;
+        return true;
+    }
+
+    uint32_t id = 0;
+    sftp_reply reply{};
+    if (!ParseReply(packet, len, arena, id, reply)) {
+        MINSFTP_ERROR("malformed sftp reply type %u for request %u", len ? packet[0] : 0, id);
+        return false; // Fail() answers everything pending
+    }
+
+    auto it = pending.find(id);
+    if (it == pending.end()) {
+        MINSFTP_WARN("sftp reply for unknown request %u", id);
+        return true;
+    }
+    pending_request request = std::move(it->second);
+    pending.erase(it);
+    if (request.priority == PRIORITY_INTERACTIVE) {
+        interactivePending--;
+    }
+    if (controller) {
+        // FX_FAILURE is what an overloaded server answers (out of handles, i/o errors)
+        bool error = reply.type == FXP_STATUS && reply.status == LIBSSH2_FX_FAILURE;
+        controller->OnSample(std::chrono::steady_clock::now() - request.sent, request.bytes + reply.dataLen, error);
+    }
+    if (request.fn) {
+        // follow-up requests keep the class of the operation
+        PRIORITY_CLASS outer = priority;
+        priority = request.priority;
+        request.fn(reply);
+        priority = outer;
+    }
+    return true;
+}
+
+void SftpChannel::Fail() {
+    if (controller && !broken) {
+        controller->OnError();
+    }
+    broken = true;
+    tx.clear();
+    txPos = txCommitted = txHead = urgentEnd = 0;
+    interactivePending = 0;
+
+    // callbacks may queue more requests, Submit answers those right away
+    while (!pending.empty()) {
+        auto it = pending.begin();
+        reply_fn fn = std::move(it->second.fn);
+        pending.erase(it);
+        if (fn) {
+            fn(sftp_reply{});
+        }
+    }
+}
+
+void SubmitBatchOp(SftpChannel* ch, Metrics* metrics, const batch_op& op, std::function<void(batch_result&)> done) {
+    METRIC_OP metricOp = OP_STAT;
+    MINSFTP_RES failRes = RES_FAILED;
+    switch (op.type) {
+    case BATCH_MKDIR:
+        metricOp = OP_MKDIR;
+        break;
+    case BATCH_RMDIR:
+    case BATCH_REMOVE:
+        metricOp = OP_REMOVE;
+        failRes = RES_DELETE_FAILED;
+        break;
+    case BATCH_RENAME:
+        metricOp = OP_RENAME;
+        failRes = RES_MOVE_FAILED;
+        break;
+    default:
+        break;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto onReply = [metrics, metricOp, failRes, start, done](const sftp_reply& reply) {
+        batch_result result{};
+        result.status = reply.type ? reply.status : LIBSSH2_FX_CONNECTION_LOST;
+        bool ok = reply.Ok();
+        if (ok && reply.type == FXP_ATTRS) {
+            result.attrs = reply.attrs;
+        }
+        else if (ok && reply.type == FXP_NAME && !reply.names.empty()) {
+            result.path = reply.names[0].name;
+        }
+        result.res = ok ? RES_OK : (reply.type ? failRes : RES_CHANNEL_FAILED);
+        if (metrics) {
+            metrics->Record(metricOp, std::chrono::steady_clock::now() - start, 0, ok);
+        }
+        done(result);
+    };
+
+    switch (op.type) {
+    case BATCH_STAT:
+        ch->Stat(op.path, onReply);
+        break;
+    case BATCH_LSTAT:
+        ch->LStat(op.path, onReply);
+        break;
+    case BATCH_MKDIR:
+        ch->MkDir(op.path, op.mode, onReply);
+        break;
+    case BATCH_RMDIR:
+        ch->RmDir(op.path, onReply);
+        break;
+    case BATCH_REMOVE:
+        ch->Remove(op.path, onReply);
+        break;
+    case BATCH_RENAME:
+        ch->Rename(op.path, op.newPath, onReply);
+        break;
+    case BATCH_SETSTAT:
+        ch->SetStat(op.path, op.attrs, onReply);
+        break;
+    case BATCH_REALPATH:
+        ch->RealPath(op.path, onReply);
+        break;
+    default: {
+        batch_result result{};
+        result.res = RES_FAILED;
+        done(result);
+        break;
+    }
+    }
+}
@@ -0,0 +1,147 @@
+#pragma once
+#include "minsftp.h"
+#include "sftp_codec.h"
+
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+constexpr uint32_t SFTP_CHANNEL_WINDOW = 2 * 1024 * 1024;
+
+// sftp subsystem on its own channel of an authenticated session, speaking the wire protocol
+// directly so any mix of requests can be in flight at once (libssh2's sftp api allows one
+// outstanding request per operation type). requests are queued with a callback and sent back to
+// back; Pump() flushes the queue, reads replies and runs callbacks matched by request id.
+// works on blocking and non-blocking sessions: in non-blocking mode Pump() returns when the
+// socket would block (WouldBlock()) and WaitSocket() sleeps until libssh2 can make progress
+class SftpChannel {
+public:
+	using reply_fn = std::function<void(const sftp_reply&)>;
+
+	// window: ssh receive window of the channel, see socket_options::channelWindow
+	SftpChannel(LIBSSH2_SESSION* _session, libssh2_socket_t _sock, uint32_t _window = SFTP_CHANNEL_WINDOW);
+	~SftpChannel();
+	SftpChannel(const SftpChannel&) = delete;
+	SftpChannel& operator=(const SftpChannel&) = delete;
+
+	// open the channel, start the subsystem and exchange INIT/VERSION
+	MINSFTP_RES Open();
+	void Close();
+	bool IsOpen() const;
+	// the channel died (eof, protocol error), every pending callback got a type 0 reply
+	bool Broken() const;
+	uint32_t Version() const;
+	// extensions announced in VERSION, name -> data (e.g. "copy-data" -> "1")
+	const std::map<std::string, std::string>& Extensions() const;
+	bool HasExtension(const std::string& name) const;
+
+	// requests allowed in flight before queueing another one pumps replies first (default 64)
+	void SetMaxInFlight(size_t _maxInFlight);
+	// feed reply latencies to controller and keep the window within its InFlightLimit()
+	void SetController(std::shared_ptr<ConcurrencyController> _controller);
+	size_t InFlight() const;
+	// class of the requests queued from now on (PRIORITY_BULK by default), requests queued
+	// from a reply callback get the class of the request being answered. interactive requests
+	// are moved ahead of unsent bulk ones and never wait for the window, bulk ones stay
+	// unsent while any interactive reply is owed
+	void SetPriority(PRIORITY_CLASS _priority);
+	PRIORITY_CLASS Priority() const;
+
+	// queue a request, returns its id (0 if the channel is broken, fn already ran)
+	uint32_t Stat(const std::string& path, reply_fn fn);
+	uint32_t LStat(const std::string& path, reply_fn fn);
+	uint32_t MkDir(const std::string& path, long mode, reply_fn fn);
+	uint32_t RmDir(const std::string& path, reply_fn fn);
+	uint32_t Remove(const std::string& path, reply_fn fn);
+	uint32_t Rename(const std::string& oldPath, const std::string& newPath, reply_fn fn);
+	uint32_t SetStat(const std::string& path, const LIBSSH2_SFTP_ATTRIBUTES& attrs, reply_fn fn);
+	uint32_t RealPath(const std::string& path, reply_fn fn);
+	// directory listing: OPENDIR gives a handle, READDIR returns batches of names until an EOF status
+	uint32_t OpenDir(const std::string& path, reply_fn fn);
+	uint32_t ReadDir(const std::string& handle, reply_fn fn);
+	uint32_t CloseHandle(const std::string& handle, reply_fn fn);
+	// files: flags are LIBSSH2_FXF_* (the wire values), mode is used on create
+	uint32_t OpenFile(const std::string& path, unsigned long flags, long mode, reply_fn fn);
+	uint32_t FStat(const std::string& handle, reply_fn fn);
+	// DATA with up to len bytes, or an EOF status at/after the end of the file
+	uint32_t Read(const std::string& handle, uint64_t offset, uint32_t len, reply_fn fn);
+	uint32_t Write(const std::string& handle, uint64_t offset, const void* data, size_t len, reply_fn fn);
+	// extended request, payload goes after the name as is (already encoded)
+	uint32_t Extended(const std::string& name, const void* payload, size_t len, reply_fn fn);
+	// "copy-data" extension: the server copies length bytes (0 = up to eof) between two open
+	// handles without the data crossing the network, check HasExtension("copy-data") first
+	uint32_t CopyData(const std::string& readHandle, uint64_t readOffset, uint64_t length,
+		const std::string& writeHandle, uint64_t writeOffset, reply_fn fn);
+
+	// one round of i/o: send queued requests, read whatever arrived and run callbacks
+	MINSFTP_RES Pump();
+	// pump until every request was answered
+	MINSFTP_RES Drain();
+	bool WouldBlock() const;
+	// wait (up to timeoutMs) for the socket in the direction libssh2 is blocked on
+	void WaitSocket(int timeoutMs = 1000);
+
+private:
+	LIBSSH2_SESSION* session{};
+	libssh2_socket_t sock{ LIBSSH2_INVALID_SOCKET };
+	uint32_t channelWindow{ SFTP_CHANNEL_WINDOW }; // ssh receive window, not the in-flight Window()
+	LIBSSH2_CHANNEL* channel{};
+	uint32_t version{};
+	bool versionReceived{ false };
+	bool broken{ false };
+	bool wouldBlock{ false };
+	bool dispatching{ false };
+	std::map<std::string, std::string> extensions{}; // from VERSION
+	SftpArena arena{}; // names of the replies being dispatched, reset per receive
+
+	struct pending_request {
+		reply_fn fn{};
+		std::chrono::steady_clock::time_point sent{}; // only taken with a controller
+		size_t bytes{}; // WRITE payload
+		PRIORITY_CLASS priority{ PRIORITY_BULK };
+	};
+
+	size_t maxInFlight{ 64 };
+	std::shared_ptr<ConcurrencyController> controller{};
+	uint32_t nextId{ 1 };
+	std::unordered_map<uint32_t, pending_request> pending{};
+	PRIORITY_CLASS priority{ PRIORITY_BULK };
+	size_t interactivePending{};
+
+	std::vector<uint8_t> tx{};
+	size_t txPos{}; // bytes of tx already handed to libssh2
+	// end of what a write that returned EAGAIN may have committed: libssh2 encrypted it already
+	// and sends it as is on the next write, so nothing before it may move
+	size_t txCommitted{};
+	size_t packetStart{}; // offset of the packet being built
+	size_t txHead{}; // a packet boundary at or before max(txPos, txCommitted)
+	size_t urgentEnd{}; // end of the interactive packets moved to the front
+	std::vector<uint8_t> rx{};
+	size_t rxStart{};
+	size_t rxEnd{};
+
+	// packet building straight into tx
+	uint32_t Begin(SFTP_PACKET type);
+	void PutU8(uint8_t v);
+	void PutU32(uint32_t v);
+	void PutU64(uint64_t v);
+	void PutString(const void* data, size_t len);
+	void PutString(const std::string& s);
+	void PutAttrs(const LIBSSH2_SFTP_ATTRIBUTES& attrs);
+	uint32_t Submit(uint32_t id, reply_fn fn, size_t bytes = 0);
+	size_t Window() const;
+	// move the packet just built in front of the bulk packets libssh2 hasn't taken yet
+	void Expedite();
+	uint32_t PathRequest(SFTP_PACKET type, const std::string& path, reply_fn fn);
+
+	MINSFTP_RES Flush();
+	MINSFTP_RES Receive();
+	bool Dispatch(const uint8_t* packet, size_t len);
+	void Fail();
+};
+
+// queue one batch_op on ch, done gets its result when the reply arrived
+// (recorded in metrics as the matching METRIC_OP), shared by minsftp::Batch and SharedSession
+void SubmitBatchOp(SftpChannel* ch, Metrics* metrics, const batch_op& op, std::function<void(batch_result&)> done);
@@ -0,0 +1,211 @@
+#include "sftp_codec.h"
+
+#include <algorithm>
+#include <new>
+
+SftpArena::SftpArena(size_t _blockSize) {
+    blockSize = _blockSize ? _blockSize : 4096;
+}
+
+void* SftpArena::Allocate(size_t bytes, size_t align) {
+    while (true) {
+        if (block < blocks.size()) {
+            size_t offset = (used + align - 1) & ~(align - 1);
+            if (offset + bytes <= sizes[block]) {
+                used = offset + bytes;
+                return blocks[block].get() + offset;
+            }
+            block++;
+            used = 0;
+            continue;
+        }
+        size_t size = std::max(blockSize, bytes + align);
+        blocks.emplace_back(new uint8_t[size]);
+        sizes.push_back(size);
+    }
+}
+
+void SftpArena::Reset() {
+    // the last batch needed more than one block, next time it fits in one
+    if (blocks.size() > 1) {
+        size_t total = Capacity();
+        blocks.clear();
+        sizes.clear();
+        blocks.emplace_back(new uint8_t[total]);
+        sizes.push_back(total);
+    }
+    block = 0;
+    used = 0;
+}
+
+size_t SftpArena::Capacity() const {
+    size_t total = 0;
+    for (size_t size : sizes) {
+        total += size;
+    }
+    return total;
+}
+
+bool wire_reader::U8(uint8_t& v) {
+    if (end - pos < 1) {
+        return false;
+    }
+    v = *pos++;
+    return true;
+}
+bool wire_reader::U32(uint32_t& v) {
+    if (end - pos < 4) {
+        return false;
+    }
+    v = (uint32_t)pos[0] << 24 | (uint32_t)pos[1] << 16 | (uint32_t)pos[2] << 8 | pos[3];
+    pos += 4;
+    return true;
+}
+bool wire_reader::U64(uint64_t& v) {
+    uint32_t hi, lo;
+    if (!U32(hi) || !U32(lo)) {
+        return false;
+    }
+    v = (uint64_t)hi << 32 | lo;
+    return true;
+}
+bool wire_reader::Bytes(const uint8_t*& data, uint32_t& len) {
+    if (!U32(len) || (size_t)(end - pos) < len) {
+        return false;
+    }
+    data = pos;
+    pos += len;
+    return true;
+}
+bool wire_reader::String(std::string_view& s) {
+    const uint8_t* data;
+    uint32_t len;
+    if (!Bytes(data, len)) {
+        return false;
+    }
+    s = std::string_view(reinterpret_cast<const char*>(data), len);
+    return true;
+}
+bool wire_reader::Attrs(LIBSSH2_SFTP_ATTRIBUTES& attrs) {
+    uint32_t flags, v;
+    if (!U32(flags)) {
+        return false;
+    }
+    attrs = LIBSSH2_SFTP_ATTRIBUTES{};
+    attrs.flags = flags & ~LIBSSH2_SFTP_ATTR_EXTENDED;
+    if (flags & LIBSSH2_SFTP_ATTR_SIZE) {
+        uint64_t size;
+        if (!U64(size)) {
+            return false;
+        }
+        attrs.filesize = size;
+    }
+    if (flags & LIBSSH2_SFTP_ATTR_UIDGID) {
+        if (!U32(v)) {
+            return false;
+        }
+        attrs.uid = v;
+        if (!U32(v)) {
+            return false;
+        }
+        attrs.gid = v;
+    }
+    if (flags & LIBSSH2_SFTP_ATTR_PERMISSIONS) {
+        if (!U32(v)) {
+            return false;
+        }
+        attrs.permissions = v;
+    }
+    if (flags & LIBSSH2_SFTP_ATTR_ACMODTIME) {
+        if (!U32(v)) {
+            return false;
+        }
+        attrs.atime = v;
+        if (!U32(v)) {
+            return false;
+        }
+        attrs.mtime = v;
+    }
+    if (flags & LIBSSH2_SFTP_ATTR_EXTENDED) { // skip name/value pairs
+        uint32_t count;
+        const uint8_t* data;
+        if (!U32(count)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < count * 2; i++) {
+            if (!Bytes(data, v)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool ParseReply(const uint8_t* packet, size_t len, SftpArena& arena, uint32_t& id, sftp_reply& reply) {
+    wire_reader in{ packet, packet + len };
+    uint8_t type;
+    if (!in.U8(type) || !in.U32(id)) {
+        return false;
+    }
+
+    reply = sftp_reply{};
+    reply.type = type;
+    switch (type) {
+    case FXP_STATUS: {
+        if (!in.U32(reply.status)) {
+            return false;
+        }
+        return in.pos == in.end || in.String(reply.message); // absent in some v3 servers
+    }
+    case FXP_HANDLE:
+        return in.String(reply.handle);
+    case FXP_DATA: {
+        uint32_t dataLen;
+        if (!in.Bytes(reply.data, dataLen)) {
+            return false;
+        }
+        reply.dataLen = dataLen;
+        return true;
+    }
+    case FXP_NAME: {
+        uint32_t count;
+        // a name is at least 12 bytes on the wire (two empty strings, no attrs)
+        if (!in.U32(count) || count > (size_t)(in.end - in.pos) / 12) {
+            return false;
+        }
+        sftp_name* names = arena.Alloc<sftp_name>(count);
+        for (uint32_t i = 0; i < count; i++) {
+            sftp_name* name = new (names + i) sftp_name{};
+            if (!in.String(name->name) || !in.String(name->longname) || !in.Attrs(name->attrs)) {
+                return false;
+            }
+        }
+        reply.names = sftp_names{ names, count };
+        return true;
+    }
+    case FXP_ATTRS:
+        return in.Attrs(reply.attrs);
+    case FXP_EXTENDED_REPLY:
+        reply.data = in.pos;
+        reply.dataLen = (size_t)(in.end - in.pos);
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool ParseVersion(const uint8_t* packet, size_t len, uint32_t& version, std::map<std::string, std::string>& extensions) {
+    wire_reader in{ packet, packet + len };
+    uint8_t type;
+    if (!in.U8(type) || type != FXP_VERSION || !in.U32(version)) {
+        return false;
+    }
+    std::string_view name, data;
+    while (in.pos < in.end) {
+        if (!in.String(name) || !in.String(data)) {
+            return false;
+        }
+        extensions[std::string(name)] = std::string(data);
+    }
+    return true;
+}
@@ -0,0 +1,126 @@
+#pragma once
+#include "libssh2_setup.h"
+#include <libssh2.h>
+#include <libssh2_sftp.h>
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// sftp v3 packet types (draft-ietf-secsh-filexfer-02), libssh2 keeps its own private
+enum SFTP_PACKET : uint8_t {
+	FXP_INIT = 1,
+	FXP_VERSION = 2,
+	FXP_OPEN = 3,
+	FXP_CLOSE = 4,
+	FXP_READ = 5,
+	FXP_WRITE = 6,
+	FXP_LSTAT = 7,
+	FXP_FSTAT = 8,
+	FXP_SETSTAT = 9,
+	FXP_FSETSTAT = 10,
+	FXP_OPENDIR = 11,
+	FXP_READDIR = 12,
+	FXP_REMOVE = 13,
+	FXP_MKDIR = 14,
+	FXP_RMDIR = 15,
+	FXP_REALPATH = 16,
+	FXP_STAT = 17,
+	FXP_RENAME = 18,
+	FXP_READLINK = 19,
+	FXP_SYMLINK = 20,
+	FXP_STATUS = 101,
+	FXP_HANDLE = 102,
+	FXP_DATA = 103,
+	FXP_NAME = 104,
+	FXP_ATTRS = 105,
+	FXP_EXTENDED = 200,
+	FXP_EXTENDED_REPLY = 201,
+};
+
+constexpr size_t SFTP_MAX_PACKET = 1024 * 1024; // larger replies are treated as a protocol error
+
+// bump allocator for the decoded parts of a batch of replies that don't fit in sftp_reply
+// itself (the entries of a NAME reply). Reset() drops everything at once and keeps the memory,
+// so once it has grown to the largest batch, parsing allocates nothing
+class SftpArena {
+public:
+	SftpArena(size_t _blockSize = 64 * 1024);
+
+	// room for n T's, only for trivially destructible types (nothing is destroyed)
+	template <typename T>
+	T* Alloc(size_t n) {
+		static_assert(std::is_trivially_destructible<T>::value, "arena memory is never destroyed");
+		return static_cast<T*>(Allocate(n * sizeof(T), alignof(T)));
+	}
+	void Reset();
+	size_t Capacity() const;
+
+private:
+	std::vector<std::unique_ptr<uint8_t[]>> blocks{};
+	std::vector<size_t> sizes{};
+	size_t block{}; // block being filled
+	size_t used{}; // bytes of it
+	size_t blockSize{};
+
+	void* Allocate(size_t bytes, size_t align);
+};
+
+// names and strings are views into the packet, attrs are decoded in place (no extended pairs)
+struct sftp_name {
+	std::string_view name{};
+	std::string_view longname{};
+	LIBSSH2_SFTP_ATTRIBUTES attrs{};
+};
+
+// the entries of a NAME reply, in the arena
+struct sftp_names {
+	const sftp_name* items{};
+	size_t count{};
+
+	const sftp_name* begin() const { return items; }
+	const sftp_name* end() const { return items + count; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	const sftp_name& operator[](size_t i) const { return items[i]; }
+};
+
+// decoded server reply, all views point into the receive buffer or arena and are only
+// valid inside the callback, copy what has to outlive it (e.g. std::string(reply.handle))
+struct sftp_reply {
+	uint8_t type{}; // FXP_STATUS, FXP_HANDLE, ... or 0 when the channel died before the reply arrived
+	uint32_t status{ LIBSSH2_FX_OK }; // LIBSSH2_FX_*, only set by FXP_STATUS
+	std::string_view message{};
+	std::string_view handle{}; // FXP_HANDLE
+	const uint8_t* data{}; // FXP_DATA, FXP_EXTENDED_REPLY
+	size_t dataLen{};
+	sftp_names names{}; // FXP_NAME
+	LIBSSH2_SFTP_ATTRIBUTES attrs{}; // FXP_ATTRS
+
+	bool Ok() const {
+		return type != 0 && status == LIBSSH2_FX_OK;
+	}
+};
+
+// bounds checked big endian reader over one packet
+struct wire_reader {
+	const uint8_t* pos;
+	const uint8_t* end;
+
+	bool U8(uint8_t& v);
+	bool U32(uint32_t& v);
+	bool U64(uint64_t& v);
+	bool Bytes(const uint8_t*& data, uint32_t& len);
+	bool String(std::string_view& s);
+	bool Attrs(LIBSSH2_SFTP_ATTRIBUTES& attrs);
+};
+
+// packet is everything after the length field. false if it is malformed or of a type
+// a client doesn't expect, id is set as soon as it could be read
+bool ParseReply(const uint8_t* packet, size_t len, SftpArena& arena, uint32_t& id, sftp_reply& reply);
+// VERSION: protocol version and the extension name/data pairs that follow it
+bool ParseVersion(const uint8_t* packet, size_t len, uint32_t& version, std::map<std::string, std::string>& extensions);
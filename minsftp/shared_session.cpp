@@ -0,0 +1,260 @@
+#include "shared_session.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#endif
+
+SharedSession::SharedSession(LIBSSH2_SESSION* _session, libssh2_socket_t _sock, std::shared_ptr<Metrics> _metrics,
+    const bulk_options& _options) {
+    session = _session;
+    sock = _sock;
+    metrics = _metrics;
+    options = _options;
+    if (!options.maxOpen) {
+        options.maxOpen = 1;
+    }
+}
+
+SharedSession::~SharedSession() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+#ifndef WIN32
+    if (wakePipe[1] >= 0) {
+        char c = 0;
+        ssize_t rc = write(wakePipe[1], &c, 1);
+        (void)rc;
+    }
+#endif
+    if (driver.joinable()) {
+        driver.join();
+    }
+
+    getter.reset();
+    putter.reset();
+    channel.reset();
+#ifndef WIN32
+    for (int fd : wakePipe) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+#endif
+}
+
+MINSFTP_RES SharedSession::Start() {
+    OpenChannel();
+    if (!channel->IsOpen()) {
+        return RES_CHANNEL_FAILED;
+    }
+
+#ifndef WIN32
+    // wakes the driver out of select when a caller queues something
+    if (pipe(wakePipe) != 0) {
+        MINSFTP_ERROR("unable to create wake pipe: %d", errno);
+        return RES_FAILED;
+    }
+    for (int fd : wakePipe) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+#endif
+
+    driver = std::thread(&SharedSession::Drive, this);
+    return RES_OK;
+}
+
+void SharedSession::OpenChannel() {
+    getter.reset();
+    putter.reset();
+    channel.reset(new SftpChannel(session, sock, window));
+    if (channel->Open() != RES_OK) {
+        MINSFTP_ERROR("shared session could not open its sftp channel");
+        // left closed, requests on it fail right away
+    }
+    channel->SetMaxInFlight(options.maxInFlight);
+    channel->SetController(controller);
+
+    getter.reset(new BulkGetter(channel.get(), metrics.get(), [this](bulk_get_result& result) {
+        auto it = reads.find(result.index);
+        if (it == reads.end()) {
+            return;
+        }
+        // counted down first, a caller woken by its future must not see itself pending
+        pending--;
+        it->second->set_value(shared_read_result{ result.res, std::move(result.data) });
+        reads.erase(it);
+    }, options));
+    putter.reset(new BulkPutter(channel.get(), metrics.get(), [this](const bulk_put_result& result) {
+        auto it = writes.find(result.index);
+        if (it == writes.end()) {
+            return;
+        }
+        pending--;
+        it->second->set_value(result.res);
+        writes.erase(it);
+    }, options));
+}
+
+std::future<shared_read_result> SharedSession::ReadBytes(const std::string& sftpFullPath, PRIORITY_CLASS priority) {
+    auto promise = std::make_shared<std::promise<shared_read_result>>();
+    std::future<shared_read_result> future = promise->get_future();
+    Queue([this, promise, sftpFullPath, priority] {
+        size_t index = nextIndex++;
+        reads[index] = promise;
+        if (priority == PRIORITY_INTERACTIVE) {
+            WithPriority(priority, [&] { getter->Add(index, sftpFullPath); });
+            return;
+        }
+        waitingReads.emplace_back(index, sftpFullPath);
+    });
+    return future;
+}
+
+std::future<MINSFTP_RES> SharedSession::WriteBytes(const std::string& sftpFullPath, FILE_DATA data, long mode,
+    PRIORITY_CLASS priority) {
+    auto promise = std::make_shared<std::promise<MINSFTP_RES>>();
+    std::future<MINSFTP_RES> future = promise->get_future();
+    auto item = std::make_shared<bulk_put_item>();
+    item->path = sftpFullPath;
+    item->data = std::move(data);
+    item->mode = mode;
+    Queue([this, promise, item, priority] {
+        size_t index = nextIndex++;
+        writes[index] = promise;
+        if (priority == PRIORITY_INTERACTIVE) {
+            WithPriority(priority, [&] { putter->Add(index, *item); });
+            return;
+        }
+        waitingWrites.emplace_back(index, std::move(*item));
+    });
+    return future;
+}
+
+std::future<batch_result> SharedSession::Submit(const batch_op& op, PRIORITY_CLASS priority) {
+    auto promise = std::make_shared<std::promise<batch_result>>();
+    std::future<batch_result> future = promise->get_future();
+    Queue([this, promise, op, priority] {
+        WithPriority(priority, [&] {
+            SubmitBatchOp(channel.get(), metrics.get(), op, [this, promise](batch_result& result) {
+                pending--;
+                promise->set_value(std::move(result));
+            });
+        });
+    });
+    return future;
+}
+
+void SharedSession::WithPriority(PRIORITY_CLASS priority, const std::function<void()>& submit) {
+    channel->SetPriority(priority);
+    submit();
+    channel->SetPriority(PRIORITY_BULK);
+}
+
+size_t SharedSession::Pending() const {
+    return pending;
+}
+
+void SharedSession::Queue(job_fn job) {
+    pending++;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(std::move(job));
+    }
+    wake.notify_one();
+#ifndef WIN32
+    if (socketWait) {
+        char c = 0;
+        ssize_t rc = write(wakePipe[1], &c, 1);
+        (void)rc; // pipe full means a wake up is already pending
+    }
+#endif
+}
+
+bool SharedSession::Idle() const {
+    return !channel->InFlight() && waitingReads.empty() && waitingWrites.empty();
+}
+
+void SharedSession::StartWaiting() {
+    while (!waitingReads.empty() && getter->Active() < options.maxOpen) {
+        auto read = std::move(waitingReads.front());
+        waitingReads.pop_front();
+        getter->Add(read.first, read.second);
+    }
+    while (!waitingWrites.empty() && putter->Active() < options.maxOpen) {
+        auto write = std::move(waitingWrites.front());
+        waitingWrites.pop_front();
+        putter->Add(write.first, write.second);
+    }
+}
+
+void SharedSession::Drive() {
+    libssh2_session_set_blocking(session, 0);
+
+    while (true) {
+        std::deque<job_fn> batch{};
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            // nothing owed by the server: sleep until a caller queues something, waking up to
+            // keep the connection alive through nat and firewall idle timeouts
+            auto ready = [this] { return !jobs.empty() || stopping || !Idle(); };
+            while (keepaliveSec > 0 && !wake.wait_for(lock, std::chrono::seconds(keepaliveSec), ready)) {
+                int next = 0;
+                if (libssh2_keepalive_send(session, &next) != 0 && libssh2_session_last_errno(session) != LIBSSH2_ERROR_EAGAIN) {
+                    MINSFTP_WARN("shared session keepalive failed");
+                }
+            }
+            wake.wait(lock, ready);
+            if (stopping && jobs.empty() && Idle()) {
+                break;
+            }
+            batch.swap(jobs);
+        }
+
+        if (!batch.empty() && !channel->IsOpen()) {
+            MINSFTP_WARN("shared session channel broke, reopening");
+            OpenChannel();
+        }
+        for (job_fn& job : batch) {
+            job();
+        }
+        StartWaiting();
+        if (!channel->InFlight()) {
+            continue;
+        }
+
+        // a broken channel already failed every callback, the next jobs reopen it
+        if (channel->Pump() == RES_OK) {
+            StartWaiting(); // finished files made room
+            if (channel->WouldBlock()) {
+                WaitForSocket();
+            }
+        }
+    }
+
+    libssh2_session_set_blocking(session, 1);
+}
+
+void SharedSession::WaitForSocket() {
+    socketWait = true;
+    bool queued;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queued = !jobs.empty() || stopping;
+    }
+    if (!queued) {
+#ifdef WIN32
+        channel->WaitSocket(1); // no wake pipe, look at the queue again every millisecond
+#else
+        WaitSessionSocket(session, sock, 1000, wakePipe[0]);
+#endif
+    }
+    socketWait = false;
+
+#ifndef WIN32
+    char buffer[64];
+    while (read(wakePipe[0], buffer, sizeof(buffer)) > 0) {
+    }
+#endif
+}
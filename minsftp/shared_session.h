@@ -0,0 +1,88 @@
+#pragma once
+#include "minsftp.h"
+#include "sftp_channel.h"
+#include "bulk_transfer.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+struct shared_read_result {
+	MINSFTP_RES res{ RES_FAILED };
+	FILE_DATA data{};
+};
+
+// one authenticated connection for many threads: calls queue the operation and return a future,
+// a driver thread puts the requests of every caller on one pipelining channel (the session runs
+// non-blocking meanwhile) and completes each future when its replies arrive, matched by request id
+// reads and writes are pipelined like BulkGet/BulkPut with up to options.maxOpen files at once
+// get one from minsftp::Share(); the minsftp itself must not be used until it is destroyed
+class SharedSession {
+public:
+	// waits for everything queued, then stops the driver and gives the session back
+	~SharedSession();
+	SharedSession(const SharedSession&) = delete;
+	SharedSession& operator=(const SharedSession&) = delete;
+
+	// all of these may be called from any thread
+	// PRIORITY_INTERACTIVE operations start right away, past maxOpen and the reads/writes
+	// waiting for it, and their requests overtake queued bulk ones on the channel
+	std::future<shared_read_result> ReadBytes(const std::string& sftpFullPath,
+		PRIORITY_CLASS priority = PRIORITY_BULK);
+	std::future<MINSFTP_RES> WriteBytes(const std::string& sftpFullPath, FILE_DATA data, long mode = LIBSSH2_SFTP_S_IRUSR,
+		PRIORITY_CLASS priority = PRIORITY_BULK);
+	// metadata operation (stat, mkdir, rename, ...), same results as minsftp::Batch
+	std::future<batch_result> Submit(const batch_op& op, PRIORITY_CLASS priority = PRIORITY_BULK);
+
+	// operations queued or in progress
+	size_t Pending() const;
+
+private:
+	friend class minsftp;
+	using job_fn = std::function<void()>; // runs on the driver thread
+
+	SharedSession(LIBSSH2_SESSION* _session, libssh2_socket_t _sock, std::shared_ptr<Metrics> _metrics,
+		const bulk_options& _options);
+	MINSFTP_RES Start();
+
+	LIBSSH2_SESSION* session{};
+	libssh2_socket_t sock{ LIBSSH2_INVALID_SOCKET };
+	std::shared_ptr<Metrics> metrics{};
+	bulk_options options{};
+	std::shared_ptr<ConcurrencyController> controller{}; // the minsftp's, set before Start
+	int keepaliveSec{}; // keepalive_options::intervalSec, 0 sends none
+	uint32_t window{ SFTP_CHANNEL_WINDOW }; // channel receive window
+
+	// shared with callers
+	mutable std::mutex mutex{};
+	std::condition_variable wake{};
+	std::deque<job_fn> jobs{};
+	bool stopping{ false };
+	std::atomic<size_t> pending{};
+	std::atomic<bool> socketWait{ false }; // driver is in select, callers write to wakePipe
+	int wakePipe[2]{ -1, -1 };
+	std::thread driver{};
+
+	// driver thread only
+	std::unique_ptr<SftpChannel> channel{};
+	std::unique_ptr<BulkGetter> getter{};
+	std::unique_ptr<BulkPutter> putter{};
+	size_t nextIndex{};
+	std::deque<std::pair<size_t, std::string>> waitingReads{}; // over maxOpen
+	std::deque<std::pair<size_t, bulk_put_item>> waitingWrites{};
+	std::unordered_map<size_t, std::shared_ptr<std::promise<shared_read_result>>> reads{};
+	std::unordered_map<size_t, std::shared_ptr<std::promise<MINSFTP_RES>>> writes{};
+
+	void Queue(job_fn job);
+	void Drive();
+	void WaitForSocket();
+	void OpenChannel();
+	void StartWaiting();
+	// queue the requests submit makes with priority
+	void WithPriority(PRIORITY_CLASS priority, const std::function<void()>& submit);
+	bool Idle() const;
+};
@@ -0,0 +1,128 @@
+#include "socket_tuning.h"
+#include "log.h"
+
+#include <algorithm>
+#include <fstream>
+
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+// what the os grows buffers to by itself when left alone (tcp autotuning), buffers are only
+// set explicitly beyond it since that switches autotuning off for the socket
+static const int AUTOTUNE_CEILING_DEFAULT = 4 * 1024 * 1024;
+
+static void SetOption(libssh2_socket_t sock, int level, int name, int value, const char* what) {
+    if (setsockopt(sock, level, name, (const char*)&value, sizeof(value)) != 0) {
+        MINSFTP_DEBUG("unable to set %s to %d", what, value);
+    }
+}
+
+static int GetOption(libssh2_socket_t sock, int level, int name) {
+    int value = 0;
+    socklen_t len = sizeof(value);
+    getsockopt(sock, level, name, (char*)&value, &len);
+    return value;
+}
+
+// third field of net.ipv4.tcp_rmem/tcp_wmem on linux, the autotuning maximum
+static int AutotuneCeiling(const char* sysctl) {
+#ifdef __linux__
+    std::ifstream file(sysctl);
+    int min = 0, def = 0, max = 0;
+    if (file >> min >> def >> max && max > 0) {
+        return max;
+    }
+#else
+    (void)sysctl;
+#endif
+    return AUTOTUNE_CEILING_DEFAULT;
+}
+
+// the buffer a setsockopt of request ends up with: linux caps it at net.core.rmem_max/wmem_max
+// (without CAP_NET_ADMIN) and then doubles it for its bookkeeping
+static int EffectiveBuffer(int request, const char* coreMax) {
+#ifdef __linux__
+    std::ifstream file(coreMax);
+    int max = 0;
+    if (file >> max && max > 0) {
+        request = std::min(request, max);
+    }
+    return request * 2;
+#else
+    (void)coreMax;
+    return request;
+#endif
+}
+
+void PrepareSocket(libssh2_socket_t sock, const socket_options& options) {
+    if (options.noDelay) {
+        SetOption(sock, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+    if (options.sendBuffer > 0) {
+        SetOption(sock, SOL_SOCKET, SO_SNDBUF, options.sendBuffer, "SO_SNDBUF");
+    }
+    if (options.recvBuffer > 0) {
+        SetOption(sock, SOL_SOCKET, SO_RCVBUF, options.recvBuffer, "SO_RCVBUF");
+    }
+#ifdef TCP_USER_TIMEOUT
+    if (options.userTimeoutMs > 0) {
+        SetOption(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, options.userTimeoutMs, "TCP_USER_TIMEOUT");
+    }
+#endif
+    if (options.tcpKeepalive) {
+        SetOption(sock, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+#if defined(TCP_KEEPIDLE)
+        SetOption(sock, IPPROTO_TCP, TCP_KEEPIDLE, options.keepIdleSec, "TCP_KEEPIDLE");
+#elif defined(TCP_KEEPALIVE)
+        SetOption(sock, IPPROTO_TCP, TCP_KEEPALIVE, options.keepIdleSec, "TCP_KEEPALIVE"); // macos
+#endif
+#ifdef TCP_KEEPINTVL
+        SetOption(sock, IPPROTO_TCP, TCP_KEEPINTVL, options.keepIntervalSec, "TCP_KEEPINTVL");
+#endif
+#ifdef TCP_KEEPCNT
+        SetOption(sock, IPPROTO_TCP, TCP_KEEPCNT, options.keepCount, "TCP_KEEPCNT");
+#endif
+    }
+}
+
+uint64_t TuneSocket(libssh2_socket_t sock, const socket_options& options, std::chrono::steady_clock::duration connectTime) {
+    double rttUs = (double)std::chrono::duration_cast<std::chrono::microseconds>(connectTime).count();
+#if defined(__linux__) && defined(TCP_INFO)
+    tcp_info info{};
+    socklen_t len = sizeof(info);
+    if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 && info.tcpi_rtt > 0) {
+        rttUs = (double)info.tcpi_rtt; // the handshake sample, connectTime also counts the race
+    }
+#endif
+    uint64_t bdp = (uint64_t)(options.linkBps * rttUs / 1e6);
+    int wanted = (int)std::min<uint64_t>(bdp * 2, (uint64_t)options.maxBuffer); // room for one bdp in flight while one is read
+
+    // linux doubles the value for its bookkeeping, a bdp worth of window needs bdp there
+#ifdef __linux__
+    int request = wanted / 2;
+#else
+    int request = wanted;
+#endif
+    // after connect is fine for auto sizes: linux negotiated the window scale from the
+    // sysctl maximums, not from this socket's buffers
+    // a fixed size switches autotuning off, so it is only set when what the kernel will really
+    // grant beats what autotuning would reach (a low rmem_max would make it a lot smaller)
+    if (options.sendBuffer == 0 &&
+        EffectiveBuffer(request, "/proc/sys/net/core/wmem_max") > AutotuneCeiling("/proc/sys/net/ipv4/tcp_wmem")) {
+        SetOption(sock, SOL_SOCKET, SO_SNDBUF, request, "SO_SNDBUF");
+    }
+    if (options.recvBuffer == 0 &&
+        EffectiveBuffer(request, "/proc/sys/net/core/rmem_max") > AutotuneCeiling("/proc/sys/net/ipv4/tcp_rmem")) {
+        SetOption(sock, SOL_SOCKET, SO_RCVBUF, request, "SO_RCVBUF");
+    }
+
+    MINSFTP_DEBUG("rtt %.2f ms, bdp %llu bytes, buffers snd %d rcv %d", rttUs / 1000, (unsigned long long)bdp,
+        GetOption(sock, SOL_SOCKET, SO_SNDBUF), GetOption(sock, SOL_SOCKET, SO_RCVBUF));
+    return bdp;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include "libssh2_setup.h"
+#include <libssh2.h>
+
+#include <chrono>
+#include <cstdint>
+
+struct socket_options {
+	bool noDelay{ true }; // TCP_NODELAY: ssh packets go out right away instead of waiting on acks
+	// SO_SNDBUF/SO_RCVBUF in bytes. 0 sizes them to the bdp (linkBps * measured rtt) when the
+	// size the os grants (net.core.[rw]mem_max on linux) is more than it grows them to by
+	// itself, -1 leaves them to the os
+	int sendBuffer{};
+	int recvBuffer{};
+	uint64_t linkBps{ 125000000 }; // bandwidth assumed for the bdp in bytes/s (1 Gbit)
+	int maxBuffer{ 64 * 1024 * 1024 }; // cap of auto sized buffers and channel windows
+	// ssh receive window of sftp and exec channels, 0 sizes it to the bdp (at least 2 MB)
+	uint32_t channelWindow{};
+	int userTimeoutMs{}; // TCP_USER_TIMEOUT (linux): unacknowledged data fails the connection, 0 os default
+	bool tcpKeepalive{ true }; // SO_KEEPALIVE with the probe timing below, where the os has it
+	int keepIdleSec{ 60 };
+	int keepIntervalSec{ 10 };
+	int keepCount{ 6 };
+};
+
+// options that must be set before connect (explicit buffer sizes are what the window scale
+// is negotiated from), nodelay, keepalive and user timeout
+void PrepareSocket(libssh2_socket_t sock, const socket_options& options);
+// after connect: estimate the bdp from the handshake rtt (TCP_INFO where available, otherwise
+// connectTime) and apply auto sized buffers, returns the bdp in bytes
+uint64_t TuneSocket(libssh2_socket_t sock, const socket_options& options, std::chrono::steady_clock::duration connectTime);
@@ -0,0 +1,550 @@
+#include "tar_stream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iterator>
+
+// ustar header field offsets
+constexpr size_t TAR_NAME = 0;
+constexpr size_t TAR_MODE = 100;
+constexpr size_t TAR_UID = 108;
+constexpr size_t TAR_GID = 116;
+constexpr size_t TAR_SIZE = 124;
+constexpr size_t TAR_MTIME = 136;
+constexpr size_t TAR_CHKSUM = 148;
+constexpr size_t TAR_TYPE = 156;
+constexpr size_t TAR_LINKNAME = 157;
+constexpr size_t TAR_MAGIC = 257;
+constexpr size_t TAR_PREFIX = 345;
+
+constexpr size_t TAR_MAX_META = 1024 * 1024; // long name / pax record size we accept
+constexpr size_t TAR_WRITE_BUFFER = 256 * 1024;
+
+static size_t TarPadding(uint64_t size) {
+    return (size_t)((TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+}
+
+// octal, or gnu base-256 when the high bit of the first byte is set
+static uint64_t TarNumber(const uint8_t* field, size_t len) {
+    uint64_t v = 0;
+    if (field[0] & 0x80) {
+        v = field[0] & 0x7f;
+        for (size_t i = 1; i < len; i++) {
+            v = v << 8 | field[i];
+        }
+        return v;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (field[i] >= '0' && field[i] <= '7') {
+            v = v << 3 | (uint64_t)(field[i] - '0');
+        }
+        else if (field[i] != ' ' || v) {
+            break;
+        }
+    }
+    return v;
+}
+static void TarPutNumber(uint8_t* field, size_t len, uint64_t v) {
+    // len - 1 octal digits and a nul, base-256 if that doesn't fit
+    if (len - 1 < 22 && v >> (3 * (len - 1))) {
+        field[0] = 0x80;
+        for (size_t i = len - 1; i > 0; i--) {
+            field[i] = (uint8_t)v;
+            v >>= 8;
+        }
+        return;
+    }
+    field[len - 1] = 0;
+    for (size_t i = len - 1; i > 0; i--) {
+        field[i - 1] = (uint8_t)('0' + (v & 7));
+        v >>= 3;
+    }
+}
+static std::string TarString(const uint8_t* field, size_t len) {
+    const uint8_t* nul = static_cast<const uint8_t*>(memchr(field, 0, len));
+    return std::string(reinterpret_cast<const char*>(field), nul ? (size_t)(nul - field) : len);
+}
+static unsigned TarChecksum(const uint8_t* header) {
+    unsigned sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK; i++) {
+        sum += (i >= TAR_CHKSUM && i < TAR_CHKSUM + 8) ? ' ' : header[i];
+    }
+    return sum;
+}
+
+TarReader::TarReader(const fs::path& _root) {
+    root = _root;
+}
+
+size_t TarReader::Files() const {
+    return files;
+}
+uint64_t TarReader::Bytes() const {
+    return bytes;
+}
+
+MINSFTP_RES TarReader::Feed(const uint8_t* data, size_t len) {
+    while (len) {
+        switch (state) {
+        case STATE_HEADER: {
+            size_t n = std::min(len, TAR_BLOCK - headerFill);
+            memcpy(header + headerFill, data, n);
+            headerFill += n;
+            data += n;
+            len -= n;
+            if (headerFill == TAR_BLOCK) {
+                headerFill = 0;
+                MINSFTP_RES res = OnHeader();
+                if (res != RES_OK) {
+                    return res;
+                }
+            }
+            break;
+        }
+        case STATE_DATA:
+        case STATE_META: {
+            size_t n = (size_t)std::min<uint64_t>(len, remaining);
+            if (state == STATE_META) {
+                meta.append(reinterpret_cast<const char*>(data), n);
+            }
+            else if (out.is_open()) {
+                out.write(reinterpret_cast<const char*>(data), (std::streamsize)n);
+                if (!out) {
+                    MINSFTP_ERROR("failed writing %s", outPath.string().c_str());
+                    return RES_FAILED;
+                }
+                bytes += n;
+            }
+            remaining -= n;
+            data += n;
+            len -= n;
+            if (!remaining) {
+                state = STATE_PADDING;
+            }
+            break;
+        }
+        case STATE_PADDING: {
+            size_t n = std::min(len, padding);
+            padding -= n;
+            data += n;
+            len -= n;
+            break;
+        }
+        case STATE_END:
+            return RES_OK; // trailing zero blocks
+        }
+
+        if (state == STATE_PADDING && !padding) {
+            MINSFTP_RES res = EndEntry();
+            if (res != RES_OK) {
+                return res;
+            }
+        }
+    }
+    return RES_OK;
+}
+
+MINSFTP_RES TarReader::Finish() {
+    if (out.is_open()) {
+        out.close();
+    }
+    if (state == STATE_END || (state == STATE_HEADER && !headerFill)) {
+        return RES_OK;
+    }
+    MINSFTP_ERROR("tar stream ended in the middle of an entry");
+    return RES_FAILED;
+}
+
+MINSFTP_RES TarReader::OnHeader() {
+    bool zero = std::all_of(header, header + TAR_BLOCK, [](uint8_t b) { return b == 0; });
+    if (zero) {
+        if (++zeroBlocks == 2) {
+            state = STATE_END;
+        }
+        return RES_OK;
+    }
+    zeroBlocks = 0;
+
+    if (TarChecksum(header) != TarNumber(header + TAR_CHKSUM, 8)) {
+        MINSFTP_ERROR("bad tar header checksum");
+        return RES_FAILED;
+    }
+
+    char type = (char)header[TAR_TYPE];
+    uint64_t size = TarNumber(header + TAR_SIZE, 12);
+    unsigned long mode = (unsigned long)TarNumber(header + TAR_MODE, 8);
+
+    // metadata for the next entry
+    if (type == 'L' || type == 'K' || type == 'x' || type == 'g') {
+        if (size > TAR_MAX_META) {
+            MINSFTP_ERROR("tar metadata record too large: %llu", (unsigned long long)size);
+            return RES_FAILED;
+        }
+        metaType = type;
+        meta.clear();
+        remaining = size;
+        padding = TarPadding(size);
+        state = size ? STATE_META : STATE_PADDING;
+        return RES_OK;
+    }
+    metaType = 0;
+
+    std::string name = longName;
+    if (name.empty()) {
+        name = TarString(header + TAR_NAME, 100);
+        // posix ustar splits long names, the old gnu format uses the field for other things
+        if (!memcmp(header + TAR_MAGIC, "ustar\0", 6) && header[TAR_PREFIX]) {
+            name = TarString(header + TAR_PREFIX, 155) + "/" + name;
+        }
+    }
+    std::string link = longLink.empty() ? TarString(header + TAR_LINKNAME, 100) : longLink;
+    if (paxSize != UINT64_MAX) {
+        size = paxSize;
+    }
+    longName.clear();
+    longLink.clear();
+    paxSize = UINT64_MAX;
+
+    remaining = size;
+    padding = TarPadding(size);
+    state = size ? STATE_DATA : STATE_PADDING;
+
+    fs::path path;
+    if (!SafePath(name, path)) {
+        MINSFTP_ERROR("refusing tar entry outside the target dir: %s", name.c_str());
+        return RES_FAILED;
+    }
+
+    std::error_code ec;
+    if (type != '2' && fs::is_symlink(fs::symlink_status(path, ec))) {
+        // replaced rather than written through
+        fs::remove(path, ec);
+    }
+    switch (type) {
+    case '0':
+    case '\0':
+    case '7':
+        fs::create_directories(path.parent_path(), ec);
+        out.open(path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            MINSFTP_ERROR("unable to create %s", path.string().c_str());
+            return RES_FAILED;
+        }
+        outPath = path;
+        outMode = mode;
+        files++;
+        break;
+    case '5':
+        fs::create_directories(path, ec);
+        if (ec) {
+            MINSFTP_ERROR("unable to create dir %s", path.string().c_str());
+            return RES_FAILED;
+        }
+        break;
+    case '1': {
+        // another name of an earlier entry (gnu tar stores every extra link of a file this way)
+        fs::path target;
+        if (!SafePath(link, target)) {
+            MINSFTP_ERROR("refusing tar hard link outside the target dir: %s -> %s", name.c_str(), link.c_str());
+            return RES_FAILED;
+        }
+        fs::create_directories(path.parent_path(), ec);
+        fs::remove(path, ec);
+        ec.clear();
+        fs::create_hard_link(target, path, ec);
+        if (ec) {
+            // e.g. a file system without hard links, a copy gives the same content
+            ec.clear();
+            if (fs::is_symlink(fs::symlink_status(target, ec))) {
+                fs::copy_symlink(target, path, ec);
+            }
+            else {
+                fs::copy_file(target, path, fs::copy_options::overwrite_existing, ec);
+            }
+        }
+        if (ec) {
+            MINSFTP_ERROR("unable to link %s to %s: %s", path.string().c_str(), target.string().c_str(), ec.message().c_str());
+            return RES_FAILED;
+        }
+        files++;
+        break;
+    }
+    case '2':
+        // created as is, SafePath keeps later entries from being written through it
+        fs::create_directories(path.parent_path(), ec);
+        fs::remove(path, ec);
+        fs::create_symlink(link, path, ec);
+        if (ec) {
+            MINSFTP_WARN("unable to create symlink %s: %s", path.string().c_str(), ec.message().c_str());
+        }
+        break;
+    default:
+        MINSFTP_DEBUG("skipping tar entry %s of type %c", name.c_str(), type);
+        break;
+    }
+    return RES_OK;
+}
+
+MINSFTP_RES TarReader::EndEntry() {
+    state = STATE_HEADER;
+
+    switch (metaType) {
+    case 'L':
+        longName = meta.c_str();
+        break;
+    case 'K':
+        longLink = meta.c_str();
+        break;
+    case 'x':
+        ParsePax();
+        break;
+    default:
+        break;
+    }
+    if (metaType) {
+        metaType = 0;
+        meta.clear();
+        return RES_OK;
+    }
+
+    if (out.is_open()) {
+        out.close();
+        std::error_code ec;
+        fs::permissions(outPath, fs::perms(outMode & 07777), ec);
+    }
+    return RES_OK;
+}
+
+void TarReader::ParsePax() {
+    // records: "<len> <key>=<value>\n"
+    size_t pos = 0;
+    while (pos < meta.size()) {
+        size_t space = meta.find(' ', pos);
+        if (space == std::string::npos) {
+            return;
+        }
+        size_t len = strtoul(meta.c_str() + pos, nullptr, 10);
+        if (!len || pos + len > meta.size()) {
+            return;
+        }
+        std::string record = meta.substr(space + 1, pos + len - space - 2);
+        size_t eq = record.find('=');
+        if (eq != std::string::npos) {
+            std::string key = record.substr(0, eq);
+            std::string value = record.substr(eq + 1);
+            if (key == "path") {
+                longName = value;
+            }
+            else if (key == "linkpath") {
+                longLink = value;
+            }
+            else if (key == "size") {
+                paxSize = strtoull(value.c_str(), nullptr, 10);
+            }
+        }
+        pos += len;
+    }
+}
+
+bool TarReader::SafePath(const std::string& name, fs::path& path) const {
+    fs::path relative = fs::path(name).lexically_normal();
+    if (relative.has_root_name() || relative.has_root_directory()) {
+        return false;
+    }
+    for (const auto& part : relative) {
+        if (part == "..") {
+            return false;
+        }
+    }
+    path = root / relative;
+
+    // create_directories and ofstream follow symlinks, an earlier entry must not redirect them
+    fs::path parent = root;
+    std::error_code ec;
+    for (auto part = relative.begin(); part != relative.end() && std::next(part) != relative.end(); ++part) {
+        parent /= *part;
+        if (fs::is_symlink(fs::symlink_status(parent, ec))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+TarWriter::TarWriter(sink_fn _sink) {
+    sink = _sink;
+    buffer.reserve(TAR_WRITE_BUFFER);
+}
+
+size_t TarWriter::Files() const {
+    return files;
+}
+uint64_t TarWriter::Bytes() const {
+    return bytes;
+}
+
+MINSFTP_RES TarWriter::Put(const void* data, size_t len) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    buffer.insert(buffer.end(), p, p + len);
+    if (buffer.size() >= TAR_WRITE_BUFFER) {
+        return Flush();
+    }
+    return RES_OK;
+}
+
+MINSFTP_RES TarWriter::Flush() {
+    if (buffer.empty()) {
+        return RES_OK;
+    }
+    MINSFTP_RES res = sink(buffer.data(), buffer.size());
+    buffer.clear();
+    return res;
+}
+
+MINSFTP_RES TarWriter::Header(const std::string& name, char type, uint64_t size, unsigned long mode, int64_t mtime,
+    const std::string& link) {
+    uint8_t header[TAR_BLOCK]{};
+
+    // names that don't fit go first as gnu long name records
+    std::string storedName = name;
+    if (name.size() > 100) {
+        size_t split = name.rfind('/', 155);
+        if (split != std::string::npos && split > 0 && name.size() - split - 1 <= 100 && name.size() - split - 1 > 0) {
+            memcpy(header + TAR_PREFIX, name.data(), split);
+            storedName = name.substr(split + 1);
+        }
+        else {
+            MINSFTP_RES res = Header("././@LongLink", 'L', name.size() + 1, 0, 0, "");
+            if (res == RES_OK) {
+                res = Put(name.c_str(), name.size() + 1);
+            }
+            uint8_t zeros[TAR_BLOCK]{};
+            if (res == RES_OK) {
+                res = Put(zeros, TarPadding(name.size() + 1));
+            }
+            if (res != RES_OK) {
+                return res;
+            }
+            storedName = name.substr(0, 100);
+        }
+    }
+    if (link.size() > 100) {
+        MINSFTP_RES res = Header("././@LongLink", 'K', link.size() + 1, 0, 0, "");
+        if (res == RES_OK) {
+            res = Put(link.c_str(), link.size() + 1);
+        }
+        uint8_t zeros[TAR_BLOCK]{};
+        if (res == RES_OK) {
+            res = Put(zeros, TarPadding(link.size() + 1));
+        }
+        if (res != RES_OK) {
+            return res;
+        }
+    }
+
+    memcpy(header + TAR_NAME, storedName.data(), std::min<size_t>(storedName.size(), 100));
+    TarPutNumber(header + TAR_MODE, 8, mode & 07777);
+    TarPutNumber(header + TAR_UID, 8, 0);
+    TarPutNumber(header + TAR_GID, 8, 0);
+    TarPutNumber(header + TAR_SIZE, 12, size);
+    TarPutNumber(header + TAR_MTIME, 12, (uint64_t)std::max<int64_t>(mtime, 0));
+    header[TAR_TYPE] = (uint8_t)type;
+    memcpy(header + TAR_LINKNAME, link.data(), std::min<size_t>(link.size(), 100));
+    memcpy(header + TAR_MAGIC, "ustar\0" "00", 8);
+    unsigned sum = TarChecksum(header);
+    TarPutNumber(header + TAR_CHKSUM, 7, sum);
+    header[TAR_CHKSUM + 7] = ' ';
+    return Put(header, TAR_BLOCK);
+}
+
+MINSFTP_RES TarWriter::AddEntry(const fs::path& path, const std::string& name) {
+    std::error_code ec;
+    fs::file_status status = fs::symlink_status(path, ec);
+    if (ec) {
+        MINSFTP_ERROR("unable to stat %s", path.string().c_str());
+        return RES_FAILED;
+    }
+    unsigned long mode = (unsigned long)status.permissions() & 07777;
+
+    int64_t mtime = 0;
+    if (!fs::is_symlink(status)) {
+        auto ftime = fs::last_write_time(path, ec);
+        if (!ec) {
+            auto since = ftime - fs::file_time_type::clock::now() + std::chrono::system_clock::now();
+            mtime = std::chrono::duration_cast<std::chrono::seconds>(since.time_since_epoch()).count();
+        }
+    }
+
+    if (fs::is_symlink(status)) {
+        std::string link = fs::read_symlink(path, ec).generic_string();
+        return ec ? RES_FAILED : Header(name, '2', 0, mode, mtime, link);
+    }
+    if (fs::is_directory(status)) {
+        return Header(name + "/", '5', 0, mode, mtime, "");
+    }
+    if (!fs::is_regular_file(status)) {
+        MINSFTP_DEBUG("not archiving %s, not a regular file", path.string().c_str());
+        return RES_OK;
+    }
+
+    uint64_t size = fs::file_size(path, ec);
+    std::ifstream in(path, std::ios::binary);
+    if (ec || !in) {
+        MINSFTP_ERROR("unable to open %s", path.string().c_str());
+        return RES_FAILED;
+    }
+
+    MINSFTP_RES res = Header(name, '0', size, mode, mtime, "");
+    // exactly size bytes, a file that changes meanwhile must not corrupt the archive
+    std::vector<char> chunk(64 * 1024);
+    uint64_t left = size;
+    while (res == RES_OK && left) {
+        size_t n = (size_t)std::min<uint64_t>(left, chunk.size());
+        in.read(chunk.data(), (std::streamsize)n);
+        size_t got = (size_t)in.gcount();
+        if (got < n) {
+            MINSFTP_WARN("%s shrank while archiving, padding with zeros", path.string().c_str());
+            memset(chunk.data() + got, 0, n - got);
+        }
+        res = Put(chunk.data(), n);
+        left -= n;
+    }
+    uint8_t zeros[TAR_BLOCK]{};
+    if (res == RES_OK) {
+        res = Put(zeros, TarPadding(size));
+    }
+    files++;
+    bytes += size;
+    return res;
+}
+
+MINSFTP_RES TarWriter::AddTree(const fs::path& root) {
+    std::error_code ec;
+    fs::recursive_directory_iterator it(root, ec);
+    if (ec) {
+        MINSFTP_ERROR("unable to list %s", root.string().c_str());
+        return RES_FAILED;
+    }
+
+    for (; it != fs::recursive_directory_iterator(); it.increment(ec)) {
+        if (ec) {
+            MINSFTP_ERROR("unable to list below %s", root.string().c_str());
+            return RES_FAILED;
+        }
+        std::string name = it->path().lexically_relative(root).generic_string();
+        MINSFTP_RES res = AddEntry(it->path(), name);
+        if (res != RES_OK) {
+            return res;
+        }
+    }
+    return RES_OK;
+}
+
+MINSFTP_RES TarWriter::Finish() {
+    uint8_t zeros[TAR_BLOCK * 2]{};
+    MINSFTP_RES res = Put(zeros, sizeof(zeros));
+    if (res != RES_OK) {
+        return res;
+    }
+    return Flush();
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include "minsftp.h"
+
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <string>
+
+constexpr size_t TAR_BLOCK = 512;
+
+// streaming ustar unpacker, the archive can be fed in chunks of any size and files are
+// written below root as their data arrives (no temp files, memory use is one block)
+// understands gnu long names ('L'/'K') and pax path/linkpath/size records, entries that would
+// land outside root (absolute, .., through a symlink) are rejected. symlinks are created as
+// they are, hard links become links (or copies) of the earlier entry they name
+class TarReader {
+public:
+	TarReader(const fs::path& _root);
+
+	MINSFTP_RES Feed(const uint8_t* data, size_t len);
+	// RES_OK if the archive ended cleanly (or at a block boundary)
+	MINSFTP_RES Finish();
+
+	size_t Files() const;
+	uint64_t Bytes() const;
+
+private:
+	enum STATE {
+		STATE_HEADER,
+		STATE_DATA,
+		STATE_PADDING,
+		STATE_META, // body of a long name or pax record
+		STATE_END,
+	};
+
+	fs::path root{};
+	STATE state{ STATE_HEADER };
+	uint8_t header[TAR_BLOCK]{};
+	size_t headerFill{};
+	int zeroBlocks{};
+
+	uint64_t remaining{}; // of the current entry's data
+	size_t padding{};
+	char metaType{};
+	std::string meta{};
+	std::string longName{};
+	std::string longLink{};
+	uint64_t paxSize{ UINT64_MAX };
+	std::ofstream out{};
+	fs::path outPath{};
+	unsigned long outMode{};
+
+	size_t files{};
+	uint64_t bytes{};
+
+	MINSFTP_RES OnHeader();
+	MINSFTP_RES EndEntry();
+	void ParsePax();
+	// root / name if that stays below root: relative, no .. and no symlink among the parents
+	bool SafePath(const std::string& name, fs::path& path) const;
+};
+
+// streaming ustar packer for a local tree, blocks go to sink as they are produced
+// regular files, directories and symlinks are stored, other types are skipped
+class TarWriter {
+public:
+	using sink_fn = std::function<MINSFTP_RES(const uint8_t* data, size_t len)>;
+
+	TarWriter(sink_fn _sink);
+
+	// everything below root, names relative to it
+	MINSFTP_RES AddTree(const fs::path& root);
+	// end of archive marker, flushes the sink
+	MINSFTP_RES Finish();
+
+	size_t Files() const;
+	uint64_t Bytes() const;
+
+private:
+	sink_fn sink{};
+	std::vector<uint8_t> buffer{};
+	size_t files{};
+	uint64_t bytes{};
+
+	MINSFTP_RES Put(const void* data, size_t len);
+	MINSFTP_RES Flush();
+	MINSFTP_RES AddEntry(const fs::path& path, const std::string& name);
+	MINSFTP_RES Header(const std::string& name, char type, uint64_t size, unsigned long mode, int64_t mtime,
+		const std::string& link);
+};
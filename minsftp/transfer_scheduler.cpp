@@ -0,0 +1,430 @@
+#include "transfer_scheduler.h"
+#include "remote_file.h"
+
+#include <algorithm>
+#include <fstream>
+#include <thread>
+
+static int64_t NowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+TransferScheduler::TransferScheduler(std::vector<minsftp*> _sessions, const scheduler_options& _options) {
+    sessions = _sessions;
+    options = _options;
+    if (!options.smallBatchFiles) {
+        options.smallBatchFiles = 1;
+    }
+    if (!options.chunkSize) {
+        options.chunkSize = 1024 * 1024;
+    }
+}
+
+size_t TransferScheduler::Steals() const {
+    return steals;
+}
+
+void TransferScheduler::SetTransferRate(uint64_t bytesPerSecond) {
+    std::lock_guard<std::mutex> lock(rateMutex);
+    transferBps = bytesPerSecond;
+    for (const std::unique_ptr<worker_state>& worker : workers) {
+        if (worker->limit) {
+            worker->limit->SetRate(bytesPerSecond);
+        }
+    }
+}
+
+MINSFTP_RES TransferScheduler::Run(const std::vector<transfer_job>& _jobs, const transfer_fn& _onResult) {
+    if (sessions.empty()) {
+        MINSFTP_WARN("transfer scheduler has no sessions");
+        return RES_FAILED;
+    }
+
+    jobs = _jobs;
+    onResult = _onResult;
+    failed = 0;
+    steals = 0;
+    {
+        std::lock_guard<std::mutex> lock(rateMutex);
+        transferBps = options.transferBps;
+        workers.clear();
+        for (size_t i = 0; i < sessions.size(); i++) {
+            workers.emplace_back(new worker_state());
+        }
+    }
+
+    ResolveSizes();
+    Plan();
+
+    std::vector<std::thread> threads{};
+    for (size_t i = 0; i < workers.size(); i++) {
+        threads.emplace_back(&TransferScheduler::Work, this, i);
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    MINSFTP_DEBUG("scheduled %zu jobs on %zu sessions, %zu steals, %zu failed", jobs.size(), sessions.size(),
+        (size_t)steals, (size_t)failed);
+    return failed ? RES_FAILED : RES_OK;
+}
+
+void TransferScheduler::ResolveSizes() {
+    // unknown remote sizes in one pipelined batch on the first session
+    std::vector<batch_op> ops{};
+    std::vector<size_t> opJobs{};
+    for (size_t i = 0; i < jobs.size(); i++) {
+        transfer_job& job = jobs[i];
+        if (job.size) {
+            continue;
+        }
+        if (job.direction == TRANSFER_PUT) {
+            std::error_code ec;
+            uint64_t size = fs::file_size(job.localPath, ec);
+            job.size = ec ? 0 : size;
+        }
+        else {
+            batch_op op{};
+            op.type = BATCH_STAT;
+            op.path = job.remotePath;
+            ops.push_back(op);
+            opJobs.push_back(i);
+        }
+    }
+    if (ops.empty()) {
+        return;
+    }
+
+    std::vector<batch_result> results{};
+    sessions[0]->Batch(ops, results);
+    for (size_t i = 0; i < results.size(); i++) {
+        if (results[i].res == RES_OK && (results[i].attrs.flags & LIBSSH2_SFTP_ATTR_SIZE)) {
+            jobs[opJobs[i]].size = results[i].attrs.filesize;
+        }
+    }
+}
+
+void TransferScheduler::Plan() {
+    // large files alone, small ones in batches of one direction and priority
+    std::vector<work_item> items{};
+    work_item batches[2][2]{}; // [priority][direction]
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const transfer_job& job = jobs[i];
+        if (job.size >= options.smallFileBytes) {
+            items.push_back(work_item{ { i }, job.size, job.priority });
+            continue;
+        }
+        work_item& batch = batches[job.priority][job.direction];
+        batch.priority = job.priority;
+        batch.jobs.push_back(i);
+        batch.bytes += job.size;
+        if (batch.jobs.size() == options.smallBatchFiles) {
+            items.push_back(std::move(batch));
+            batch = work_item{};
+        }
+    }
+    for (auto& byDirection : batches) {
+        for (work_item& batch : byDirection) {
+            if (!batch.jobs.empty()) {
+                items.push_back(std::move(batch));
+            }
+        }
+    }
+
+    // interactive items head the deques, then longest processing time first: each item goes
+    // to the least loaded worker, so every deque ends up sorted largest first as well
+    std::stable_sort(items.begin(), items.end(), [](const work_item& a, const work_item& b) {
+        if (a.priority != b.priority) {
+            return a.priority > b.priority;
+        }
+        return a.bytes > b.bytes;
+    });
+    for (work_item& item : items) {
+        auto least = std::min_element(workers.begin(), workers.end(),
+            [](const std::unique_ptr<worker_state>& a, const std::unique_ptr<worker_state>& b) {
+            return a->queuedBytes < b->queuedBytes;
+        });
+        (*least)->queuedBytes += item.bytes;
+        (*least)->queue.push_back(std::move(item));
+    }
+}
+
+bool TransferScheduler::Stalled(const worker_state& worker) const {
+    return worker.busy && NowMs() - worker.progressMs > (int64_t)options.stallMs;
+}
+
+bool TransferScheduler::Take(size_t index, work_item& item) {
+    worker_state& self = *workers[index];
+    {
+        std::lock_guard<std::mutex> lock(self.mutex);
+        if (!self.queue.empty()) {
+            item = std::move(self.queue.front());
+            self.queue.pop_front();
+            self.queuedBytes -= item.bytes;
+            return true;
+        }
+    }
+
+    // steal interactive items waiting behind a busy worker first, otherwise from whoever has
+    // the most left; a stalled worker loses its big items too
+    while (true) {
+        size_t victim = SIZE_MAX;
+        uint64_t most = 0;
+        bool interactive = false;
+        for (size_t i = 0; i < workers.size(); i++) {
+            if (i == index) {
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(workers[i]->mutex);
+            if (workers[i]->queue.empty() || interactive) {
+                continue;
+            }
+            if (workers[i]->queue.front().priority == PRIORITY_INTERACTIVE) {
+                victim = i;
+                interactive = true;
+            }
+            else if (victim == SIZE_MAX || workers[i]->queuedBytes > most) {
+                victim = i;
+                most = workers[i]->queuedBytes;
+            }
+        }
+        if (victim == SIZE_MAX) {
+            return false;
+        }
+
+        worker_state& other = *workers[victim];
+        bool stalled = Stalled(other);
+        std::lock_guard<std::mutex> lock(other.mutex);
+        if (other.queue.empty()) {
+            continue; // someone else got there first
+        }
+        if (stalled || other.queue.front().priority == PRIORITY_INTERACTIVE) {
+            item = std::move(other.queue.front());
+            other.queue.pop_front();
+        }
+        else {
+            item = std::move(other.queue.back());
+            other.queue.pop_back();
+        }
+        other.queuedBytes -= item.bytes;
+        steals++;
+        MINSFTP_DEBUG("worker %zu stole %zu file(s), %llu bytes from worker %zu%s", index, item.jobs.size(),
+            (unsigned long long)item.bytes, victim, stalled ? " (stalled)" : "");
+        return true;
+    }
+}
+
+bool TransferScheduler::HasQueued() const {
+    for (const std::unique_ptr<worker_state>& worker : workers) {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        if (!worker->queue.empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void TransferScheduler::Work(size_t index) {
+    worker_state& self = *workers[index];
+    work_item item{};
+    while (true) {
+        // parked above the session limit, the running workers steal its queue meanwhile
+        if (options.controller && index >= options.controller->SessionLimit()) {
+            if (!HasQueued()) {
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            continue;
+        }
+        if (!Take(index, item)) {
+            return;
+        }
+        self.progressMs = NowMs();
+        self.busy = true;
+        ExecuteLimited(index, item);
+        self.busy = false;
+    }
+}
+
+void TransferScheduler::Progress(size_t index) {
+    workers[index]->progressMs = NowMs();
+}
+
+void TransferScheduler::Report(size_t index, size_t job, MINSFTP_RES res, uint64_t bytes) {
+    Progress(index);
+    if (res != RES_OK) {
+        failed++;
+    }
+    if (onResult) {
+        std::lock_guard<std::mutex> lock(resultMutex);
+        onResult(transfer_result{ job, res, index, bytes });
+    }
+}
+
+void TransferScheduler::ExecuteLimited(size_t index, const work_item& item) {
+    // the item gets its own bucket under the session's limit for its direction, so its rate
+    // can be changed while it runs
+    minsftp* session = sessions[index];
+    std::shared_ptr<TokenBucket> upload = session->UploadLimit();
+    std::shared_ptr<TokenBucket> download = session->DownloadLimit();
+    bool put = jobs[item.jobs[0]].direction == TRANSFER_PUT;
+    std::shared_ptr<TokenBucket> limit{};
+    {
+        std::lock_guard<std::mutex> lock(rateMutex);
+        if (transferBps) {
+            limit = std::make_shared<TokenBucket>(transferBps, 0, put ? upload : download);
+        }
+        workers[index]->limit = limit;
+    }
+    if (!limit) {
+        Execute(index, item);
+        return;
+    }
+
+    session->SetRateLimit(put ? limit : upload, put ? download : limit);
+    Execute(index, item);
+    session->SetRateLimit(upload, download);
+    std::lock_guard<std::mutex> lock(rateMutex);
+    workers[index]->limit.reset();
+}
+
+void TransferScheduler::Execute(size_t index, const work_item& item) {
+    minsftp* session = sessions[index];
+
+    if (item.jobs.size() == 1 && jobs[item.jobs[0]].size >= options.smallFileBytes) {
+        const transfer_job& job = jobs[item.jobs[0]];
+        uint64_t bytes = 0;
+        MINSFTP_RES res = job.direction == TRANSFER_GET ? GetLarge(index, job, bytes) : PutLarge(index, job, bytes);
+        Report(index, item.jobs[0], res, bytes);
+        return;
+    }
+
+    if (jobs[item.jobs[0]].direction == TRANSFER_GET) {
+        std::vector<std::string> paths{};
+        for (size_t job : item.jobs) {
+            paths.push_back(jobs[job].remotePath);
+        }
+        session->BulkGet(paths, [&](bulk_get_result& result) {
+            size_t job = item.jobs[result.index];
+            MINSFTP_RES res = result.res;
+            if (res == RES_OK) {
+                fs::path local = jobs[job].localPath;
+                std::error_code ec;
+                if (local.has_parent_path()) {
+                    fs::create_directories(local.parent_path(), ec);
+                }
+                std::ofstream out(local, std::ios::binary | std::ios::trunc);
+                out.write(reinterpret_cast<const char*>(result.data.data()), (std::streamsize)result.data.size());
+                if (!out) {
+                    MINSFTP_ERROR("unable to write %s", local.string().c_str());
+                    res = RES_FAILED;
+                }
+            }
+            Report(index, job, res, res == RES_OK ? result.data.size() : 0);
+        }, options.bulk);
+        return;
+    }
+
+    // small uploads, read from disk as BulkPut asks for them
+    size_t next = 0;
+    std::vector<size_t> sent{}; // BulkPut index -> job
+    session->BulkPut([&](bulk_put_item& put) {
+        while (next < item.jobs.size()) {
+            size_t job = item.jobs[next++];
+            std::ifstream in(jobs[job].localPath, std::ios::binary);
+            if (!in) {
+                MINSFTP_ERROR("unable to read %s", jobs[job].localPath.c_str());
+                Report(index, job, RES_FAILED, 0);
+                continue;
+            }
+            put.path = jobs[job].remotePath;
+            put.data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+            put.mode = jobs[job].mode;
+            sent.push_back(job);
+            return true;
+        }
+        return false;
+    }, [&](const bulk_put_result& result) {
+        size_t job = sent[result.index];
+        Report(index, job, result.res, result.res == RES_OK ? jobs[job].size : 0);
+    }, options.bulk);
+}
+
+MINSFTP_RES TransferScheduler::GetLarge(size_t index, const transfer_job& job, uint64_t& bytes) {
+    std::unique_ptr<RemoteFile> file = sessions[index]->OpenRemoteFile(job.remotePath);
+    if (!file) {
+        return RES_FAILED_OPEN_FILE_SFTP;
+    }
+
+    fs::path local = job.localPath;
+    std::error_code ec;
+    if (local.has_parent_path()) {
+        fs::create_directories(local.parent_path(), ec);
+    }
+    std::ofstream out(local, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        MINSFTP_ERROR("unable to create %s", local.string().c_str());
+        return RES_FAILED;
+    }
+
+    std::vector<char> buffer(options.chunkSize);
+    while (true) {
+        ssize_t n = file->ReadAt(bytes, buffer.data(), buffer.size());
+        if (n < 0) {
+            MINSFTP_ERROR("error reading %s", job.remotePath.c_str());
+            if (options.controller) {
+                options.controller->OnError();
+            }
+            return RES_FAILED;
+        }
+        if (options.controller) {
+            options.controller->OnBytes((uint64_t)n);
+        }
+        if (n == 0) {
+            break;
+        }
+        out.write(buffer.data(), n);
+        if (!out) {
+            MINSFTP_ERROR("unable to write %s", local.string().c_str());
+            return RES_FAILED;
+        }
+        bytes += (uint64_t)n;
+        Progress(index);
+    }
+    return file->Close();
+}
+
+MINSFTP_RES TransferScheduler::PutLarge(size_t index, const transfer_job& job, uint64_t& bytes) {
+    std::ifstream in(job.localPath, std::ios::binary);
+    if (!in) {
+        MINSFTP_ERROR("unable to read %s", job.localPath.c_str());
+        return RES_FAILED;
+    }
+    std::unique_ptr<RemoteFile> file = sessions[index]->OpenRemoteFile(job.remotePath,
+        LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC, job.mode);
+    if (!file) {
+        return RES_FAILED_OPEN_FILE_SFTP;
+    }
+
+    std::vector<char> buffer(options.chunkSize);
+    while (in) {
+        in.read(buffer.data(), (std::streamsize)buffer.size());
+        size_t n = (size_t)in.gcount();
+        if (!n) {
+            break;
+        }
+        MINSFTP_RES res = file->WriteAt(bytes, buffer.data(), n);
+        if (res != RES_OK) {
+            if (options.controller) {
+                options.controller->OnError();
+            }
+            return res;
+        }
+        if (options.controller) {
+            options.controller->OnBytes(n);
+        }
+        bytes += n;
+        Progress(index);
+    }
+    return file->Close();
+}
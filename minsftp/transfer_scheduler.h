@@ -0,0 +1,112 @@
+#pragma once
+#include "minsftp.h"
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+enum TRANSFER_DIR {
+	TRANSFER_GET, // remotePath -> localPath
+	TRANSFER_PUT, // localPath -> remotePath
+};
+
+struct transfer_job {
+	TRANSFER_DIR direction{ TRANSFER_GET };
+	std::string remotePath{};
+	std::string localPath{};
+	uint64_t size{}; // 0: unknown, stat'ed (get) or read from the local file (put) before planning
+	long mode{ 0644 }; // for uploaded files
+	// interactive jobs are planned ahead of every bulk one and stolen first by idle workers
+	PRIORITY_CLASS priority{ PRIORITY_BULK };
+};
+
+struct transfer_result {
+	size_t index{}; // into the jobs passed to Run
+	MINSFTP_RES res{ RES_FAILED };
+	size_t worker{}; // session that did it
+	uint64_t bytes{};
+};
+
+// called from worker threads, one call at a time
+using transfer_fn = std::function<void(const transfer_result&)>;
+
+struct scheduler_options {
+	uint64_t smallFileBytes{ 256 * 1024 }; // below this files are batched
+	size_t smallBatchFiles{ 64 }; // files per batch, one BulkGet/BulkPut each
+	size_t chunkSize{ 1024 * 1024 }; // read/write size for large files
+	uint32_t stallMs{ 5000 }; // a busy worker without progress this long counts as stalled
+	bulk_options bulk{}; // for the small file batches
+	// the host's limits (minsftp::Concurrency()): workers beyond its SessionLimit() sit out
+	// until it grows, large file chunks are reported to it. nullptr uses every session
+	std::shared_ptr<ConcurrencyController> controller{};
+	// bytes per second for each work item (a large file or a small file batch), nested under
+	// the session's own limits (minsftp::SetRateLimit), 0 is unlimited. change it while running
+	// with SetTransferRate
+	uint64_t transferBps{};
+};
+
+// runs a multi-file job on a pool of sessions, one worker thread per session
+// work items (a large file, or a batch of small files of one direction and priority) are
+// planned interactive first, then largest first onto the least loaded worker's deque, so big
+// files start early and the tail is made of small ones. a worker takes from the front of its
+// own deque; an idle worker steals from the back of the deque with the most queued bytes, or
+// from its front when that worker is stalled (no progress for stallMs), so one slow
+// connection doesn't hold back the rest of its queue
+class TransferScheduler {
+public:
+	// sessions must be initialized, each is used by one worker thread only while Run is going
+	TransferScheduler(std::vector<minsftp*> _sessions, const scheduler_options& _options = scheduler_options{});
+
+	// blocks until every job finished, RES_OK if all succeeded, RES_FAILED otherwise
+	MINSFTP_RES Run(const std::vector<transfer_job>& jobs, const transfer_fn& onResult = nullptr);
+
+	// work items taken from another worker's deque during the last Run
+	size_t Steals() const;
+
+	// new per transfer limit for the following work items and the running ones that are
+	// limited already (0 lifts their limit), thread safe
+	void SetTransferRate(uint64_t bytesPerSecond);
+
+private:
+	struct work_item {
+		std::vector<size_t> jobs{}; // one large file or a batch of small ones
+		uint64_t bytes{};
+		PRIORITY_CLASS priority{ PRIORITY_BULK };
+	};
+	struct worker_state {
+		std::mutex mutex{};
+		std::deque<work_item> queue{}; // largest first
+		uint64_t queuedBytes{};
+		std::atomic<bool> busy{ false };
+		std::atomic<int64_t> progressMs{}; // last time a transfer moved
+		std::shared_ptr<TokenBucket> limit{}; // of the running item, guarded by rateMutex
+	};
+
+	std::vector<minsftp*> sessions{};
+	scheduler_options options{};
+	std::vector<std::unique_ptr<worker_state>> workers{};
+	std::atomic<size_t> steals{};
+	std::mutex rateMutex{};
+	uint64_t transferBps{};
+
+	// the current Run
+	std::vector<transfer_job> jobs{};
+	transfer_fn onResult{};
+	std::mutex resultMutex{};
+	std::atomic<size_t> failed{};
+
+	void ResolveSizes();
+	void Plan();
+	void Work(size_t index);
+	bool Take(size_t index, work_item& item);
+	void Execute(size_t index, const work_item& item);
+	void ExecuteLimited(size_t index, const work_item& item);
+	MINSFTP_RES GetLarge(size_t index, const transfer_job& job, uint64_t& bytes);
+	MINSFTP_RES PutLarge(size_t index, const transfer_job& job, uint64_t& bytes);
+	void Report(size_t index, size_t job, MINSFTP_RES res, uint64_t bytes);
+	void Progress(size_t index);
+	bool Stalled(const worker_state& worker) const;
+	bool HasQueued() const;
+};
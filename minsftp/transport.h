@@ -0,0 +1,128 @@
+#pragma once
+#include "libssh2_setup.h"
+#include <libssh2.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#ifdef WIN32
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#include <poll.h>
+#include <errno.h>
+#endif
+
+// hook for the session socket, installed with LIBSSH2_CALLBACK_SEND/RECV before the handshake
+// return values follow libssh2's default callbacks: bytes transferred, 0 on eof or -errno
+// note: libssh2 puts the socket in non-blocking mode, a shim must return -EAGAIN
+// instead of waiting for data that isn't there yet or libssh2 can't poll the socket
+// a shim that holds i/o back on its own (pacing, delayed delivery) returns -EAGAIN as well
+// and reports when it can continue through SendReady/RecvReady, the wait helpers use that
+class Transport {
+public:
+	using clock = std::chrono::steady_clock;
+
+	virtual ~Transport() {}
+
+	virtual ssize_t Send(libssh2_socket_t sock, const void* buffer, size_t length, int flags) = 0;
+	virtual ssize_t Recv(libssh2_socket_t sock, void* buffer, size_t length, int flags) = 0;
+
+	// after Send/Recv returned -EAGAIN: when the shim can continue, clock max when it is
+	// waiting for the socket rather than for time
+	virtual clock::time_point SendReady() const {
+		return clock::time_point::max();
+	}
+	virtual clock::time_point RecvReady() const {
+		return clock::time_point::max();
+	}
+
+	// plain socket calls with libssh2's error convention
+	static ssize_t SocketSend(libssh2_socket_t sock, const void* buffer, size_t length, int flags) {
+		ssize_t rc = send(sock, (const char*)buffer, (int)length, flags);
+		return rc < 0 ? LastSocketError() : rc;
+	}
+	static ssize_t SocketRecv(libssh2_socket_t sock, void* buffer, size_t length, int flags) {
+		ssize_t rc = recv(sock, (char*)buffer, (int)length, flags);
+		return rc < 0 ? LastSocketError() : rc;
+	}
+	static ssize_t LastSocketError() {
+#ifdef WIN32
+		int err = WSAGetLastError();
+		return err == WSAEWOULDBLOCK ? -EAGAIN : -err;
+#else
+		return errno == EWOULDBLOCK ? -EAGAIN : -errno;
+#endif
+	}
+};
+
+// i/o the session's send/recv callbacks held back on their own (rate limit, transport shim)
+// rather than because the socket would block, clock max while nothing is held
+struct session_hold {
+	Transport::clock::time_point sendUntil{ Transport::clock::time_point::max() };
+	Transport::clock::time_point recvUntil{ Transport::clock::time_point::max() };
+	bool recvWatchSocket{}; // new data on the socket matters before recvUntil (the shim stamps arrivals)
+};
+// hold of a session created by minsftp (defined next to its callbacks), empty for any other
+session_hold SessionHold(LIBSSH2_SESSION* session);
+
+// wait until the socket is readable (in) or writable (out), wakeFd (posix only, e.g. the
+// read end of a pipe) is readable or until has passed
+inline void WaitSocketUntil(libssh2_socket_t sock, bool in, bool out, int wakeFd, Transport::clock::time_point until) {
+	auto left = std::chrono::ceil<std::chrono::milliseconds>(until - Transport::clock::now());
+	if (left.count() < 0) {
+		left = std::chrono::milliseconds::zero();
+	}
+
+	// poll rather than select, descriptors of long running processes easily pass FD_SETSIZE
+	int timeoutMs = (int)left.count();
+#ifdef WIN32
+	(void)wakeFd;
+	WSAPOLLFD fds[1]{};
+	ULONG count = 0;
+	if (in || out) {
+		fds[count++] = { sock, (SHORT)((in ? POLLRDNORM : 0) | (out ? POLLWRNORM : 0)), 0 };
+	}
+	if (!count) {
+		std::this_thread::sleep_for(left); // WSAPoll without sockets fails right away
+		return;
+	}
+	WSAPoll(fds, count, timeoutMs);
+#else
+	pollfd fds[2]{};
+	nfds_t count = 0;
+	if (in || out) {
+		fds[count++] = { sock, (short)((in ? POLLIN : 0) | (out ? POLLOUT : 0)), 0 };
+	}
+	if (wakeFd >= 0) {
+		fds[count++] = { wakeFd, POLLIN, 0 };
+	}
+	poll(fds, count, timeoutMs);
+#endif
+}
+
+// on a non-blocking session, wait (up to timeoutMs) until the socket is ready in the
+// direction libssh2 last blocked on, returns right away if it isn't blocked
+// a direction the callbacks held back waits for the hold to end instead of for the socket
+// wakeFd (posix only, e.g. the read end of a pipe) also ends the wait once it is readable
+inline void WaitSessionSocket(LIBSSH2_SESSION* session, libssh2_socket_t sock, int timeoutMs, int wakeFd = -1) {
+	int dir = libssh2_session_block_directions(session);
+	if (!dir || sock == LIBSSH2_INVALID_SOCKET) {
+		return;
+	}
+
+	bool in = (dir & LIBSSH2_SESSION_BLOCK_INBOUND) != 0;
+	bool out = (dir & LIBSSH2_SESSION_BLOCK_OUTBOUND) != 0;
+	auto until = Transport::clock::now() + std::chrono::milliseconds(timeoutMs);
+	session_hold hold = SessionHold(session);
+	if (out && hold.sendUntil != Transport::clock::time_point::max()) {
+		out = false;
+		until = std::min(until, hold.sendUntil);
+	}
+	if (in && hold.recvUntil != Transport::clock::time_point::max()) {
+		in = hold.recvWatchSocket;
+		until = std::min(until, hold.recvUntil);
+	}
+	WaitSocketUntil(sock, in, out, wakeFd, until);
+}
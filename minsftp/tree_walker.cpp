@@ -0,0 +1,315 @@
+#include "tree_walker.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+TreeWalker::TreeWalker(SftpChannel* _channel, Metrics* _metrics, const walk_fn& _onEntry, const walk_options& _options) {
+    channel = _channel;
+    metrics = _metrics;
+    onEntry = _onEntry;
+    options = _options;
+    if (!options.maxDirsInFlight) {
+        options.maxDirsInFlight = 1;
+    }
+}
+
+size_t TreeWalker::Entries() const {
+    return entries;
+}
+size_t TreeWalker::Errors() const {
+    return errors;
+}
+
+MINSFTP_RES TreeWalker::Run(const std::string& root) {
+    // room for every directory's readdir plus the closes of finished ones
+    channel->SetMaxInFlight(std::max<size_t>(64, options.maxDirsInFlight * 2));
+
+    auto rootDir = std::make_shared<dir_state>();
+    rootDir->path = root;
+    while (rootDir->path.size() > 1 && rootDir->path.back() == '/') {
+        rootDir->path.pop_back();
+    }
+    queue.push_back(rootDir);
+
+    while (!channel->Broken()) {
+        while (!stopped && active < options.maxDirsInFlight && !queue.empty()) {
+            std::shared_ptr<dir_state> dir = queue.front();
+            queue.pop_front();
+            StartDir(dir);
+        }
+        if (!channel->InFlight()) {
+            break;
+        }
+
+        if (channel->Pump() != RES_OK) {
+            break;
+        }
+        if (channel->WouldBlock()) {
+            channel->WaitSocket();
+        }
+    }
+
+    if (channel->Broken()) {
+        MINSFTP_ERROR("tree walk aborted, sftp channel broke");
+        return RES_CHANNEL_FAILED;
+    }
+    return errors ? RES_FAILED : RES_OK;
+}
+
+void TreeWalker::StartDir(std::shared_ptr<dir_state> dir) {
+    active++;
+    auto start = std::chrono::steady_clock::now();
+    channel->OpenDir(dir->path, [this, dir, start](const sftp_reply& reply) {
+        bool ok = reply.Ok() && reply.type == FXP_HANDLE;
+        if (metrics) {
+            metrics->Record(OP_OPEN, std::chrono::steady_clock::now() - start, 0, ok);
+        }
+        if (!ok) {
+            if (reply.type) {
+                MINSFTP_WARN("unable to open dir %s: %u", dir->path.c_str(), reply.status);
+            }
+            errors++;
+            active--;
+            return;
+        }
+
+        dir->handle = reply.handle;
+        if (stopped) {
+            FinishDir(dir);
+        }
+        else {
+            ReadNext(dir);
+        }
+    });
+}
+
+void TreeWalker::ReadNext(std::shared_ptr<dir_state> dir) {
+    auto start = std::chrono::steady_clock::now();
+    channel->ReadDir(dir->handle, [this, dir, start](const sftp_reply& reply) {
+        if (reply.type == FXP_NAME) {
+            if (metrics) {
+                metrics->Record(OP_READDIR, std::chrono::steady_clock::now() - start);
+            }
+            OnNames(*dir, reply);
+            if (stopped) {
+                FinishDir(dir);
+            }
+            else {
+                ReadNext(dir);
+            }
+            return;
+        }
+
+        // end of directory, or an error part way through
+        if (reply.type && reply.status != LIBSSH2_FX_EOF) {
+            MINSFTP_WARN("error reading dir %s: %u", dir->path.c_str(), reply.status);
+            errors++;
+        }
+        if (reply.type) {
+            FinishDir(dir);
+        }
+        else {
+            active--;
+        }
+    });
+}
+
+void TreeWalker::FinishDir(std::shared_ptr<dir_state> dir) {
+    auto start = std::chrono::steady_clock::now();
+    Metrics* m = metrics;
+    channel->CloseHandle(dir->handle, [m, start](const sftp_reply& reply) {
+        if (m) {
+            m->Record(OP_CLOSE, std::chrono::steady_clock::now() - start, 0, reply.Ok());
+        }
+    });
+    active--;
+}
+
+void TreeWalker::OnNames(const dir_state& dir, const sftp_reply& reply) {
+    // same as find -maxdepth: 0 reports nothing below the root
+    if (options.maxDepth >= 0 && dir.depth + 1 > options.maxDepth) {
+        return;
+    }
+    for (const sftp_name& name : reply.names) {
+        if (stopped) {
+            return;
+        }
+        if (name.name == "." || name.name == "..") {
+            continue;
+        }
+
+        tree_entry entry{};
+        entry.name = name.name;
+        entry.path = dir.path == "/" ? "/" + entry.name : dir.path + "/" + entry.name;
+        entry.attrs = name.attrs;
+        entry.depth = dir.depth + 1;
+
+        if (options.prune && options.prune(entry)) {
+            continue;
+        }
+        entries++;
+        if (onEntry && !onEntry(entry)) {
+            stopped = true;
+            return;
+        }
+
+        // readdir attributes are lstat's, symlinked directories are reported but not followed
+        bool isDir = (entry.attrs.flags & LIBSSH2_SFTP_ATTR_PERMISSIONS) && LIBSSH2_SFTP_S_ISDIR(entry.attrs.permissions);
+        if (isDir && (options.maxDepth < 0 || entry.depth < options.maxDepth)) {
+            auto child = std::make_shared<dir_state>();
+            child->path = entry.path;
+            child->depth = entry.depth;
+            queue.push_back(child);
+        }
+    }
+}
+
+FindWalker::FindWalker(LIBSSH2_SESSION* _session, libssh2_socket_t _sock, const walk_fn& _onEntry, const walk_options& _options) {
+    session = _session;
+    sock = _sock;
+    onEntry = _onEntry;
+    options = _options;
+}
+
+size_t FindWalker::Entries() const {
+    return entries;
+}
+
+MINSFTP_RES FindWalker::Run(const std::string& root) {
+    std::string dir = root;
+    while (dir.size() > 1 && dir.back() == '/') {
+        dir.pop_back();
+    }
+
+    // probe for -printf first so a missing feature is told apart from a missing root
+    // record: type mode size uid gid atime mtime depth path, nul terminated (names may hold newlines)
+    std::string command = "find / -maxdepth 0 -printf '' >/dev/null 2>&1 || exit 97; exec find -P " + ExecChannel::Quote(dir) +
+        " -mindepth 1";
+    if (options.maxDepth >= 0) {
+        command += " -maxdepth " + std::to_string(options.maxDepth);
+    }
+    command += " -printf '%y %m %s %U %G %A@ %T@ %d %p\\0'";
+
+    ExecChannel exec(session, sock);
+    MINSFTP_RES res = exec.Open(command);
+    if (res != RES_OK) {
+        return res;
+    }
+
+    std::vector<char> buffer(64 * 1024);
+    std::string partial{};
+    bool malformed = false;
+    while (!stopped && !malformed) {
+        ssize_t n = exec.Read(buffer.data(), buffer.size());
+        if (n <= 0) {
+            if (n < 0) {
+                MINSFTP_ERROR("find output read failed: %zd", n);
+                exec.Close();
+                return RES_CHANNEL_FAILED;
+            }
+            break;
+        }
+
+        const char* p = buffer.data();
+        const char* end = p + n;
+        while (!stopped && p < end) {
+            const char* nul = static_cast<const char*>(memchr(p, '\0', (size_t)(end - p)));
+            if (!nul) {
+                partial.append(p, end);
+                break;
+            }
+            bool ok;
+            if (partial.empty()) {
+                ok = ParseRecord(dir, p, (size_t)(nul - p));
+            }
+            else {
+                partial.append(p, nul);
+                ok = ParseRecord(dir, partial.data(), partial.size());
+                partial.clear();
+            }
+            if (!ok) {
+                MINSFTP_WARN("unexpected find output, giving up on exec listing");
+                malformed = true;
+                break;
+            }
+            p = nul + 1;
+        }
+    }
+
+    int status = exec.Close();
+    if (malformed) {
+        return RES_EXEC_UNSUPPORTED;
+    }
+    if (stopped) {
+        return RES_OK;
+    }
+    if (status == 97 || status == 126 || status == 127) {
+        return RES_EXEC_UNSUPPORTED;
+    }
+    return status == 0 ? RES_OK : RES_FAILED;
+}
+
+bool FindWalker::ParseRecord(const std::string& root, const char* record, size_t len) {
+    // eight space separated fields, the path is the rest (it may contain spaces)
+    const char* fields[8];
+    const char* p = record;
+    const char* end = record + len;
+    for (int i = 0; i < 8; i++) {
+        fields[i] = p;
+        const char* space = static_cast<const char*>(memchr(p, ' ', (size_t)(end - p)));
+        if (!space) {
+            return false;
+        }
+        p = space + 1;
+    }
+
+    tree_entry entry{};
+    entry.path.assign(p, end);
+    if (entry.path.compare(0, root.size(), root) != 0) {
+        return false;
+    }
+    size_t slash = entry.path.find_last_of('/');
+    entry.name = slash == std::string::npos ? entry.path : entry.path.substr(slash + 1);
+    entry.depth = atoi(fields[7]);
+
+    unsigned long type = 0;
+    switch (fields[0][0]) {
+    case 'f': type = LIBSSH2_SFTP_S_IFREG; break;
+    case 'd': type = LIBSSH2_SFTP_S_IFDIR; break;
+    case 'l': type = LIBSSH2_SFTP_S_IFLNK; break;
+    case 'b': type = LIBSSH2_SFTP_S_IFBLK; break;
+    case 'c': type = LIBSSH2_SFTP_S_IFCHR; break;
+    case 'p': type = LIBSSH2_SFTP_S_IFIFO; break;
+    case 's': type = LIBSSH2_SFTP_S_IFSOCK; break;
+    default: break;
+    }
+    entry.attrs.flags = LIBSSH2_SFTP_ATTR_SIZE | LIBSSH2_SFTP_ATTR_UIDGID | LIBSSH2_SFTP_ATTR_PERMISSIONS |
+        LIBSSH2_SFTP_ATTR_ACMODTIME;
+    entry.attrs.permissions = type | strtoul(fields[1], nullptr, 8);
+    entry.attrs.filesize = strtoull(fields[2], nullptr, 10);
+    entry.attrs.uid = strtoul(fields[3], nullptr, 10);
+    entry.attrs.gid = strtoul(fields[4], nullptr, 10);
+    entry.attrs.atime = strtoul(fields[5], nullptr, 10); // fraction is dropped, sftp v3 has whole seconds
+    entry.attrs.mtime = strtoul(fields[6], nullptr, 10);
+
+    if (!prunedDir.empty()) {
+        if (entry.path.size() > prunedDir.size() && entry.path.compare(0, prunedDir.size(), prunedDir) == 0 &&
+            entry.path[prunedDir.size()] == '/') {
+            return true;
+        }
+        prunedDir.clear();
+    }
+    if (options.prune && options.prune(entry)) {
+        if (LIBSSH2_SFTP_S_ISDIR(entry.attrs.permissions)) {
+            prunedDir = entry.path;
+        }
+        return true;
+    }
+
+    entries++;
+    if (onEntry && !onEntry(entry)) {
+        stopped = true;
+    }
+    return true;
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include "minsftp.h"
+#include "sftp_channel.h"
+#include "exec_channel.h"
+
+#include <deque>
+#include <memory>
+#include <string>
+
+// breadth first walk over an SftpChannel with up to maxDirsInFlight directories being
+// listed at once, each with its own opendir/readdir/close chain
+// used through minsftp::WalkTree
+class TreeWalker {
+public:
+	TreeWalker(SftpChannel* _channel, Metrics* _metrics, const walk_fn& _onEntry, const walk_options& _options);
+
+	// RES_OK, RES_FAILED if some directories couldn't be listed, RES_CHANNEL_FAILED
+	MINSFTP_RES Run(const std::string& root);
+	size_t Entries() const;
+	size_t Errors() const;
+
+private:
+	struct dir_state {
+		std::string path{};
+		int depth{};
+		std::string handle{};
+	};
+
+	SftpChannel* channel{};
+	Metrics* metrics{};
+	walk_fn onEntry{};
+	walk_options options{};
+
+	std::deque<std::shared_ptr<dir_state>> queue{};
+	size_t active{};
+	bool stopped{ false };
+	size_t entries{};
+	size_t errors{};
+
+	void StartDir(std::shared_ptr<dir_state> dir);
+	void ReadNext(std::shared_ptr<dir_state> dir);
+	void FinishDir(std::shared_ptr<dir_state> dir);
+	void OnNames(const dir_state& dir, const sftp_reply& reply);
+};
+
+// the same walk as a single remote `find -printf` on an exec channel, one command instead of
+// a request per directory. output is depth first, so prune is applied to the stream: entries
+// below a pruned directory are dropped as they arrive (find still visits them)
+class FindWalker {
+public:
+	FindWalker(LIBSSH2_SESSION* _session, libssh2_socket_t _sock, const walk_fn& _onEntry, const walk_options& _options);
+
+	// RES_OK, RES_FAILED if find reported errors, RES_CHANNEL_FAILED if exec was refused
+	// and RES_EXEC_UNSUPPORTED if the remote find has no -printf (or there is no find)
+	MINSFTP_RES Run(const std::string& root);
+	size_t Entries() const;
+
+private:
+	LIBSSH2_SESSION* session{};
+	libssh2_socket_t sock{ LIBSSH2_INVALID_SOCKET };
+	walk_fn onEntry{};
+	walk_options options{};
+
+	size_t entries{};
+	bool stopped{ false };
+	std::string prunedDir{}; // last pruned directory, its subtree follows it directly
+
+	bool ParseRecord(const std::string& root, const char* record, size_t len);
+};
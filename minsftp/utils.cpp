@@ -1,10 +1,17 @@
 #include "utils.h"
+#include "log.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
 
 UTILS_RES utils::ReadFile(const char* filePath, PFILE_DATA data) {
 	std::ifstream fs(filePath, std::ios::binary);
 
 	if (!fs.is_open()) {
-		fprintf(stderr, "failed to open ifstream to: '%s'\n", filePath);
+		MINSFTP_ERROR("failed to open ifstream to: '%s'", filePath);
 		return UTILS_FAILED;
 	}
 
@@ -15,7 +22,7 @@ UTILS_RES utils::ReadFile(const char* filePath, PFILE_DATA data) {
 
 	// Check for any stream errors
 	if (fs.bad()) {
-		fprintf(stderr, "Error occurred while reading file: '%s'\n", filePath);
+		MINSFTP_ERROR("Error occurred while reading file: '%s'", filePath);
 		return UTILS_FAILED;
 	}
 
@@ -26,4 +33,20 @@ void utils::NullTerminate(FILE_DATA& fileData) {
 	if (fileData.at(fileData.size() - 1) != '\0') {
 		fileData.push_back('\0');
 	}
+}
+
+bool utils::CpuHasAesNi() {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	int info[4]{};
+	__cpuid(info, 1);
+	return (info[2] & (1 << 25)) != 0;
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	unsigned int eax{}, ebx{}, ecx{}, edx{};
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		return false;
+	}
+	return (ecx & bit_AES) != 0;
+#else
+	return false;
+#endif
 }
\ No newline at end of file
@@ -17,4 +17,6 @@ enum UTILS_RES {
 namespace utils {
 	UTILS_RES ReadFile(const char* filePath, PFILE_DATA data);
 	void NullTerminate(FILE_DATA& fileData);
+	// true if the cpu has hardware aes instructions (AES-NI)
+	bool CpuHasAesNi();
 }
\ No newline at end of file